@@ -0,0 +1,254 @@
+// OBJ loading benchmark: compares the original getline/stringstream parser
+// against Mesh::readObj and reports throughput in MB/s. Also checks that frustum
+// culling's SSE and scalar kernels agree with a brute-force test.
+//
+// Usage: mesh_bench [file.obj] [repetitions] [threads]
+// Without a file, a synthetic mesh is written to the temp directory.
+#define NOMINMAX
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <cstring>
+#include <random>
+#include <glm/gtc/matrix_transform.hpp>
+#include "mesh.hpp"
+#include "frustumcull.hpp"
+#include "parallel.hpp"
+namespace fs = std::filesystem;
+
+// ========== Original loader (before), kept here for comparison ==========
+
+namespace legacy {
+
+int indexOfNumberLetter(std::string& str, int offset) {
+	for (int i = offset; i < int(str.length()); ++i) {
+		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
+	}
+	return (int)str.length();
+}
+int lastIndexOfNumberLetter(std::string& str) {
+	for (int i = int(str.length()) - 1; i >= 0; --i) {
+		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
+	}
+	return 0;
+}
+std::vector<std::string> split(const std::string &s, char delim) {
+	std::vector<std::string> elems;
+	std::stringstream ss(s);
+	std::string item;
+	while (getline(ss, item, delim)) {
+		elems.push_back(item);
+	}
+	return elems;
+}
+
+void readObj(const std::string& filename, std::vector<Mesh::Vertex>& vertices) {
+	std::ifstream file(filename);
+	std::vector<glm::vec3> raw_vertices;
+	std::vector<std::vector<unsigned int>> v_elements;
+	std::vector<glm::vec3> raw_normals;
+	std::vector<glm::vec2> raw_uvs;
+
+	std::string line;
+	while (getline(file, line)) {
+		if (line.substr(0, 2) == "v ") {
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			raw_vertices.push_back(glm::vec3(stof(values[0]), stof(values[1]), stof(values[2])));
+		}
+		else if (line.substr(0, 2) == "vt") {
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			raw_uvs.push_back(glm::vec2(stof(values[0]), stof(values[1])));
+		}
+		else if (line.substr(0, 2) == "vn") {
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			raw_normals.push_back(glm::vec3(stof(values[0]), stof(values[1]), stof(values[2])));
+		}
+		else if (line.substr(0, 2) == "f ") {
+			int index1 = indexOfNumberLetter(line, 2);
+			int index2 = lastIndexOfNumberLetter(line);
+			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
+			for (int i = 0; i < int(values.size()) - 2; i++) {
+				std::vector<std::string> v1 = split(values[0], '/');
+				std::vector<std::string> v2 = split(values[i+1], '/');
+				std::vector<std::string> v3 = split(values[i+2], '/');
+				v_elements.push_back({ (unsigned int)stoul(v1[0]) - 1, (unsigned int)stoul(v1[1]) - 1, (unsigned int)stoul(v1[2]) - 1 });
+				v_elements.push_back({ (unsigned int)stoul(v2[0]) - 1, (unsigned int)stoul(v2[1]) - 1, (unsigned int)stoul(v2[2]) - 1 });
+				v_elements.push_back({ (unsigned int)stoul(v3[0]) - 1, (unsigned int)stoul(v3[1]) - 1, (unsigned int)stoul(v3[2]) - 1 });
+			}
+		}
+	}
+
+	vertices = std::vector<Mesh::Vertex>(v_elements.size());
+	for (int i = 0; i < int(v_elements.size()); i += 3) {
+		for (int k = 0; k < 3; k++) {
+			vertices[i+k].pos = raw_vertices[v_elements[i+k][0]];
+			vertices[i+k].uv = raw_uvs[v_elements[i+k][1]];
+			vertices[i+k].vnorm = raw_normals[v_elements[i+k][2]];
+		}
+		glm::vec3 n = glm::cross(vertices[i+1].pos - vertices[i].pos, vertices[i+2].pos - vertices[i].pos);
+		glm::vec3 vn = (vertices[i].vnorm + vertices[i+1].vnorm + vertices[i+2].vnorm) * 0.33f;
+		if (glm::dot(n, vn) < 0) {
+			std::swap(vertices[i+1], vertices[i+2]);
+			n = -n;
+		}
+		for (int k = 0; k < 3; k++)
+			vertices[i+k].fnorm = n;
+	}
+}
+
+}
+
+// ========== Benchmark driver ==========
+
+// Write a UV sphere made of quads, roughly the size of a dense character mesh
+std::string writeSyntheticObj(int rings, int segments) {
+	fs::path path = fs::temp_directory_path() / "mesh_bench_sphere.obj";
+	std::ofstream file(path);
+	file.setf(std::ios::fixed);
+	file.precision(6);
+	const float pi = 3.14159265f;
+	for (int i = 0; i <= rings; i++)
+		for (int j = 0; j <= segments; j++) {
+			float th = pi * i / rings, ph = 2.0f * pi * j / segments;
+			file << "v " << std::sin(th) * std::cos(ph) << " " << std::cos(th) << " " << std::sin(th) * std::sin(ph) << "\n";
+		}
+	for (int i = 0; i <= rings; i++)
+		for (int j = 0; j <= segments; j++)
+			file << "vt " << (float)j / segments << " " << 1.0f - (float)i / rings << "\n";
+	for (int i = 0; i <= rings; i++)
+		for (int j = 0; j <= segments; j++) {
+			float th = pi * i / rings, ph = 2.0f * pi * j / segments;
+			file << "vn " << std::sin(th) * std::cos(ph) << " " << std::cos(th) << " " << std::sin(th) * std::sin(ph) << "\n";
+		}
+	int w = segments + 1;
+	for (int i = 0; i < rings; i++)
+		for (int j = 0; j < segments; j++) {
+			int a = i * w + j + 1, b = a + 1, c = a + w + 1, d = a + w;
+			file << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " "
+				<< c << "/" << c << "/" << c << " " << d << "/" << d << "/" << d << "\n";
+		}
+	return path.string();
+}
+
+// Run a loader several times and return the best time in seconds
+double timeBest(int reps, const std::function<void()>& fn) {
+	double best = std::numeric_limits<double>::max();
+	for (int i = 0; i < reps; i++) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		auto finish = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double>(finish - start).count());
+	}
+	return best;
+}
+
+// Cull random boxes against random perspective and orthographic frusta with both
+// kernels, and compare each result with testing all 8 corners against every plane.
+// Returns the number of boxes where any of the three disagree.
+size_t checkFrustumCulling(size_t& boxes, size_t& culled) {
+	std::mt19937 rng(1);
+	auto uniform = [&rng](float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+	const int FRUSTA = 200;
+	const size_t BOXES = 1001;	// Not a multiple of 4, to cover the padding
+	size_t mismatches = 0;
+	boxes = culled = 0;
+
+	CullBounds bounds;
+	bounds.resize(BOXES);
+	std::vector<uint8_t> simd, scalar;
+	for (int f = 0; f < FRUSTA; f++) {
+		glm::mat4 proj;
+		if (f % 2 == 0) {
+			float zNear = uniform(0.05f, 1.0f);
+			proj = glm::perspective(glm::radians(uniform(20.0f, 120.0f)), uniform(0.5f, 2.0f), zNear, zNear + uniform(1.0f, 200.0f));
+		} else {
+			float w = uniform(1.0f, 50.0f), h = uniform(1.0f, 50.0f), zNear = uniform(-50.0f, 10.0f);
+			proj = glm::ortho(-w, w, -h, h, zNear, zNear + uniform(1.0f, 200.0f));
+		}
+		glm::vec3 eye(uniform(-50.0f, 50.0f), uniform(-50.0f, 50.0f), uniform(-50.0f, 50.0f));
+		glm::vec3 target(uniform(-50.0f, 50.0f), uniform(-50.0f, 50.0f), uniform(-50.0f, 50.0f));
+		Frustum frustum(proj * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f)));
+
+		for (size_t i = 0; i < BOXES; i++) {
+			glm::vec3 center(uniform(-100.0f, 100.0f), uniform(-100.0f, 100.0f), uniform(-100.0f, 100.0f));
+			glm::vec3 extent(uniform(0.0f, 20.0f), uniform(0.0f, 20.0f), uniform(0.0f, 20.0f));
+			if (i % 10 == 0)
+				extent = glm::vec3(0.0f);	// Points
+			bounds.set(i, center - extent, center + extent);
+		}
+		bounds.cull(frustum, simd);
+		bounds.cullScalar(frustum, scalar);
+
+		for (size_t i = 0; i < BOXES; i++) {
+			// Outside when all 8 corners are outside one plane (summed like the kernels)
+			glm::vec3 lo = bounds.getMin(i), hi = bounds.getMax(i);
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; p++) {
+				const glm::vec4& pl = frustum.planes[p];
+				bool allOutside = true;
+				for (int c = 0; c < 8 && allOutside; c++) {
+					glm::vec3 corner(c & 1 ? hi.x : lo.x, c & 2 ? hi.y : lo.y, c & 4 ? hi.z : lo.z);
+					allOutside = (pl.x * corner.x + pl.y * corner.y) + (pl.z * corner.z + pl.w) < 0.0f;
+				}
+				outside = allOutside;
+			}
+			if (simd.size() != BOXES || scalar.size() != BOXES || simd[i] != scalar[i] || (simd[i] != 0) == outside)
+				mismatches++;
+			culled += outside;
+		}
+		boxes += BOXES;
+	}
+	return mismatches;
+}
+
+int main(int argc, char** argv) {
+	std::string filename = argc > 1 ? argv[1] : writeSyntheticObj(700, 700);
+	int reps = argc > 2 ? std::max(1, atoi(argv[2])) : 3;
+	unsigned int threads = argc > 3 ? (unsigned int)std::max(1, atoi(argv[3])) : hardwareThreads();
+	double mb = fs::file_size(filename) / (1024.0 * 1024.0);
+	std::cout << "File: " << filename << " (" << mb << " MB)" << std::endl;
+
+	std::vector<Mesh::Vertex> before, after, afterParallel;
+	glm::vec3 minBB, maxBB;
+	double tBefore = timeBest(reps, [&]() { legacy::readObj(filename, before); });
+	Mesh::setLoadThreads(1);
+	double tAfter = timeBest(reps, [&]() { Mesh::readObj(filename, after, minBB, maxBB); });
+	Mesh::setLoadThreads(threads);
+	double tParallel = timeBest(reps, [&]() { Mesh::readObj(filename, afterParallel, minBB, maxBB); });
+
+	// Make sure both loaders agree
+	size_t mismatches = before.size() == after.size() ? 0 : before.size() + after.size();
+	if (afterParallel.size() != after.size() ||
+		memcmp(afterParallel.data(), after.data(), after.size() * sizeof(Mesh::Vertex)) != 0)
+		mismatches++;
+	for (size_t i = 0; mismatches == 0 && i < after.size(); i++) {
+		if (glm::any(glm::greaterThan(glm::abs(before[i].pos - after[i].pos), glm::vec3(1e-5f))) ||
+			glm::any(glm::greaterThan(glm::abs(before[i].vnorm - after[i].vnorm), glm::vec3(1e-5f))) ||
+			glm::any(glm::greaterThan(glm::abs(before[i].uv - after[i].uv), glm::vec2(1e-5f))))
+			mismatches++;
+	}
+
+	std::cout << "Vertices:  " << after.size() << (mismatches ? " (MISMATCH)" : " (outputs match)") << std::endl;
+	std::cout << "Before:    " << tBefore * 1000.0 << " ms, " << mb / tBefore << " MB/s" << std::endl;
+	std::cout << "After:     " << tAfter * 1000.0 << " ms, " << mb / tAfter << " MB/s" << std::endl;
+	std::cout << "Parallel:  " << tParallel * 1000.0 << " ms, " << mb / tParallel << " MB/s ("
+		<< threads << " threads)" << std::endl;
+	std::cout << "Speedup:   " << tBefore / tAfter << "x serial, " << tBefore / tParallel << "x parallel" << std::endl;
+
+	size_t boxes, culled;
+	size_t cullMismatches = checkFrustumCulling(boxes, culled);
+	std::cout << "Culling:   " << culled << " of " << boxes << " random boxes outside random frusta"
+		<< (cullMismatches ? " (MISMATCH)" : " (SSE, scalar and 8-corner tests match)") << std::endl;
+	return mismatches || cullMismatches ? 1 : 0;
+}
@@ -1,6 +1,6 @@
 #version 330
 
+// Only the depth is written (by the fixed-function stage, so early depth testing stays on)
 void main()
 {
-	gl_FragDepth = gl_FragCoord.z;  // set depth by z
 }
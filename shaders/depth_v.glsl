@@ -1,11 +1,21 @@
 #version 330
 
 layout(location = 0) in vec3 pos;  // Model-space position
+layout(location = 5) in mat4 modelMat;  // Model-to-world transform of the instance (5-8)
 
-uniform mat4 lightSpaceMat;  // Convert to light space (to generate depth map)
-uniform mat4 modelMat;       // Model-to-world transform matrix
+#include "frame_block.glsl"
+
+// Per-object data (GLState::ObjectData)
+layout (std140) uniform ObjectBlock {
+	vec3 posScale;       // Vertex decoding: bounding box extent (1 for float positions)
+	int objType;         // 0 for floor and 1 for model
+	vec3 posOffset;      // Bounding box minimum (0 for float positions)
+	bool octNormals;     // Normals are octahedral-encoded in .xy
+};
+
+uniform int cascade;  // Shadow cascade being drawn
 
 void main()
 {
-	gl_Position = lightSpaceMat * modelMat * vec4(pos, 1.0);
+	gl_Position = lightSpaceMats[cascade] * modelMat * vec4(posOffset + posScale * pos, 1.0);
 }
@@ -0,0 +1,53 @@
+#version 330
+
+// Offscreen scene targets (EdgeOutline)
+uniform sampler2D sceneColor;	// Shaded color
+uniform sampler2D sceneNormal;	// World-space normal (rgb)
+uniform sampler2D sceneDepth;	// Depth buffer
+uniform usampler2D sceneObjectId;	// Object ID + 1 (0 = background)
+
+uniform float lineWidth;		// Line width in pixels
+uniform vec2 depthRange;		// Near and far plane of the camera
+
+out vec3 outCol;	// Final pixel color
+
+// A neighbour is across an edge if it is farther by this fraction of the depth (per
+// pixel of distance), if its normal turns by more than acos(NORMAL_THRESHOLD), or if
+// it belongs to another object
+const float DEPTH_THRESHOLD = 0.01;
+const float NORMAL_THRESHOLD = 0.8;
+
+const ivec2 OFFSETS[8] = ivec2[8](ivec2(-1, -1), ivec2(0, -1), ivec2(1, -1), ivec2(-1, 0),
+	ivec2(1, 0), ivec2(-1, 1), ivec2(0, 1), ivec2(1, 1));
+
+// Eye-space distance of a depth buffer value
+float linearDepth(float d) {
+	float zNear = depthRange.x, zFar = depthRange.y;
+	return 2.0 * zNear * zFar / (zFar + zNear - (d * 2.0 - 1.0) * (zFar - zNear));
+}
+
+void main()
+{
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	ivec2 maxP = textureSize(sceneDepth, 0) - 1;
+	float depth = texelFetch(sceneDepth, p, 0).r;
+	uint objectId = texelFetch(sceneObjectId, p, 0).r;
+	float z = linearDepth(depth);
+	vec3 normal = texelFetch(sceneNormal, p, 0).rgb * 2.0 - 1.0;
+	gl_FragDepth = depth;
+
+	// Look lineWidth pixels away in 8 directions; only the nearer side of an edge draws
+	// the line, so it is lineWidth wide and does not spill onto the background (which
+	// is never nearer and can skip the search)
+	int r = max(int(lineWidth + 0.5), 1);
+	bool edge = false;
+	for (int i = 0; i < 8 && !edge && depth < 1.0; i++) {
+		ivec2 q = clamp(p + OFFSETS[i] * r, ivec2(0), maxP);
+		float zq = linearDepth(texelFetch(sceneDepth, q, 0).r);
+		if (zq < z)
+			continue;
+		edge = zq - z > DEPTH_THRESHOLD * r * z || texelFetch(sceneObjectId, q, 0).r != objectId ||
+			dot(texelFetch(sceneNormal, q, 0).rgb * 2.0 - 1.0, normal) < NORMAL_THRESHOLD;
+	}
+	outCol = edge ? vec3(0.0) : texelFetch(sceneColor, p, 0).rgb;
+}
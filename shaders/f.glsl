@@ -1,95 +1,125 @@
 #version 330
 
-const int SHADINGMODE_NORMALS = 0;		// Show normals as colors
-const int SHADINGMODE_CEL = 1;			// Cel shading + illumination
-const int SHADINGMODE_PHONG = 2;
-const int SHADINGMODE_NONE = 3;
+// Features are compiled in (see GLState::getProgram): SHADING_MODE, NORMALS_MODE,
+// TINT_MODE, OCCLUSION_MODE, SPECULAR_MODE, TEXTURE_MODE and CONTOUR_MODE take the
+// values below, and FLOOR is defined for the floor
+#define SHADINGMODE_NORMALS 0		// Show normals as colors
+#define SHADINGMODE_CEL 1			// Cel shading + illumination
+#define SHADINGMODE_PHONG 2
+#define SHADINGMODE_NONE 3
 
-const int LIGHTTYPE_POINT = 0;			// Point light
-const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
+#define TINTMODE_SSS 0
+#define TINTMODE_CONST 1
 
-const int TINTMODE_SSS = 0;
-const int TINTMODE_CONST = 1;
+#define OCCLUSION_ON 0
+#define OCCLUSION_OFF 1
 
-const int OCCLUSION_ON = 0;
-const int OCCLUSION_OFF = 1;
+#define SPECULAR_ON 0
+#define SPECULAR_OFF 1
 
-const int SPECULAR_ON = 0;
-const int SPECULAR_OFF = 1;
+#define TEXTUREMODE_TEX 0
+#define TEXTUREMODE_CONST 1
 
-const int TEXTUREMODE_TEX = 0;
-const int TEXTUREMODE_CONST = 1;
+#define CONTOUR_ON 0
+#define CONTOUR_OFF 1
 
-const int CONTOUR_ON = 0;
-const int CONTOUR_OFF = 1;
-
-const int OBJTYPE_FLOOR = 0;
-const int OBJTYPE_MODEL = 1;
+const int LIGHTTYPE_POINT = 0;			// Point light
+const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
 
 // Textures
 uniform sampler2D texModelColor; // Model color texture
 uniform sampler2D texModelSss; 	 // Model tint texture
 uniform sampler2D texModelNrm; 	 // Model normal texture
 uniform sampler2D texModelIlm; 	 // Special Texture
-uniform sampler2D shadowMap;     // Shadow map
+uniform sampler2DArrayShadow shadowMap;  // Shadow map, one layer per cascade (compares depths)
 
 smooth in vec3 fragPos;		    // Interpolated position in world-space
 smooth in vec3 fragNorm;	    // Interpolated normal in world-space
+flat in int fragObjectId;       // Index of the instance in the scene
+#ifndef FLOOR
 smooth in vec2 fragUV;          // Interpolated texture coordinates
-smooth in vec4 lightFragPos;    // Fragment position in light space
 smooth in float isOutline;   
+#endif
+
+layout (location = 0) out vec3 outCol;	        // Final pixel color
+layout (location = 1) out vec3 outNormal;      // Normal for screen-space edges (EdgeOutline)
+layout (location = 2) out uint outObjectId;    // Object ID + 1 for screen-space edges (0 = background)
 
-out vec3 outCol;	         // Final pixel color
+// Lights: two texels of the light data per light (Light::LightData); the lights of each
+// cluster of the view frustum are listed in lightIndices (see LightClusters)
+uniform samplerBuffer lightData;
+uniform usamplerBuffer lightGrid;     // Offset into lightIndices and count of each cluster
+uniform usamplerBuffer lightIndices;  // The global lights, then the lights of each cluster
 
 // Light information
 struct LightData {
-	bool enabled;	// Whether the light is on
 	int type;		// Type of light (0 = point, 1 = directional)
 	vec3 pos;		// World-space position/direction of light source
 	vec3 color;		// Color of light
+	float range;	// Distance where a point light fades out (0 = everywhere)
+};
+
+LightData fetchLight(int index) {
+	vec4 posType = texelFetch(lightData, 2 * index);
+	vec4 colorRange = texelFetch(lightData, 2 * index + 1);
+	return LightData(int(posType.w), posType.xyz, colorRange.rgb, colorRange.a);
+}
+
+#include "frame_block.glsl"
+
+// Per-object data (GLState::ObjectData)
+layout (std140) uniform ObjectBlock {
+	vec3 posScale;       // Vertex decoding: bounding box extent (1 for float positions)
+	int objType;         // 0 for floor and 1 for model
+	vec3 posOffset;      // Bounding box minimum (0 for float positions)
+	bool octNormals;     // Normals are octahedral-encoded in .xy
 };
 
-// Array of lights
-const int MAX_LIGHTS = 1;
-layout (std140) uniform LightBlock {
-	LightData lights [MAX_LIGHTS];
+// Material properties (GLState::MaterialData)
+layout (std140) uniform MaterialBlock {
+	vec3 floorColor;			// Object color
+	float floorAmbStr;			// Ambient strength
+	float floorDiffStr;			// Diffuse strength
+	float floorSpecStr;			// Specular strength
+	float floorSpecExp;			// Specular exponent
+	vec3 modelColor;			// Object color
+	float modelAmbStr;			// Ambient strength
+	float modelDiffStr;			// Diffuse strength
+	float modelSpecStr;			// Specular strength
+	float modelSpecExp;			// Specular exponent
 };
 
-uniform int shadingMode;		// Which shading mode
-uniform int tintMode;
-uniform int occlusionMode;
-uniform int specularMode;
-uniform int textureMode;
-uniform int contourMode;
-uniform int objType;            // 0 for floor and 1 for model
-uniform vec3 camPos;			// World-space camera position
-
-uniform vec3 floorColor;			// Object color
-uniform float floorAmbStr;			// Ambient strength
-uniform float floorDiffStr;			// Diffuse strength
-uniform float floorSpecStr;			// Specular strength
-uniform float floorSpecExp;			// Specular exponent
-uniform vec3  modelColor;			    // Object color
-uniform float modelAmbStr;			// Ambient strength
-uniform float modelDiffStr;			// Diffuse strength
-uniform float modelSpecStr;			// Specular strength
-uniform float modelSpecExp;			// Specular exponent
-
-float calculateShadow(vec4 light_frag_pos) {  // TODO: add other parameters if needed
+// Fraction of the fragment in the shadow of light 0, from 0 (lit) to 1
+float calculateShadow() {
+	// Pick the first cascade that reaches the fragment's view depth (gl_FragCoord.w is 1/w)
+	float viewDepth = 1.0 / gl_FragCoord.w;
+	int cascade = 0;
+	while (cascade < cascadeCount - 1 && viewDepth > cascadeFar[cascade])
+		cascade++;
+	if (viewDepth > cascadeFar[cascade])
+		return 0.0;
+
 	// Perspective divide
-	vec3 projCoords = light_frag_pos.xyz / light_frag_pos.w;
+	vec4 lightFragPos = lightSpaceMats[cascade] * vec4(fragPos, 1.0);
+	vec3 projCoords = lightFragPos.xyz / lightFragPos.w;
 	// Remap to [0.0, 1.0]
 	projCoords = projCoords * 0.5 + 0.5;
+	if (any(lessThan(projCoords, vec3(0.0))) || any(greaterThan(projCoords, vec3(1.0))))
+		return 0.0;
 
-	// TODO 4-3
-	// Decide whether a fragment is in shadow
-	// Read the depth from depth map, then compare it with the depth of the current fragment
-	float closestDepth = texture(shadowMap, projCoords.xy).x;
-
-	float depth = projCoords.z;
-
-	// return a binary representing whether there is shadow (0.0 or 1.0)
-	return depth > closestDepth ? 1.0 : 0.0;
+	// Percentage-closer filtering: each tap compares the fragment's depth with the 2x2
+	// nearest texels and returns the bilinearly weighted fraction that is lit
+	mat2 rotation = mat2(1.0);
+	if (shadowRotate) {
+		// Interleaved gradient noise turns the banding of a fixed pattern into fine noise
+		float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+		rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+	}
+	vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+	float lit = 0.0;
+	for (int i = 0; i < shadowTaps; i++)
+		lit += texture(shadowMap, vec4(projCoords.xy + rotation * shadowKernel[i] * texelSize, cascade, projCoords.z));
+	return 1.0 - lit / float(shadowTaps);
 }
 
 vec3 renderFloor() {
@@ -99,7 +129,7 @@ vec3 renderFloor() {
 	diffStr = floorDiffStr;
 	specStr = floorSpecStr;
 	specExp = floorSpecExp;
-	float shadow = calculateShadow(lightFragPos);        // TODO: add more parameters if necessary
+	float shadow = calculateShadow();
 	objColor -= 0.2 * shadow;
 	return objColor;
 }
@@ -109,83 +139,120 @@ vec3 renderMesh() {
 }
 
 void main() {
+	outNormal = normalize(fragNorm) * 0.5 + vec3(0.5);
+	outObjectId = uint(fragObjectId) + 1u;
 
-	if (shadingMode == SHADINGMODE_NORMALS) {
-		outCol = normalize(fragNorm) * 0.5 + vec3(0.5);
-		return;
-	}
+#if SHADING_MODE == SHADINGMODE_NORMALS
+	outCol = normalize(fragNorm) * 0.5 + vec3(0.5);
+#elif defined(FLOOR)
+	outCol = renderFloor();
+#else
 	if (isOutline != 0.0) {
 		outCol = vec3(0.0);
 		return;
 	}
-	else if (objType == OBJTYPE_FLOOR) {
-		outCol = renderFloor();
-		return;
-	}
 
 	float ambStr, diffStr, specStr, specExp;
 	vec3 objColor = vec3(1.0, 1.0, 1.0); 
 	
-	if (textureMode == TEXTUREMODE_CONST) {
-		objColor *= .9;
-	} else {
-		objColor *= texture(texModelColor, fragUV).rgb;
-	}
-	objColor *= contourMode == CONTOUR_OFF ? 1.0 : texture(texModelIlm, fragUV).a;
+#if TEXTURE_MODE == TEXTUREMODE_CONST
+	objColor *= .9;
+#else
+	objColor *= texture(texModelColor, fragUV).rgb;
+#endif
+#if CONTOUR_MODE == CONTOUR_ON
+	objColor *= texture(texModelIlm, fragUV).a;
+#endif
 	ambStr = modelAmbStr;
 	diffStr = modelDiffStr;
 	specStr = modelSpecStr;
 	specExp = modelSpecExp;
-	
-	for (int i = 0; i < MAX_LIGHTS; i++) {
-		if (lights[i].enabled) {
-			vec3 normal = normalize(fragNorm);
-
-			vec3 lightDir;
-			if (lights[i].type == LIGHTTYPE_POINT)
-				lightDir = normalize(lights[i].pos - fragPos);
-			else if (lights[i].type == LIGHTTYPE_DIRECTIONAL) {
-				lightDir = normalize(lights[i].pos);
-			}
+#if SHADING_MODE == SHADINGMODE_CEL || SHADING_MODE == SHADINGMODE_PHONG
+	float shadow = calculateShadow();
+	vec3 normal = normalize(fragNorm);
+	vec3 viewDir = normalize(camPos - fragPos);
+#endif
+#if SHADING_MODE == SHADINGMODE_CEL
+	// The first global light sets the tones (light or shaded side); the other lights add
+	// their color where they light the surface
+	vec4 ilm = texture(texModelIlm, fragUV);
+#if OCCLUSION_MODE == OCCLUSION_OFF
+	float diffuseThreshhold = .5;
+#else
+	float diffuseThreshhold = 1-ilm.g;
+#endif
+	float specularThreshhold = 1-ilm.b;
+	float shade = 1.0;				// 1 = shaded side
+	float highlight = 0.0;
+	vec3 added = vec3(0.0);
+#elif SHADING_MODE == SHADINGMODE_PHONG
+	outCol = vec3(0.0);
+#else
+	outCol = vec3(1.0);
+#endif
 
-			vec3 viewDir = normalize(camPos - fragPos);
-
-			if (shadingMode == SHADINGMODE_CEL) {
-				outCol = vec3(1.0);
-				vec4 ilm = texture(texModelIlm, fragUV);
-
-				float diffuse = dot(normal, lightDir);
-				vec3 reflectDir = -lightDir - 2 * dot(-lightDir, normal) * normal;
-				float specular = dot(viewDir, reflectDir);
-
-				float diffuseThreshhold = occlusionMode == OCCLUSION_OFF ? .5 : 1-ilm.g;
-				float specularThreshhold = 1-ilm.b;
-				
-				if (diffuse <= diffuseThreshhold) {
-					if (tintMode == TINTMODE_CONST) {
-						outCol *= .5;
-					} else {
-						outCol *= texture(texModelSss, fragUV).rgb;
-					}
-				}
-				if (specularMode == SPECULAR_ON && specular >= specularThreshhold) {
-					outCol += 0.2*ilm.r;
-				}
-			} 
-			else if (shadingMode == SHADINGMODE_PHONG) {
-				outCol = vec3(0.0);
-				float ambient = ambStr;
-				float diffuse = max(dot(normal, lightDir), 0.0) * diffStr;
-				vec3 reflectDir = -lightDir - 2 * dot(-lightDir, normal) * normal;
-				float specular = max(dot(viewDir, reflectDir), 0.0);
-				specular = pow(dot(viewDir, reflectDir), specExp) * specStr;
-				outCol += (ambient + diffuse + specular) * lights[i].color;
-			}
-			else if (shadingMode == SHADINGMODE_NONE) {
-				outCol = vec3(1.0);
+#if SHADING_MODE == SHADINGMODE_CEL || SHADING_MODE == SHADINGMODE_PHONG
+	// The global lights, then those of the fragment's cluster
+	ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy * clusterScale.xy),
+		int(log(1.0 / gl_FragCoord.w) * clusterScale.z + clusterScale.w));
+	cluster = clamp(cluster, ivec3(0), clusterCount - 1);
+	uvec2 clusterLights = texelFetch(lightGrid, (cluster.z * clusterCount.y + cluster.y) * clusterCount.x + cluster.x).xy;
+	int lightCount = globalLights + int(clusterLights.y);
+	for (int i = 0; i < lightCount; i++) {
+		int index = int(texelFetch(lightIndices, i < globalLights ? i : int(clusterLights.x) + i - globalLights).x);
+		LightData light = fetchLight(index);
+
+		vec3 lightDir;
+		float attenuation = 1.0;
+		if (light.type == LIGHTTYPE_POINT) {
+			vec3 toLight = light.pos - fragPos;
+			lightDir = normalize(toLight);
+			if (light.range > 0.0) {
+				// Fades out smoothly to nothing at the range
+				float d = length(toLight) / light.range;
+				attenuation = clamp(1.0 - d * d, 0.0, 1.0);
+				attenuation *= attenuation;
 			}
 		}
+		else
+			lightDir = normalize(light.pos);
+		float lightShadow = index == shadowLight ? shadow : 0.0;
+
+#if SHADING_MODE == SHADINGMODE_CEL
+		float diffuse = dot(normal, lightDir);
+		if (i == 0 && globalLights > 0) {
+			vec3 reflectDir = -lightDir - 2 * dot(-lightDir, normal) * normal;
+			float specular = dot(viewDir, reflectDir);
+			// Cast shadows tint like the shaded side, keeping their filtered edges
+			shade = diffuse <= diffuseThreshhold ? 1.0 : lightShadow;
+			if (specular >= specularThreshhold)
+				highlight = 1.0 - lightShadow;
+		}
+		else if (diffuse > diffuseThreshhold)
+			added += light.color * attenuation * (1.0 - lightShadow);
+#else
+		float ambient = ambStr;
+		float diffuse = max(dot(normal, lightDir), 0.0) * diffStr;
+		vec3 reflectDir = -lightDir - 2 * dot(-lightDir, normal) * normal;
+		float specular = max(dot(viewDir, reflectDir), 0.0);
+		specular = pow(specular, specExp) * specStr;
+		outCol += (ambient + (diffuse + specular) * (1.0 - lightShadow)) * light.color * attenuation;
+#endif
 	}
+#endif
+
+#if SHADING_MODE == SHADINGMODE_CEL
+#if TINT_MODE == TINTMODE_CONST
+	outCol = vec3(mix(1.0, .5, shade));
+#else
+	outCol = mix(vec3(1.0), texture(texModelSss, fragUV).rgb, shade);
+#endif
+#if SPECULAR_MODE == SPECULAR_ON
+	outCol += 0.2*ilm.r * highlight;
+#endif
+	outCol += added;
+#endif
 	outCol *= objColor;
+#endif
 	
 }
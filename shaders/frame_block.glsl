@@ -0,0 +1,18 @@
+// Per-frame data (GLState::FrameData), shared by the shaders that #include this file
+const int MAX_CASCADES = 4;
+const int MAX_SHADOW_TAPS = 16;
+layout (std140) uniform FrameBlock {
+	mat4 viewProjMat;	 // World-to-clip transform matrix
+	mat4 lightSpaceMats[MAX_CASCADES];  // World-to-light matrix of each shadow cascade
+	vec4 cascadeFar;     // View depth where each cascade ends
+	vec3 camPos;         // Camera position
+	float outline;       // Outline width (0 = no outline)
+	int cascadeCount;    // Shadow cascades in use
+	int shadowTaps;      // Shadow map samples per fragment
+	bool shadowRotate;   // Rotate the sample pattern per pixel
+	vec2 shadowKernel[MAX_SHADOW_TAPS];  // Sample offsets in shadow map texels
+	vec4 clusterScale;   // Light clusters per pixel (.xy); log(view depth) * z + w is the depth slice
+	ivec3 clusterCount;  // Light clusters along x, y and depth
+	int globalLights;    // Lights reaching every fragment, first in lightIndices
+	int shadowLight;     // Light data entry of the light casting the shadows (-1 = none)
+};
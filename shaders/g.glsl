@@ -1,22 +1,34 @@
 #version 330 core
+#ifdef ADJACENCY
+layout (triangles_adjacency) in;
+layout (triangle_strip, max_vertices = 15) out;
+#else
 layout (triangles) in;
+#ifdef OUTLINE
 layout (triangle_strip, max_vertices = 6) out;
+#else
+layout (triangle_strip, max_vertices = 3) out;
+#endif
+#endif
 
-const int OBJTYPE_FLOOR = 0;
-const int OBJTYPE_MODEL = 1;
+// Features are compiled in (see GLState::getProgram): NORMALS_MODE takes the values
+// below, and OUTLINE is defined to extrude a back-facing outline shell. With ADJACENCY
+// (OUTLINE and GL_TRIANGLES_ADJACENCY input) only the silhouette edges are extruded.
+#define NORMALSMODE_INTERPOLATE 0
+#define NORMALSMODE_FACE 1
 
-const int NORMALSMODE_INTERPOLATE = 0;
-const int NORMALSMODE_FACE = 1;
-
-uniform int objType;            // 0 for floor and 1 for model
-uniform int normalsMode;
+#if NORMALS_MODE == NORMALSMODE_FACE
+#define geoNorm geoFNorm
+#else
+#define geoNorm geoVNorm
+#endif
 
 smooth in vec3 geoPos[];	    // Interpolated position in world-space
 smooth in vec3 geoFNorm[];	    // Interpolated normal in world-space
 smooth in vec3 geoVNorm[];	    // Interpolated normal in world-space
 smooth in vec3 geoColor[];	    // Interpolated color (for Gouraud shading)
 smooth in vec2 geoUV[];         // Interpolated texture coordinates
-smooth in vec4 lightGeoPos[];   // Geoment position in light space
+flat in int geoObjectId[];      // Index of the instance in the scene
 
 smooth out vec3 fragPos;		    // Interpolated position in world-space
 smooth out vec3 fragNorm;	    // Interpolated normal in world-space
@@ -24,40 +36,100 @@ smooth out vec2 fragUV;          // Interpolated texture coordinates
 smooth out vec3 tanLightPos;     // Light position in tangent space
 smooth out vec3 tanViewer;       // Viewing vector in tangent space
 smooth out vec3 tanFragPos;      // Fragment position in tangent space
-smooth out vec4 lightFragPos;    // Fragment position in light space
-out float isOutline;
+smooth out float isOutline;
+flat out int fragObjectId;       // Index of the instance in the scene
+
+#include "frame_block.glsl"
+
+// Per-object data (GLState::ObjectData)
+layout (std140) uniform ObjectBlock {
+	vec3 posScale;       // Vertex decoding: bounding box extent (1 for float positions)
+	int objType;         // 0 for floor and 1 for model
+	vec3 posOffset;      // Bounding box minimum (0 for float positions)
+	bool octNormals;     // Normals are octahedral-encoded in .xy
+};
+
+#ifdef ADJACENCY
+// Triangle corners are inputs 0, 2 and 4; input 2e+1 is across the edge from corner 2e
+const int CORNER[3] = int[3](0, 2, 4);
+
+// Whether triangle (i, j, k) is counter-clockwise seen from the camera
+bool facesCamera(int i, int j, int k) {
+    vec3 n = cross(geoPos[j] - geoPos[i], geoPos[k] - geoPos[i]);
+    return dot(n, camPos - geoPos[i]) > 0.0;
+}
+
+// Emit one end of an outline fin, extruded along the vertex normal
+void emitFinVertex(int i, bool extruded) {
+    float width = extruded ? outline : 0.0;
+    gl_Position = gl_in[i].gl_Position + viewProjMat * vec4(geoVNorm[i], 0.0) * width;
+    fragPos = geoPos[i] + geoVNorm[i] * width;
+    fragNorm = geoNorm[i];
+    fragUV = geoUV[i];
+    fragObjectId = geoObjectId[i];
+    EmitVertex();
+}
 
-uniform float outline;
-uniform mat4 viewProjMat;
+// Emit a quad extruded from edge (a, b), wound to face the camera so culling keeps it
+void emitFin(int a, int b) {
+    vec4 p0 = gl_in[a].gl_Position;
+    vec4 p1 = gl_in[b].gl_Position;
+    vec4 p2 = p0 + viewProjMat * vec4(geoVNorm[a], 0.0) * outline;
+    vec2 e1 = p1.xy / p1.w - p0.xy / p0.w;
+    vec2 e2 = p2.xy / p2.w - p0.xy / p0.w;
+    if (e1.x * e2.y - e1.y * e2.x < 0.0) {
+        int t = a; a = b; b = t;
+    }
+    emitFinVertex(a, false);
+    emitFinVertex(b, false);
+    emitFinVertex(a, true);
+    emitFinVertex(b, true);
+    EndPrimitive();
+}
+#endif
 
 void main() {
     
     isOutline = 0.0;
-    for (int i = 0; i < 3; i++) {
+    for (int c = 0; c < 3; c++) {
+#ifdef ADJACENCY
+        int i = CORNER[c];
+#else
+        int i = c;
+#endif
         gl_Position = gl_in[i].gl_Position;
         fragPos = geoPos[i];
-        fragNorm = normalsMode == NORMALSMODE_FACE ? geoFNorm[i] : geoVNorm[i];
+        fragNorm = geoNorm[i];
         fragUV = geoUV[i];
-        lightFragPos = lightGeoPos[i];
+        fragObjectId = geoObjectId[i];
         EmitVertex();
     }
     EndPrimitive();
-    
-    if (objType == OBJTYPE_FLOOR || outline == 0.0) {
-        return;
-    }
 
+#if defined(ADJACENCY)
+    // Silhouette edges: this triangle faces the camera and its neighbour does not
+    // (a border edge has the triangle's own third vertex, so it always qualifies)
+    isOutline = 1.0;
+    if (facesCamera(0, 2, 4)) {
+        for (int e = 0; e < 3; e++) {
+            int a = CORNER[e], b = CORNER[(e + 1) % 3];
+            if (!facesCamera(a, a + 1, b))
+                emitFin(a, b);
+        }
+    }
+#elif defined(OUTLINE)
     isOutline = 1.0;
     vec4 viewNorm;
     for (int i = 2; i >= 0; i--) {
         viewNorm = viewProjMat * vec4(geoVNorm[i], 0.0) * outline;
         gl_Position = gl_in[i].gl_Position + viewNorm;
         fragPos = geoPos[i] + geoVNorm[i] * outline;
-        fragNorm = normalsMode == NORMALSMODE_FACE ? geoFNorm[i] : geoVNorm[i];
+        fragNorm = geoNorm[i];
         fragUV = geoUV[i];
-        lightFragPos = lightGeoPos[i];
+        fragObjectId = geoObjectId[i];
         EmitVertex();
     }
 
     EndPrimitive();
+#endif
 }  
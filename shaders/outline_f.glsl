@@ -0,0 +1,8 @@
+#version 330
+
+out vec3 outCol;	// Final pixel color
+
+void main()
+{
+	outCol = vec3(0.0);
+}
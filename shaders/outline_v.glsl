@@ -0,0 +1,25 @@
+#version 330
+
+layout(location = 0) in vec3 pos;			// Model-space position
+layout(location = 4) in vec4 outlineNorm;	// Model-space outline normal (xyz) and thickness (w)
+layout(location = 5) in mat4 modelMat;		// Model-to-world transform of the instance (5-8)
+
+#include "frame_block.glsl"
+
+// Per-object data (GLState::ObjectData)
+layout (std140) uniform ObjectBlock {
+	vec3 posScale;       // Vertex decoding: bounding box extent (1 for float positions)
+	int objType;         // 0 for floor and 1 for model
+	vec3 posOffset;      // Bounding box minimum (0 for float positions)
+	bool octNormals;     // Normals are octahedral-encoded in .xy
+};
+
+void main()
+{
+	// Push the vertex out along the normal smoothed across hard edges, so the hull stays closed
+	vec3 worldPos = vec3(modelMat * vec4(posOffset + posScale * pos, 1.0));
+	vec3 worldNorm = vec3(modelMat * vec4(outlineNorm.xyz, 0.0));
+	if (dot(worldNorm, worldNorm) > 0.0)
+		worldNorm = normalize(worldNorm);
+	gl_Position = viewProjMat * vec4(worldPos + worldNorm * outline * outlineNorm.w, 1.0);
+}
@@ -4,56 +4,59 @@ layout(location = 0) in vec3 pos;			// Model-space position
 layout(location = 1) in vec3 fnorm;		    // Model-space face normal
 layout(location = 2) in vec3 vnorm;		    // Model-space face normal
 layout(location = 3) in vec2 uv;	        // Texture coordinates
+layout(location = 5) in mat4 modelMat;		// Model-to-world transform of the instance (5-8)
+layout(location = 9) in int objectId;		// Index of the instance in the scene
+
+// Features are compiled in (see GLState::getProgram): the floor is drawn without the
+// geometry shader, so its outputs go straight to the fragment shader
+#ifdef FLOOR
+#define NORMALSMODE_INTERPOLATE 0
+#define NORMALSMODE_FACE 1
+#define geoPos fragPos
+#define geoObjectId fragObjectId
+#if NORMALS_MODE == NORMALSMODE_FACE
+#define geoFNorm fragNorm
+#else
+#define geoVNorm fragNorm
+#endif
+#endif
 
 smooth out vec3 geoPos;	    // Interpolated position in world-space
 smooth out vec3 geoFNorm;	    // Interpolated normal in world-space
 smooth out vec3 geoVNorm;	    // Interpolated normal in world-space
 smooth out vec2 geoUV;         // Interpolated texture coordinates
-smooth out vec4 lightGeoPos;   // Geoment position in light space
-
-// Light information
-struct LightData {
-	bool enabled;
-	int type;
-	vec3 pos;
-	vec3 color;
-};
+flat out int geoObjectId;      // Index of the instance in the scene
+
+#include "frame_block.glsl"
 
-// Array of lights
-const int MAX_LIGHTS = 1;
-layout (std140) uniform LightBlock {
-	LightData lights [MAX_LIGHTS];
+// Per-object data (GLState::ObjectData)
+layout (std140) uniform ObjectBlock {
+	vec3 posScale;       // Vertex decoding: bounding box extent (1 for float positions)
+	int objType;         // 0 for floor and 1 for model
+	vec3 posOffset;      // Bounding box minimum (0 for float positions)
+	bool octNormals;     // Normals are octahedral-encoded in .xy
 };
 
-uniform mat4 modelMat;		 // Model-to-world transform matrix
-uniform mat4 lightSpaceMat;  // World-to-light matrix location
-uniform int objType;         // 0 for floor and 1 for cube
-uniform mat4 viewProjMat;	 // World-to-clip transform matrix
-uniform int shadingMode;     // Cel vs. colored normals
-uniform vec3 camPos;         // Camera position
-
-uniform vec3 floorColor;
-uniform float floorAmbStr;
-uniform float floorDiffStr;
-uniform float floorSpecStr;
-uniform float floorSpecExp;
-uniform vec3 cubeColor;
-uniform float cubeAmbStr;
-uniform float cubeDiffStr;
-uniform float cubeSpecStr;
-uniform float cubeSpecExp;
+// Unfold an octahedral-encoded direction
+vec3 decodeNormal(vec3 n) {
+	if (!octNormals)
+		return n;
+	vec3 v = vec3(n.xy, 1.0 - abs(n.x) - abs(n.y));
+	float t = max(-v.z, 0.0);
+	v.x += v.x >= 0.0 ? -t : t;
+	v.y += v.y >= 0.0 ? -t : t;
+	return normalize(v);
+}
 
 void main() {
 	// Get world-space position and normal
-	geoPos = vec3(modelMat * vec4(pos, 1.0));
-	geoFNorm = vec3(modelMat * vec4(fnorm, 0.0));
-	geoVNorm = normalize(vec3(modelMat * vec4(vnorm, 0.0)));
-
-	// Get light-space position, pass to geoment shader
-	lightGeoPos = lightSpaceMat * vec4(geoPos, 1.0);
+	geoPos = vec3(modelMat * vec4(posOffset + posScale * pos, 1.0));
+	geoFNorm = vec3(modelMat * vec4(decodeNormal(fnorm), 0.0));
+	geoVNorm = normalize(vec3(modelMat * vec4(decodeNormal(vnorm), 0.0)));
 
 	// Pass the interpolated texture coordinates to the geometry shader
 	geoUV = uv;
+	geoObjectId = objectId;
 
 	// Output clip-space position
 	gl_Position = viewProjMat * vec4(geoPos, 1.0);
@@ -0,0 +1,99 @@
+#include "edgeoutline.hpp"
+#include <stdexcept>
+#include "glcache.hpp"
+#include "programcache.hpp"
+
+void EdgeOutline::begin(int w, int h) {
+	if (!fbo || w != width || h != height)
+		create(w, h);
+	GLCache::bindFramebuffer(fbo);
+
+	// Background: far depth, object ID 0
+	const GLfloat noNormal[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const GLuint noObject[4] = { 0, 0, 0, 0 };
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearBufferfv(GL_COLOR, 1, noNormal);
+	glClearBufferuiv(GL_COLOR, 2, noObject);
+}
+
+void EdgeOutline::apply(float zNear, float zFar) {
+	GLCache::bindFramebuffer(0);
+	GLCache::bindTexture(COLOR_UNIT, colorTex);
+	GLCache::bindTexture(NORMAL_UNIT, normalTex);
+	GLCache::bindTexture(DEPTH_UNIT, depthTex);
+	GLCache::bindTexture(OBJECT_UNIT, objectTex);
+	GLCache::useProgram(program);
+	glUniform1f(lineWidthLoc, lineWidth);
+	glUniform2f(depthRangeLoc, zNear, zFar);
+
+	// The filter writes every pixel's scene depth, so the test must always pass
+	glDepthFunc(GL_ALWAYS);
+	GLCache::bindVertexArray(vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glDepthFunc(GL_LESS);
+}
+
+// Create the targets, and the filter program the first time
+void EdgeOutline::create(int w, int h) {
+	if (!program) {
+		program = buildProgram({
+			{ GL_VERTEX_SHADER, "shaders/edge_v.glsl" },
+			{ GL_FRAGMENT_SHADER, "shaders/edge_f.glsl" } });
+		GLCache::useProgram(program);
+		glUniform1i(glGetUniformLocation(program, "sceneColor"), COLOR_UNIT);
+		glUniform1i(glGetUniformLocation(program, "sceneNormal"), NORMAL_UNIT);
+		glUniform1i(glGetUniformLocation(program, "sceneDepth"), DEPTH_UNIT);
+		glUniform1i(glGetUniformLocation(program, "sceneObjectId"), OBJECT_UNIT);
+		lineWidthLoc = glGetUniformLocation(program, "lineWidth");
+		depthRangeLoc = glGetUniformLocation(program, "depthRange");
+		glGenVertexArrays(1, &vao);
+	}
+
+	releaseTargets();
+	width = w;
+	height = h;
+
+	// Nearest filtering: the filter reads exact texels
+	struct Target { GLuint* tex; GLuint unit; GLint internalFormat; GLenum format; GLenum type; };
+	const Target targets[] = {
+		{ &colorTex, COLOR_UNIT, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE },
+		{ &normalTex, NORMAL_UNIT, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE },
+		{ &depthTex, DEPTH_UNIT, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT },
+		{ &objectTex, OBJECT_UNIT, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT }
+	};
+	for (auto& t : targets) {
+		glGenTextures(1, t.tex);
+		GLCache::bindTexture(t.unit, *t.tex);
+		glTexImage2D(GL_TEXTURE_2D, 0, t.internalFormat, width, height, 0, t.format, t.type, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	glGenFramebuffers(1, &fbo);
+	GLCache::bindFramebuffer(fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTex, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalTex, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, objectTex, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTex, 0);
+	const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+	glDrawBuffers(3, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		throw std::runtime_error("Edge outline framebuffer is incomplete");
+}
+
+void EdgeOutline::releaseTargets() {
+	if (fbo) { GLCache::deleteFramebuffer(fbo); fbo = 0; }
+	if (colorTex) { GLCache::deleteTexture(colorTex); colorTex = 0; }
+	if (normalTex) { GLCache::deleteTexture(normalTex); normalTex = 0; }
+	if (objectTex) { GLCache::deleteTexture(objectTex); objectTex = 0; }
+	if (depthTex) { GLCache::deleteTexture(depthTex); depthTex = 0; }
+	width = height = 0;
+}
+
+void EdgeOutline::release() {
+	releaseTargets();
+	if (vao) { GLCache::deleteVertexArray(vao); vao = 0; }
+	if (program) { GLCache::deleteProgram(program); program = 0; }
+}
@@ -0,0 +1,60 @@
+#ifndef EDGEOUTLINE_HPP
+#define EDGEOUTLINE_HPP
+
+#include "gl_core_3_3.h"
+
+// Screen-space outline: the scene is rendered into an offscreen target with color,
+// normal, object ID and depth, and a full-screen pass draws lines where the depth,
+// normal or object changes. Its cost depends on the resolution, not on the triangles.
+//
+// f.glsl writes the world-space normal (scaled to [0, 1]) at location 1 and the object
+// ID + 1 (0 = background) at location 2, into a 32-bit integer target so that every
+// instance of a dense scene keeps its own ID.
+class EdgeOutline {
+public:
+	EdgeOutline() {}
+	~EdgeOutline() { release(); }
+	// Disallow copy, move, & assignment
+	EdgeOutline(const EdgeOutline& other) = delete;
+	EdgeOutline& operator=(const EdgeOutline& other) = delete;
+	EdgeOutline(EdgeOutline&& other) = delete;
+	EdgeOutline& operator=(EdgeOutline&& other) = delete;
+
+	// Render into the offscreen target from now on, (re)creating it at the given size,
+	// and clear it
+	void begin(int width, int height);
+	// Draw the scene with its edges into the default framebuffer, also copying the
+	// scene depth so that later draws are depth tested against it. zNear and zFar are
+	// those of the camera projection.
+	void apply(float zNear, float zFar);
+
+	// Width of the lines in pixels
+	void setLineWidth(float width) { lineWidth = width; }
+	float getLineWidth() const { return lineWidth; }
+
+	// Texture units of the offscreen targets (after those of the scene)
+	static const GLuint COLOR_UNIT = 5;
+	static const GLuint NORMAL_UNIT = 6;
+	static const GLuint DEPTH_UNIT = 7;
+	static const GLuint OBJECT_UNIT = 11;
+
+protected:
+	void create(int w, int h);
+	void releaseTargets();	// Release the framebuffer and its textures
+	void release();			// Release OpenGL resources
+
+	int width = 0, height = 0;	// Size of the targets
+	float lineWidth = 2.0f;
+
+	// OpenGL resources
+	GLuint fbo = 0;			// Offscreen framebuffer
+	GLuint colorTex = 0;	// Scene color
+	GLuint normalTex = 0;	// Normal
+	GLuint objectTex = 0;	// Object ID
+	GLuint depthTex = 0;	// Scene depth
+	GLuint vao = 0;			// Empty vertex array for the full-screen triangle
+	GLuint program = 0;		// Edge filter
+	GLint lineWidthLoc = -1, depthRangeLoc = -1;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "frustumcull.hpp"
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRUSTUMCULL_SSE
+#include <xmmintrin.h>
+#endif
+
+// Gribb & Hartmann: each plane is the sum or difference of the fourth row of the matrix
+// and one of the others
+Frustum::Frustum(const glm::mat4& viewProj) {
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++)
+		rows[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+	for (int i = 0; i < 3; i++) {
+		planes[2 * i] = rows[3] + rows[i];
+		planes[2 * i + 1] = rows[3] - rows[i];
+	}
+}
+
+void CullBounds::resize(size_t n) {
+	count = n;
+	size_t padded = (n + 3) & ~(size_t)3;
+	for (auto v : { &minX, &minY, &minZ, &maxX, &maxY, &maxZ })
+		v->resize(padded, 0.0f);
+}
+
+void CullBounds::set(size_t i, const glm::vec3& minBB, const glm::vec3& maxBB) {
+	minX[i] = minBB.x; minY[i] = minBB.y; minZ[i] = minBB.z;
+	maxX[i] = maxBB.x; maxY[i] = maxBB.y; maxZ[i] = maxBB.z;
+}
+
+// A box is outside a plane when its corner farthest along the plane normal is; which
+// corner that is depends only on the signs of the normal, so it is picked once per plane
+void CullBounds::cull(const Frustum& frustum, std::vector<uint8_t>& visible) const {
+#ifdef FRUSTUMCULL_SSE
+	visible.resize(minX.size());
+	const float* xs[6]; const float* ys[6]; const float* zs[6];
+	__m128 a[6], b[6], c[6], d[6];
+	for (int p = 0; p < 6; p++) {
+		const glm::vec4& pl = frustum.planes[p];
+		xs[p] = pl.x >= 0.0f ? maxX.data() : minX.data();
+		ys[p] = pl.y >= 0.0f ? maxY.data() : minY.data();
+		zs[p] = pl.z >= 0.0f ? maxZ.data() : minZ.data();
+		a[p] = _mm_set1_ps(pl.x);
+		b[p] = _mm_set1_ps(pl.y);
+		c[p] = _mm_set1_ps(pl.z);
+		d[p] = _mm_set1_ps(pl.w);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	for (size_t i = 0; i < minX.size(); i += 4) {
+		__m128 outside = zero;
+		for (int p = 0; p < 6; p++) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[p], _mm_loadu_ps(xs[p] + i)),
+				_mm_mul_ps(b[p], _mm_loadu_ps(ys[p] + i))),
+				_mm_add_ps(_mm_mul_ps(c[p], _mm_loadu_ps(zs[p] + i)), d[p]));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, zero));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; k++)
+			visible[i + k] = !((mask >> k) & 1);
+	}
+	visible.resize(count);	// Drop the padding
+#else
+	cullScalar(frustum, visible);
+#endif
+}
+
+// The distance is summed in the same order as the SSE kernel's, so both give the same result
+void CullBounds::cullScalar(const Frustum& frustum, std::vector<uint8_t>& visible) const {
+	visible.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; p++) {
+			const glm::vec4& pl = frustum.planes[p];
+			float x = pl.x >= 0.0f ? maxX[i] : minX[i];
+			float y = pl.y >= 0.0f ? maxY[i] : minY[i];
+			float z = pl.z >= 0.0f ? maxZ[i] : minZ[i];
+			outside = (pl.x * x + pl.y * y) + (pl.z * z + pl.w) < 0.0f;
+		}
+		visible[i] = !outside;
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef FRUSTUMCULL_HPP
+#define FRUSTUMCULL_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// The six planes of a view frustum, taken from a world-to-clip matrix (perspective or
+// orthographic). A point p is inside a plane when dot(plane.xyz, p) + plane.w >= 0.
+struct Frustum {
+	glm::vec4 planes[6];	// Left, right, bottom, top, near, far
+	explicit Frustum(const glm::mat4& viewProj);
+};
+
+// World-space bounding boxes of the scene's objects as a structure of arrays, tested
+// against a frustum four boxes at a time with SSE (or one at a time without it)
+class CullBounds {
+public:
+	// Set the number of boxes; new boxes are empty points at the origin
+	void resize(size_t count);
+	size_t size() const { return count; }
+	void set(size_t i, const glm::vec3& minBB, const glm::vec3& maxBB);
+	glm::vec3 getMin(size_t i) const { return glm::vec3(minX[i], minY[i], minZ[i]); }
+	glm::vec3 getMax(size_t i) const { return glm::vec3(maxX[i], maxY[i], maxZ[i]); }
+
+	// Set visible[i] to whether box i may be inside the frustum (boxes entirely outside one
+	// of its planes are culled; a few near the corners are kept)
+	void cull(const Frustum& frustum, std::vector<uint8_t>& visible) const;
+	// The same test one box at a time (what cull runs without SSE)
+	void cullScalar(const Frustum& frustum, std::vector<uint8_t>& visible) const;
+
+protected:
+	size_t count = 0;
+	// Bounds, padded with zeros to a multiple of 4
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+};
+
+#endif
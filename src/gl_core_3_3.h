@@ -924,6 +924,10 @@ typedef int  GLint;
 #define GL_UNIFORM_BUFFER 0x8A11
 #define GL_TEXTURE23 0x84D7
 #define GL_INTERLEAVED_ATTRIBS 0x8C8C
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_PROGRAM_BINARY_FORMATS 0x87FF
 
 typedef void  (GL_APIENTRY *PFN_glVertexAttribP4uiv)(GLuint index, GLenum type, GLboolean normalized, const GLuint * value);
 extern PFN_glVertexAttribP4uiv _glptr_glVertexAttribP4uiv;
@@ -2300,6 +2304,18 @@ extern PFN_glDetachShader _glptr_glDetachShader;
 typedef void  (GL_APIENTRY *PFN_glCullFace)(GLenum mode);
 extern PFN_glCullFace _glptr_glCullFace;
 #define glCullFace _glptr_glCullFace
+
+typedef void  (GL_APIENTRY *PFN_glGetProgramBinary)(GLuint program, GLsizei bufSize, GLsizei * length, GLenum * binaryFormat, void * binary);
+extern PFN_glGetProgramBinary _glptr_glGetProgramBinary;
+#define glGetProgramBinary _glptr_glGetProgramBinary
+
+typedef void  (GL_APIENTRY *PFN_glProgramBinary)(GLuint program, GLenum binaryFormat, const void * binary, GLsizei length);
+extern PFN_glProgramBinary _glptr_glProgramBinary;
+#define glProgramBinary _glptr_glProgramBinary
+
+typedef void  (GL_APIENTRY *PFN_glProgramParameteri)(GLuint program, GLenum pname, GLint value);
+extern PFN_glProgramParameteri _glptr_glProgramParameteri;
+#define glProgramParameteri _glptr_glProgramParameteri
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,194 @@
+#include "glcache.hpp"
+#include <iostream>
+
+// Static GLCache members (a new context has nothing bound)
+GLuint GLCache::program = 0;
+GLuint GLCache::vertexArray = 0;
+GLuint GLCache::arrayBuffer = 0;
+GLuint GLCache::elementBuffer = 0;
+GLuint GLCache::uniformBuffer = 0;
+GLCache::Range GLCache::uniformRanges[GLCache::MAX_UNIFORM_BINDINGS] = {};
+GLuint GLCache::activeUnit = 0;
+GLuint GLCache::textures[GLCache::MAX_TEXTURE_UNITS] = {};
+GLuint GLCache::framebuffer = 0;
+unsigned long GLCache::requests[GLCache::BIND_KIND_COUNT] = {};
+unsigned long GLCache::issued[GLCache::BIND_KIND_COUNT] = {};
+unsigned int GLCache::reportFrames = 0;
+unsigned int GLCache::frames = 0;
+
+// Names of the bind kinds in reports
+static const char* kindNames[] = {
+	"program", "vertex array", "buffer", "uniform range", "active unit", "texture", "framebuffer"
+};
+
+bool GLCache::request(BindKind kind, bool changed) {
+	requests[kind]++;
+	if (changed)
+		issued[kind]++;
+	return changed;
+}
+
+void GLCache::useProgram(GLuint prog) {
+	if (request(BIND_PROGRAM, prog != program)) {
+		glUseProgram(prog);
+		program = prog;
+	}
+}
+
+void GLCache::bindVertexArray(GLuint vao) {
+	if (request(BIND_VERTEX_ARRAY, vao != vertexArray)) {
+		glBindVertexArray(vao);
+		vertexArray = vao;
+		// The element buffer binding belongs to the vertex array
+		elementBuffer = UNKNOWN;
+	}
+}
+
+void GLCache::bindBuffer(GLenum target, GLuint buffer) {
+	GLuint* bound = nullptr;
+	switch (target) {
+	case GL_ARRAY_BUFFER:			bound = &arrayBuffer; break;
+	case GL_ELEMENT_ARRAY_BUFFER:	bound = &elementBuffer; break;
+	case GL_UNIFORM_BUFFER:			bound = &uniformBuffer; break;
+	}
+	if (!bound) {
+		glBindBuffer(target, buffer);
+		return;
+	}
+	if (request(BIND_BUFFER, buffer != *bound)) {
+		glBindBuffer(target, buffer);
+		*bound = buffer;
+	}
+}
+
+void GLCache::bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+	if (target != GL_UNIFORM_BUFFER || index >= MAX_UNIFORM_BINDINGS) {
+		glBindBufferBase(target, index, buffer);
+		return;
+	}
+	// A whole-buffer binding has no range; remember it as one that never matches
+	Range& range = uniformRanges[index];
+	if (request(BIND_UNIFORM_RANGE, range.buffer != buffer || range.size != -1)) {
+		glBindBufferBase(target, index, buffer);
+		range.buffer = buffer;
+		range.offset = 0;
+		range.size = -1;
+		uniformBuffer = buffer;
+	}
+}
+
+void GLCache::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+	if (target != GL_UNIFORM_BUFFER || index >= MAX_UNIFORM_BINDINGS) {
+		glBindBufferRange(target, index, buffer, offset, size);
+		return;
+	}
+	Range& range = uniformRanges[index];
+	if (request(BIND_UNIFORM_RANGE, range.buffer != buffer || range.offset != offset || range.size != size)) {
+		glBindBufferRange(target, index, buffer, offset, size);
+		range.buffer = buffer;
+		range.offset = offset;
+		range.size = size;
+		uniformBuffer = buffer;
+	}
+}
+
+void GLCache::bindTexture(GLuint unit, GLuint texture, GLenum target) {
+	if (unit >= MAX_TEXTURE_UNITS) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(target, texture);
+		activeUnit = unit;
+		return;
+	}
+	if (!request(BIND_TEXTURE, textures[unit] != texture))
+		return;
+	if (request(BIND_ACTIVE_UNIT, unit != activeUnit)) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		activeUnit = unit;
+	}
+	glBindTexture(target, texture);
+	textures[unit] = texture;
+}
+
+void GLCache::bindFramebuffer(GLuint fbo) {
+	if (request(BIND_FRAMEBUFFER, fbo != framebuffer)) {
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		framebuffer = fbo;
+	}
+}
+
+void GLCache::deleteProgram(GLuint prog) {
+	// A bound program lives on until it is unbound, but its name may be reused
+	if (prog == program)
+		program = UNKNOWN;
+	glDeleteProgram(prog);
+}
+
+void GLCache::deleteVertexArray(GLuint vao) {
+	if (vao == vertexArray) {
+		vertexArray = 0;
+		elementBuffer = UNKNOWN;
+	}
+	glDeleteVertexArrays(1, &vao);
+}
+
+void GLCache::deleteBuffer(GLuint buffer) {
+	if (buffer == arrayBuffer) arrayBuffer = 0;
+	if (buffer == elementBuffer) elementBuffer = 0;
+	if (buffer == uniformBuffer) uniformBuffer = 0;
+	for (auto& range : uniformRanges)
+		if (range.buffer == buffer) range.buffer = 0;
+	glDeleteBuffers(1, &buffer);
+}
+
+void GLCache::deleteTexture(GLuint texture) {
+	for (auto& t : textures)
+		if (t == texture) t = 0;
+	glDeleteTextures(1, &texture);
+}
+
+void GLCache::deleteFramebuffer(GLuint fbo) {
+	if (fbo == framebuffer)
+		framebuffer = 0;
+	glDeleteFramebuffers(1, &fbo);
+}
+
+void GLCache::invalidate() {
+	program = vertexArray = arrayBuffer = elementBuffer = uniformBuffer = UNKNOWN;
+	for (auto& range : uniformRanges)
+		range.buffer = UNKNOWN;
+	activeUnit = UNKNOWN;
+	for (auto& t : textures)
+		t = UNKNOWN;
+	framebuffer = UNKNOWN;
+}
+
+void GLCache::endFrame() {
+	frames++;
+	if (reportFrames && frames >= reportFrames) {
+		report(std::cout);
+		resetStats();
+	}
+}
+
+// One line per kind of binding, e.g. "program: 120 of 480 binds issued (75% skipped)"
+void GLCache::report(std::ostream& ostr) {
+	unsigned long totalRequests = 0, totalIssued = 0;
+	ostr << "GL state cache over " << frames << " frames:" << std::endl;
+	for (int k = 0; k < BIND_KIND_COUNT; k++) {
+		totalRequests += requests[k];
+		totalIssued += issued[k];
+		if (requests[k] == 0)
+			continue;
+		ostr << "  " << kindNames[k] << ": " << issued[k] << " of " << requests[k] << " binds issued ("
+			<< 100 * (requests[k] - issued[k]) / requests[k] << "% skipped)" << std::endl;
+	}
+	if (totalRequests)
+		ostr << "  total: " << totalIssued << " of " << totalRequests << " binds issued ("
+			<< 100 * (totalRequests - totalIssued) / totalRequests << "% skipped)" << std::endl;
+}
+
+void GLCache::resetStats() {
+	for (int k = 0; k < BIND_KIND_COUNT; k++)
+		requests[k] = issued[k] = 0;
+	frames = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef GLCACHE_HPP
+#define GLCACHE_HPP
+
+#include <ostream>
+#include "gl_core_3_3.h"
+
+// Tracks the OpenGL bindings of the (single) context and skips calls that would bind
+// what is already bound. All program, vertex array, buffer, texture and framebuffer
+// bindings must go through it, and objects must be deleted through it so that their
+// names can be reused; call invalidate() after binding anything directly.
+class GLCache {
+public:
+	static void useProgram(GLuint program);
+	static void bindVertexArray(GLuint vao);
+	// GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER (part of the vertex array) or GL_UNIFORM_BUFFER
+	static void bindBuffer(GLenum target, GLuint buffer);
+	// Uniform buffer binding points (these also bind the GL_UNIFORM_BUFFER target)
+	static void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+	static void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+	// Bind a texture to a texture unit, switching the active unit only when needed (a
+	// texture name belongs to one target, so the name alone tells the binding apart)
+	static void bindTexture(GLuint unit, GLuint texture, GLenum target = GL_TEXTURE_2D);
+	static void bindFramebuffer(GLuint fbo);
+
+	// Delete objects, dropping them from the cache (OpenGL unbinds deleted objects)
+	static void deleteProgram(GLuint program);
+	static void deleteVertexArray(GLuint vao);
+	static void deleteBuffer(GLuint buffer);
+	static void deleteTexture(GLuint texture);
+	static void deleteFramebuffer(GLuint fbo);
+	// Forget all bindings; the next bind of each kind is always issued
+	static void invalidate();
+
+	// Hit rates: print every given number of frames (0 = never)
+	static void setReportFrames(unsigned int frames) { reportFrames = frames; }
+	static unsigned int getReportFrames() { return reportFrames; }
+	// Count a frame, reporting and resetting the statistics when due
+	static void endFrame();
+	static void report(std::ostream& ostr);
+	static void resetStats();
+
+	static const unsigned int MAX_TEXTURE_UNITS = 16;
+	static const unsigned int MAX_UNIFORM_BINDINGS = 16;
+
+protected:
+	enum BindKind {
+		BIND_PROGRAM = 0,
+		BIND_VERTEX_ARRAY,
+		BIND_BUFFER,
+		BIND_UNIFORM_RANGE,
+		BIND_ACTIVE_UNIT,
+		BIND_TEXTURE,
+		BIND_FRAMEBUFFER,
+		BIND_KIND_COUNT
+	};
+	// Count a bind request; returns whether it must be issued
+	static bool request(BindKind kind, bool changed);
+
+	static const GLuint UNKNOWN = ~0u;	// Binding not known (always rebinds)
+	struct Range {
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+
+	// Current bindings
+	static GLuint program;
+	static GLuint vertexArray;
+	static GLuint arrayBuffer;
+	static GLuint elementBuffer;		// Of the bound vertex array
+	static GLuint uniformBuffer;		// Generic GL_UNIFORM_BUFFER binding
+	static Range uniformRanges[MAX_UNIFORM_BINDINGS];
+	static GLuint activeUnit;
+	static GLuint textures[MAX_TEXTURE_UNITS];
+	static GLuint framebuffer;
+
+	// Statistics
+	static unsigned long requests[BIND_KIND_COUNT];	// Bind calls made to the cache
+	static unsigned long issued[BIND_KIND_COUNT];	// Bind calls passed on to OpenGL
+	static unsigned int reportFrames;
+	static unsigned int frames;
+};
+
+#endif
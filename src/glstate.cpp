@@ -2,13 +2,32 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <limits>
+#include <random>
 #include "glstate.hpp"
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
 #include "util.hpp"
+#include "glcache.hpp"
+#include "programcache.hpp"
 #include "mesh.hpp"
 
+// Feature key bits
+enum {
+	FEATURE_SHADING_SHIFT = 0,		// ShadingMode (2 bits)
+	FEATURE_NORMALS_FACE = 1 << 2,
+	FEATURE_TINT_CONST = 1 << 3,
+	FEATURE_OCCLUSION_OFF = 1 << 4,
+	FEATURE_SPECULAR_OFF = 1 << 5,
+	FEATURE_TEXTURE_CONST = 1 << 6,
+	FEATURE_CONTOUR_OFF = 1 << 7,
+	FEATURE_OUTLINE = 1 << 8,
+	FEATURE_FLOOR = 1 << 9,
+	FEATURE_ADJACENCY = 1 << 10		// Drawn with adjacency: outline the silhouette edges only
+};
+
 // Constructor
 GLState::GLState() :
 	shadingMode(SHADINGMODE_CEL),
@@ -24,39 +43,36 @@ GLState::GLState() :
 	camCoords(0.0f, 1.0f, 4.5f),
 	lookAt(0.0f, -1.0f),
 	camRotating(false),
-	shader(0),
+	material(),
 	depthShader(0),
-	modelMatLoc(0),
-	modelMatDepthLoc(0),
-	lightSpaceMatLoc(0),
-	lightSpaceMatDepthLoc(0),
-	objTypeLoc(0),
-	viewProjMatLoc(0),
-	shadingModeLoc(0),
-	outlineModeLoc(0),
-	camPosLoc(0),
-	floorColorLoc(0),
-	floorAmbStrLoc(0),
-	floorDiffStrLoc(0),
-	floorSpecStrLoc(0),
-	floorSpecExpLoc(0),
-	modelColorLoc(0),
-	modelAmbStrLoc(0),
-	modelDiffStrLoc(0),
-	modelSpecStrLoc(0),
-	modelSpecExpLoc(0),
-	featureToggleLoc()
-	{}
+	hullShader(0) {
+	updateShadowKernel();
+}
 
 // Destructor
 GLState::~GLState() {
 	// Release OpenGL resources
-	if (shader)	glDeleteProgram(shader);
-	if (depthShader) glDeleteProgram(depthShader);
+	for (auto& p : programs)
+		GLCache::deleteProgram(p.second);
+	if (depthShader) GLCache::deleteProgram(depthShader);
+	if (hullShader) GLCache::deleteProgram(hullShader);
+	if (frameUbo) GLCache::deleteBuffer(frameUbo);
+	if (materialUbo) GLCache::deleteBuffer(materialUbo);
+	if (objectUbo) GLCache::deleteBuffer(objectUbo);
+	if (primitivesQuery) glDeleteQueries(1, &primitivesQuery);
+	if (mainTimeQuery) glDeleteQueries(1, &mainTimeQuery);
+	for (GLuint query : cascadeQueries)
+		if (query) glDeleteQueries(1, &query);
 }
 
 // Called when OpenGL context is created (some time after construction)
 void GLState::initializeGL() {
+	startTime = std::chrono::steady_clock::now();
+
+	// Start decoding the textures while the rest is set up
+	if (asyncLoading)
+		textures.beginLoad();
+
 	// General settings
 	glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
 	glClearDepth(1.0f);
@@ -65,6 +81,7 @@ void GLState::initializeGL() {
 
 	// Initialize OpenGL state
 	initShaders();
+	initUBOs();
 
 	// Set drawing state
 	setShadingMode(SHADINGMODE_CEL);
@@ -72,12 +89,17 @@ void GLState::initializeGL() {
 
 	// Create lights
 	lights.resize(Light::MAX_LIGHTS);
+	clusters.init();
 
 	// Set initialized state
 	init = true;
 
 	// Initialize textures
-	textures.load();
+	if (!asyncLoading) {
+		textures.load();
+		texturesReady = true;
+	}
+	textures.setShadowMapSize(shadowMapSize, cascadeCount);
 	textures.prepareDepthMap();
 }
 
@@ -86,104 +108,605 @@ void GLState::paintGL() {
 	// Clear the color and depth buffers
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// ========== Begin the first render pass to generate the depth map ==========
-	glUseProgram(depthShader);
-
-	// Render the scene from the light's perspective
-	// TODO 4-1.
-	// Calculate the matrix "lightSpaceMat" to do world-to-light space transform
-	// This matrix contains a projection and a view matrix from the light "lights[0]"
-	// Remember the light is directional so its projection should be an orthographic projection
-
-	glm::mat4 lightSpaceMat = glm::mat4(1.0f);
-	glm::mat4 lightView = glm::lookAt(lights[0].getPos(), glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0));
-	glm::mat4 lightProj = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, 0.1f, 100.0f);
-	lightSpaceMat = lightProj * lightView;
-
-	// Pass the transform matrix to the depth shader
-	glUniformMatrix4fv(lightSpaceMatDepthLoc, 1, GL_FALSE, glm::value_ptr(lightSpaceMat));
-
-	// Prepare before rendering
-	int shadowWidth, shadowHeight;
-	textures.getShadowWidthHeight(shadowWidth, shadowHeight);
-	glViewport(0, 0, shadowWidth, shadowHeight);
-	glBindFramebuffer(GL_FRAMEBUFFER, textures.getdepthMapFBO());
-	glClear(GL_DEPTH_BUFFER_BIT);
-
-	glCullFace(GL_FRONT);  // Fix peter panning
-	for (auto& objPtr : objects) {
-		// Pass the model matrix to the depth shader
-		glm::mat4 modelMat = objPtr->getModelMat();
-		glUniformMatrix4fv(modelMatDepthLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-
-		// Draw the mesh
-		objPtr->draw();
+	// Upload the next slice of background-loaded meshes, and stop the loader when all are done
+	if (meshLoader && !meshLoader->update(UPLOAD_BYTES_PER_FRAME)) {
+		lastLoaded = meshLoader->getLastLoaded();
+		meshLoader.reset();
+	}
+	// Create the textures once their images are decoded
+	if (!texturesReady && textures.finishLoad(false)) {
+		texturesReady = true;
+		lastLoaded = "textures";
+	}
+	if (!loadReported && texturesReady && !meshLoader) {
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		std::cout << "All objects and textures loaded after " << ms << " ms";
+		if (!lastLoaded.empty())
+			std::cout << " (last: " << lastLoaded << ")";
+		std::cout << std::endl;
+		loadReported = true;
 	}
-	glCullFace(GL_BACK);  // Reset
-	glFrontFace(GL_CCW);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glUseProgram(0);
-
-	// ========== Begin the second render pass ===================================
-	glViewport(0, 0, width, height);  // Reset the viewport
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glUseProgram(shader);
-
-	// Activate textures and pass them to the shader
-	textures.activeTextures();
-	textures.activeDepthMap();
-	GLuint texUnitLoc0, texUnitLoc1, texUnitLoc2, texUnitLoc3, texUnitLoc4;
-	texUnitLoc0 = glGetUniformLocation(shader, "texModelColor");
-	texUnitLoc1 = glGetUniformLocation(shader, "texModelSss");
-	texUnitLoc2 = glGetUniformLocation(shader, "texModelNrm");
-	texUnitLoc3 = glGetUniformLocation(shader, "texModelIlm");
-	texUnitLoc4 = glGetUniformLocation(shader, "shadowMap");
-	glUniform1i(texUnitLoc0, 0);
-	glUniform1i(texUnitLoc1, 1);
-	glUniform1i(texUnitLoc2, 2);
-	glUniform1i(texUnitLoc3, 3);
-	glUniform1i(texUnitLoc4, 4);
-
-	// Pass the transform matrix to the shader
-	glUniformMatrix4fv(lightSpaceMatLoc, 1, GL_FALSE, glm::value_ptr(lightSpaceMat));
 
 	// Construct a transformation matrix for the camera
 	glm::mat4 viewProjMat(1.0f);
 	// Perspective projection
 	float aspect = (float)width / (float)height;
-	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, 0.1f, 100.0f);
+	const float zNear = 0.1f, zFar = 100.0f;
+	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, zNear, zFar);
 	// Camera viewpoint
 	glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(lookAt, -camCoords.z));
 	view = glm::rotate(view, glm::radians(camCoords.y), glm::vec3(1.0f, 0.0f, 0.0f));
 	view = glm::rotate(view, glm::radians(camCoords.x), glm::vec3(0.0f, 1.0f, 0.0f));
 	// Combine transformations
 	viewProjMat = proj * view;
-	glEnable(GL_DEPTH_TEST);
-	glClear(GL_DEPTH_BUFFER_BIT);
-	glUniform1f(glGetUniformLocation(shader, "outline"), (outlineMode == OUTLINE_ON) ? outlineFactor : 0);
-	for (auto& objPtr : objects) {
-		glm::mat4 modelMat = objPtr->getModelMat();
-		// Upload transform matrices to shader
-		glUniformMatrix4fv(modelMatLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-		glUniformMatrix4fv(viewProjMatLoc, 1, GL_FALSE, glm::value_ptr(viewProjMat));
+	glm::vec3 camPos = glm::vec3(glm::inverse(view)[3]);
+
+	// Render the scene from the light's perspective: the light is directional, so each
+	// cascade has an orthographic projection around its slice of the camera frustum
+	updateBounds();
+	float lightFar = fitCascades(view, aspect, zNear, zFar);
+	// List the lights of each cluster for the main pass
+	clusters.assign(view, glm::radians(fovy), aspect, zNear, zFar, lights, frameWorkers);
+	clusters.upload();
+
+	// Upload the per-frame and per-object shader data once for both passes
+	FrameData frame;
+	frame.viewProjMat = viewProjMat;
+	for (unsigned int c = 0; c < cascadeCount; c++) {
+		frame.lightSpaceMats[c] = cascades[c].lightSpaceMat;
+		frame.cascadeFar[c] = cascades[c].far;
+	}
+	frame.cascadeCount = (int)cascadeCount;
+	frame.shadowTaps = (int)shadowTaps;
+	frame.shadowRotate = shadowKernel == SHADOWKERNEL_POISSON;
+	std::copy(shadowKernelTaps, shadowKernelTaps + shadowTaps, frame.shadowKernel);
+	frame.clusterScale = clusters.getScale(width, height);
+	frame.clusterCount = glm::ivec3(LightClusters::COUNT_X, LightClusters::COUNT_Y, LightClusters::COUNT_Z);
+	frame.globalLights = (int)clusters.getGlobalCount();
+	frame.shadowLight = lights[0].getEnabled() ? lights[0].getIndex() : -1;
+	frame.camPos = camPos;
+	frame.outline = (outlineMode == OUTLINE_ON || outlineMode == OUTLINE_HULL) ? outlineFactor : 0.0f;
+	GLCache::bindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+	size_t objectBase = writeObjectData();
+
+	// Queue the draws of every pass, sorted by program and textures, then front to back
+	float camProjScale = proj[1][1] * height * 0.5f;
+	cullObjects(viewProjMat);
+	unsigned int drawStatic = updateShadowCasters();
+	bool anyMoving[MAX_CASCADES] = {};
+	queue.clear();
+	for (size_t i = 0; i < objects.size(); i++) {
+		Mesh& mesh = *objects[i];
+		if (!mesh.isReady())
+			continue;
+		// The instances in view and in each cascade, packed into the mesh's draw list
+		InstanceRun runs[1 + MAX_CASCADES];
+		drawList.clear();
+		runs[0] = appendRun(camVisible, i, runs, 0);
+		for (unsigned int c = 0; c < cascadeCount; c++)
+			runs[1 + c] = appendRun(cascadeVisible[c], i, runs, 1 + c);
+		mesh.setDrawList(drawList);
+		const InstanceRun& camRun = runs[0];
+
+		unsigned int lightInstances = 0;
+		for (unsigned int b = firstBox[i]; b < firstBox[i + 1]; b++) {
+			bool inCascade = false;
+			for (unsigned int c = 0; c < cascadeCount; c++)
+				inCascade = inCascade || cascadeVisible[c][b];
+			lightInstances += inCascade;
+		}
+		unsigned int instanceCount = firstBox[i + 1] - firstBox[i];
+		cullStats.objects++;
+		cullStats.lightCulled += !lightInstances;
+		cullStats.camCulled += !camRun.count;
+		cullStats.instances += instanceCount;
+		cullStats.lightCulledInstances += instanceCount - lightInstances;
+		cullStats.camCulledInstances += instanceCount - camRun.count;
+		if (!lightInstances && !camRun.count)
+			continue;
+		// Level of detail that fits the mesh's size on screen (the shadow casters have theirs)
+		unsigned int lod = mesh.selectLod(pixelsPerUnit(mesh, camProjScale, true, camPos), lodPixelError);
+		float camDepth = nearestDistance(mesh, camPos) / zFar;
+		uint32_t textureSet = mesh.getMeshType() == Mesh::MODEL_FLOOR ? 0 : 1;
+
+		// Static casters are only drawn into cascades whose cached depth map is out of date
+		const ShadowCaster& caster = shadowCasters[i];
+		RenderQueue::Pass shadowPass = caster.moving ? RenderQueue::PASS_SHADOW_MOVING : RenderQueue::PASS_SHADOW;
+		float lightDepth = nearestDistance(mesh, lights[0].getPos()) / lightFar;
+		for (unsigned int c = 0; c < cascadeCount; c++) {
+			const ShadowCaster::Layer& layer = caster.cascades[c];
+			if (!layer.casts || !(caster.moving || (drawStatic & (1u << c))))
+				continue;
+			queue.push(shadowPass, c, 0, lightDepth, (uint32_t)i, layer.lod, runs[1 + c].first, runs[1 + c].count);
+			anyMoving[c] = anyMoving[c] || caster.moving;
+		}
+		if (!camRun.count)
+			continue;
+		queue.push(RenderQueue::PASS_MAIN, featureKey(mesh), textureSet, camDepth, (uint32_t)i, lod, camRun.first, camRun.count);
+		if (outlineMode == OUTLINE_HULL && mesh.hasOutlineNormals() && mesh.getMeshType() != Mesh::MODEL_FLOOR)
+			queue.push(RenderQueue::PASS_HULL, 0, 0, camDepth, (uint32_t)i, lod, camRun.first, camRun.count);
+	}
+	queue.sort();
+	const std::vector<RenderQueue::Item>& items = queue.getItems();
+
+	// Find the objects hidden by occluders on other threads while the depth map is drawn
+	bool occlusionStarted = startOcclusionCulling(viewProjMat);
+
+	// ========== Begin the first render pass to generate the depth maps ==========
+	// With split caching, a cascade's depth map is a copy of its static casters' depth map
+	// with the moving casters drawn over it; it is rebuilt while any move, and once after
+	// they stop
+	bool split = shadowCacheMode == SHADOWCACHE_SPLIT;
+	bool timeCascades = GLCache::getReportFrames() != 0;
+	int shadowWidth, shadowHeight;
+	textures.getShadowWidthHeight(shadowWidth, shadowHeight);
+	for (unsigned int c = 0; c < cascadeCount; c++) {
+		bool drawCascade = (drawStatic & (1u << c)) != 0;
+		bool drawMoving = split && (drawCascade || anyMoving[c] || movingCastersDrawn[c]);
+		movingCastersDrawn[c] = anyMoving[c];
+		if (!drawCascade && !drawMoving)
+			continue;
+		shadowStats.drawn[c]++;
+		if (timeCascades)
+			beginCascadeQuery(c);
+
+		GLCache::useProgram(depthShader);
+		glUniform1i(cascadeLoc, (GLint)c);
+		// Prepare before rendering
+		glViewport(0, 0, shadowWidth, shadowHeight);
+		glCullFace(GL_FRONT);  // Fix peter panning
+		if (drawCascade) {
+			if (split)
+				textures.prepareStaticDepthMap();
+			GLCache::bindFramebuffer(split ? textures.getStaticDepthMapFBO(c) : textures.getdepthMapFBO(c));
+			glClear(GL_DEPTH_BUFFER_BIT);
+			drawShadowPass(RenderQueue::PASS_SHADOW, c, objectBase);
+			shadowStats.staticDraws[c]++;
+		}
+		if (drawMoving) {
+			textures.copyStaticDepthMap(c);
+			drawShadowPass(RenderQueue::PASS_SHADOW_MOVING, c, objectBase);
+			shadowStats.movingDraws[c]++;
+		}
+		glCullFace(GL_BACK);  // Reset
+		glFrontFace(GL_CCW);
+		if (timeCascades)
+			glEndQuery(GL_TIME_ELAPSED);
+	}
+	GLCache::bindFramebuffer(0);
 
-		// Get camera position and upload to shader
-		glm::vec3 camPos = glm::vec3(glm::inverse(view)[3]);
-		glUniform3fv(camPosLoc, 1, glm::value_ptr(camPos));
+	// ========== Begin the second render pass ===================================
+	if (occlusionStarted) {
+		auto waitStart = std::chrono::steady_clock::now();
+		frameWorkers.wait(occlusionJob);
+		cullStats.occlusionWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+		cullStats.occlusionMs += occlusion.getMs();
+		cullStats.tested += occlusion.getTestedCount();
+		cullStats.occluded += occlusion.getOccludedCount();
+		cullStats.occluderTriangles += occlusion.getTriangleCount();
+	}
+	glViewport(0, 0, width, height);  // Reset the viewport
+	if (outlineMode == OUTLINE_SCREEN)
+		edges.begin(width, height);  // Render offscreen; the edge filter draws the result
+	else
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// Activate textures (the samplers are pointed at their units in getProgram)
+	textures.activeTextures();
+	textures.activeDepthMap();
 
-		// Pass object type to shader
-		glUniform1i(objTypeLoc, (int)objPtr->getMeshType());
-		// Draw the mesh
-		objPtr->draw();
+	glEnable(GL_DEPTH_TEST);
+	bool countPrimitives = GLCache::getReportFrames() != 0;
+	if (countPrimitives)
+		beginPrimitivesQuery();
+	auto range = queue.passRange(RenderQueue::PASS_MAIN);
+	for (size_t k = range.first; k < range.second; k++) {
+		const RenderQueue::Item& item = items[k];
+		if (!anyInstance(unoccluded, item.object))
+			continue;
+		GLCache::bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BIND_PT, objectUbo, objectBase + item.object * objectStride, sizeof(ObjectData));
+
+		// Draw the mesh with the shader variant for its type and the drawing modes
+		GLCache::useProgram(getProgram(item.program));
+		if (item.program & FEATURE_ADJACENCY)
+			objects[item.object]->drawAdjacency(item.lod, item.firstInstance, item.instanceCount);
+		else
+			objects[item.object]->draw(item.lod, item.firstInstance, item.instanceCount);
 	}
 
-	glUseProgram(0);
+	// Inverted hull: draw the back faces of each model pushed out along its outline
+	// normals, so they show only around the silhouette
+	range = queue.passRange(RenderQueue::PASS_HULL);
+	if (range.first < range.second) {
+		GLCache::useProgram(hullShader);
+		glCullFace(GL_FRONT);
+		for (size_t k = range.first; k < range.second; k++) {
+			const RenderQueue::Item& item = items[k];
+			if (!anyInstance(unoccluded, item.object))
+				continue;
+			GLCache::bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BIND_PT, objectUbo, objectBase + item.object * objectStride, sizeof(ObjectData));
+			objects[item.object]->draw(item.lod, item.firstInstance, item.instanceCount);
+		}
+		glCullFace(GL_BACK);
+	}
+	if (countPrimitives) {
+		glEndQuery(GL_PRIMITIVES_GENERATED);
+		glEndQuery(GL_TIME_ELAPSED);
+	}
+	if (outlineMode == OUTLINE_SCREEN)
+		edges.apply(zNear, zFar);
 
 	// Draw enabled light icons (if in lighting mode)
 	if (shadingMode != SHADINGMODE_NORMALS)
 		for (auto& l : lights)
 			if (l.getEnabled()) l.drawIcon(viewProjMat);
+
+	if (!firstFrameDrawn) {
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		const ProgramCacheStats& shaderStats = getProgramCacheStats();
+		std::cout << "First frame drawn after " << ms << " ms (shaders " << shaderStats.ms << " ms, "
+			<< shaderStats.loaded << " of " << shaderStats.loaded + shaderStats.compiled
+			<< " programs from the cache)" << std::endl;
+		firstFrameDrawn = true;
+	}
+	queue.endFrame(GLCache::getReportFrames());
+	clusters.endFrame(GLCache::getReportFrames());
+	reportCulling();
+	reportShadowCache();
+	GLCache::endFrame();
+}
+
+// Add up the previous frame's query result (the GPU has usually finished it by now), print
+// the average when GLCache reports, and start counting this frame
+void GLState::beginPrimitivesQuery() {
+	if (!primitivesQuery) {
+		glGenQueries(1, &primitivesQuery);
+		glGenQueries(1, &mainTimeQuery);
+	}
+	if (primitivesPending) {
+		GLuint primitives = 0;
+		GLuint64 ns = 0;
+		glGetQueryObjectuiv(primitivesQuery, GL_QUERY_RESULT, &primitives);
+		glGetQueryObjectui64v(mainTimeQuery, GL_QUERY_RESULT, &ns);
+		primitivesTotal += primitives;
+		mainGpuMs += ns / 1e6;
+		if (++primitivesFrames >= GLCache::getReportFrames()) {
+			std::cout << "Main pass: " << primitivesTotal / primitivesFrames << " primitives generated and "
+				<< mainGpuMs / primitivesFrames << " ms GPU time per frame over " << primitivesFrames
+				<< " frames (" << shadowTaps << " shadow samples per fragment)" << std::endl;
+			primitivesTotal = 0;
+			mainGpuMs = 0.0;
+			primitivesFrames = 0;
+		}
+	}
+	glBeginQuery(GL_PRIMITIVES_GENERATED, primitivesQuery);
+	glBeginQuery(GL_TIME_ELAPSED, mainTimeQuery);
+	primitivesPending = true;
+}
+
+// Gather the world bounds of the instances of the objects that are ready to draw
+void GLState::updateBounds() {
+	// The bounds are also tested against the occluders
+	firstBox.resize(objects.size() + 1);
+	firstBox[0] = 0;
+	for (size_t i = 0; i < objects.size(); i++)
+		firstBox[i + 1] = firstBox[i] + objects[i]->getInstanceCount();
+	cullBounds.resize(firstBox.back());
+	sceneMinBB = glm::vec3(std::numeric_limits<float>::max());
+	sceneMaxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (!objects[i]->isReady())
+			continue;
+		for (unsigned int k = 0; k < objects[i]->getInstanceCount(); k++) {
+			auto box = objects[i]->instanceBoundingBox(k);
+			cullBounds.set(firstBox[i] + k, box.first, box.second);
+		}
+		auto bb = objects[i]->worldBoundingBox();
+		sceneMinBB = glm::min(sceneMinBB, bb.first);
+		sceneMaxBB = glm::max(sceneMaxBB, bb.second);
+	}
+	if (sceneMinBB.x > sceneMaxBB.x)
+		sceneMinBB = sceneMaxBB = glm::vec3(0.0f);
+}
+
+// The slices split the camera frustum up to the far end of the scene, with a blend of
+// logarithmic and uniform splits. Each slice's bounding sphere keeps the size of its
+// projection fixed while the camera turns, and its center is snapped to whole texels
+// in light space, so shadow edges do not shimmer as the camera moves. The depth range
+// reaches from the nearest point of the scene seen from the light, so casters outside
+// the slice still shadow it.
+float GLState::fitCascades(const glm::mat4& view, float aspect, float zNear, float zFar) {
+	glm::vec3 lightPos = lights[0].getPos();
+	glm::mat4 lightView = glm::lookAt(lightPos, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+	// Depth range of the scene from the camera and from the light
+	float sceneFar = 0.0f, lightDistance = 0.0f;
+	float lightNear = std::numeric_limits<float>::max(), lightFar = std::numeric_limits<float>::lowest();
+	for (int c = 0; c < 8; c++) {
+		glm::vec4 corner(c & 1 ? sceneMaxBB.x : sceneMinBB.x, c & 2 ? sceneMaxBB.y : sceneMinBB.y,
+			c & 4 ? sceneMaxBB.z : sceneMinBB.z, 1.0f);
+		sceneFar = std::max(sceneFar, -(view * corner).z);
+		float depth = -(lightView * corner).z;
+		lightNear = std::min(lightNear, depth);
+		lightFar = std::max(lightFar, depth);
+		lightDistance = std::max(lightDistance, glm::length(glm::vec3(corner) - lightPos));
+	}
+	float margin = 0.01f * (lightFar - lightNear) + 0.01f;
+	// Round the far end up in steps of about 19%, so the splits stay put while the camera moves
+	float shadowFar = std::exp2(std::ceil(std::log2(std::max(sceneFar, 2.0f * zNear)) * 4.0f) / 4.0f);
+	shadowFar = std::min(shadowFar, zFar);
+
+	float tanY = std::tan(glm::radians(fovy) * 0.5f), tanX = tanY * aspect;
+	float k2 = tanX * tanX + tanY * tanY;	// Squared slope of the frustum's corner edges
+	glm::mat4 invView = glm::inverse(view);
+	float sliceNear = zNear;
+	for (unsigned int c = 0; c < cascadeCount; c++) {
+		float t = (float)(c + 1) / cascadeCount;
+		float sliceFar = CASCADE_SPLIT_BLEND * zNear * std::pow(shadowFar / zNear, t)
+			+ (1.0f - CASCADE_SPLIT_BLEND) * (zNear + (shadowFar - zNear) * t);
+
+		// Smallest sphere around the slice; its center is on the view axis. The radius is
+		// rounded up to 1/16 units so rounding errors do not change the projection's size.
+		float centerDepth = std::min(sliceFar, 0.5f * (1.0f + k2) * (sliceNear + sliceFar));
+		float radius = std::sqrt((sliceFar - centerDepth) * (sliceFar - centerDepth) + sliceFar * sliceFar * k2);
+		radius = std::ceil(radius * 16.0f) / 16.0f;
+		glm::vec3 center = glm::vec3(invView * glm::vec4(0.0f, 0.0f, -centerDepth, 1.0f));
+
+		glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+		float texel = 2.0f * radius / shadowMapSize;
+		lightCenter.x = std::floor(lightCenter.x / texel) * texel;
+		lightCenter.y = std::floor(lightCenter.y / texel) * texel;
+		float farDepth = std::max(std::min(lightFar, -lightCenter.z + radius), lightNear);
+		glm::mat4 lightProj = glm::ortho(lightCenter.x - radius, lightCenter.x + radius,
+			lightCenter.y - radius, lightCenter.y + radius, lightNear - margin, farDepth + margin);
+
+		cascades[c].lightSpaceMat = lightProj * lightView;
+		cascades[c].far = sliceFar;
+		cascades[c].texelsPerUnit = shadowMapSize / (2.0f * radius);
+		sliceNear = sliceFar;
+	}
+	return lightDistance;
+}
+
+// Test the bounds against the camera frustum and each cascade
+void GLState::cullObjects(const glm::mat4& viewProjMat) {
+	if (!frustumCulling) {
+		camVisible.assign(cullBounds.size(), 1);
+		for (unsigned int c = 0; c < cascadeCount; c++)
+			cascadeVisible[c].assign(cullBounds.size(), 1);
+		return;
+	}
+	cullBounds.cull(Frustum(viewProjMat), camVisible);
+	for (unsigned int c = 0; c < cascadeCount; c++)
+		cullBounds.cull(Frustum(cascades[c].lightSpaceMat), cascadeVisible[c]);
+}
+
+bool GLState::anyInstance(const std::vector<uint8_t>& marks, size_t object) const {
+	for (unsigned int b = firstBox[object]; b < firstBox[object + 1]; b++)
+		if (marks[b])
+			return true;
+	return false;
+}
+
+GLState::InstanceRun GLState::appendRun(const std::vector<uint8_t>& visible, size_t object,
+	const InstanceRun* runs, unsigned int runCount) {
+	InstanceRun run;
+	run.first = (uint32_t)drawList.size();
+	for (unsigned int b = firstBox[object]; b < firstBox[object + 1]; b++)
+		if (visible[b])
+			drawList.push_back(b - firstBox[object]);
+	run.count = (uint32_t)drawList.size() - run.first;
+	for (unsigned int r = 0; r < runCount; r++)
+		if (runs[r].count == run.count && std::equal(drawList.begin() + run.first, drawList.end(),
+			drawList.begin() + runs[r].first)) {
+			drawList.resize(run.first);
+			return runs[r];
+		}
+	return run;
+}
+
+// Occlusion is tested per instance, but an object's run of instances in view is drawn
+// whole unless all of them are hidden (the run is uploaded before the test finishes)
+bool GLState::startOcclusionCulling(const glm::mat4& viewProjMat) {
+	unoccluded = camVisible;
+	occluders.clear();
+	occlusionTest.assign(cullBounds.size(), 0);
+	if (!occlusionCulling)
+		return false;
+	for (size_t i = 0; i < objects.size(); i++) {
+		Mesh& mesh = *objects[i];
+		if (!mesh.isReady())
+			continue;
+		if (!mesh.isOccluder())
+			std::fill(occlusionTest.begin() + firstBox[i], occlusionTest.begin() + firstBox[i + 1], 1);
+		else if (anyInstance(camVisible, i) && !mesh.getOccluderIndices().empty())
+			occluders.push_back(&mesh);
+	}
+	if (occluders.empty())
+		return false;
+
+	// The job only reads the meshes, which the shadow pass does not change
+	frameWorkers.run(occlusionJob, [this, viewProjMat]() {
+		occlusion.run(viewProjMat, occluders, cullBounds, occlusionTest, unoccluded);
+	});
+	return true;
+}
+
+void GLState::reportCulling() {
+	unsigned int reportFrames = GLCache::getReportFrames();
+	if (!reportFrames || ++cullStats.frames < reportFrames)
+		return;
+	std::cout << "Frustum culling over " << cullStats.frames << " frames: of " << cullStats.objects / cullStats.frames
+		<< " objects (" << cullStats.instances / cullStats.frames << " instances), "
+		<< cullStats.camCulled / cullStats.frames << " (" << cullStats.camCulledInstances / cullStats.frames
+		<< " instances) culled from the main pass and " << cullStats.lightCulled / cullStats.frames << " ("
+		<< cullStats.lightCulledInstances / cullStats.frames << " instances) from the shadow pass per frame" << std::endl;
+	if (cullStats.occluderTriangles)
+		std::cout << "Occlusion culling over " << cullStats.frames << " frames: " << cullStats.occluded / cullStats.frames
+			<< " of " << cullStats.tested / cullStats.frames << " tested instances hidden by "
+			<< cullStats.occluderTriangles / cullStats.frames << " occluder triangles per frame, "
+			<< cullStats.occlusionMs / cullStats.frames << " ms culling on a worker ("
+			<< cullStats.occlusionWaitMs / cullStats.frames << " ms waited for)" << std::endl;
+	cullStats = CullStats();
+}
+
+// A caster moves when its mesh changed within the last SHADOW_STILL_FRAMES frames; the
+// cached depth map of a cascade is out of date when its projection changed or a static
+// caster in it was added, removed, moved or given another level of detail
+unsigned int GLState::updateShadowCasters() {
+	unsigned int outdated = 0;
+	if (shadowCacheMode == SHADOWCACHE_OFF || !shadowCacheValid)
+		outdated = (1u << cascadeCount) - 1;
+	for (unsigned int c = 0; c < cascadeCount; c++)
+		if (cascades[c].lightSpaceMat != cachedLightSpaceMats[c])
+			outdated |= 1u << c;
+	for (size_t i = objects.size(); i < shadowCasters.size(); i++)
+		for (unsigned int c = 0; c < cascadeCount; c++)
+			if (shadowCasters[i].cascades[c].cached)
+				outdated |= 1u << c;
+	shadowCasters.resize(objects.size());
+
+	for (size_t i = 0; i < objects.size(); i++) {
+		Mesh& mesh = *objects[i];
+		ShadowCaster& caster = shadowCasters[i];
+		if (caster.mesh != &mesh) {
+			// New objects start out static
+			for (unsigned int c = 0; c < cascadeCount; c++)
+				if (caster.cascades[c].cached)
+					outdated |= 1u << c;
+			caster = ShadowCaster();
+			caster.mesh = &mesh;
+			caster.changeCount = mesh.getChangeCount();
+			caster.stillFrames = SHADOW_STILL_FRAMES;
+		}
+		// Casters that were not drawn last frame (still loading, or outside the cascades)
+		// are not counted as moving
+		bool drawn = false;
+		for (unsigned int c = 0; c < cascadeCount; c++)
+			drawn = drawn || caster.cascades[c].casts;
+		if (mesh.getChangeCount() != caster.changeCount) {
+			caster.changeCount = mesh.getChangeCount();
+			if (drawn)
+				caster.stillFrames = 0;
+		} else if (caster.stillFrames < SHADOW_STILL_FRAMES)
+			caster.stillFrames++;
+		caster.moving = shadowCacheMode == SHADOWCACHE_SPLIT && caster.stillFrames < SHADOW_STILL_FRAMES;
+
+		for (unsigned int c = 0; c < cascadeCount; c++) {
+			ShadowCaster::Layer& layer = caster.cascades[c];
+			layer.casts = mesh.isReady() && anyInstance(cascadeVisible[c], i);
+			// Level of detail that fits the cascade's resolution
+			if (layer.casts)
+				layer.lod = mesh.selectLod(pixelsPerUnit(mesh, cascades[c].texelsPerUnit, false, glm::vec3(0.0f)), lodPixelError);
+			bool isStatic = layer.casts && !caster.moving;
+			if (isStatic != layer.cached || (isStatic && (layer.lod != layer.cachedLod || caster.changeCount != layer.cachedChange)))
+				outdated |= 1u << c;
+		}
+	}
+	if (!outdated)
+		return 0;
+
+	for (unsigned int c = 0; c < cascadeCount; c++) {
+		if (!(outdated & (1u << c)))
+			continue;
+		for (auto& caster : shadowCasters) {
+			ShadowCaster::Layer& layer = caster.cascades[c];
+			layer.cached = layer.casts && !caster.moving;
+			layer.cachedLod = layer.lod;
+			layer.cachedChange = caster.changeCount;
+		}
+		cachedLightSpaceMats[c] = cascades[c].lightSpaceMat;
+	}
+	shadowCacheValid = shadowCacheMode != SHADOWCACHE_OFF;
+	return outdated;
+}
+
+void GLState::drawShadowPass(RenderQueue::Pass pass, unsigned int cascade, size_t objectBase) {
+	const std::vector<RenderQueue::Item>& items = queue.getItems();
+	auto range = queue.passRange(pass);
+	for (size_t k = range.first; k < range.second; k++) {
+		const RenderQueue::Item& item = items[k];
+		if (item.program != cascade)
+			continue;
+		GLCache::bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BIND_PT, objectUbo, objectBase + item.object * objectStride, sizeof(ObjectData));
+		objects[item.object]->draw(item.lod, item.firstInstance, item.instanceCount);
+		shadowStats.casters[cascade]++;
+	}
+}
+
+// Add up the cascade's previous timing (the GPU has usually finished it by now) and start
+// timing this draw
+void GLState::beginCascadeQuery(unsigned int cascade) {
+	if (!cascadeQueries[cascade])
+		glGenQueries(1, &cascadeQueries[cascade]);
+	collectCascadeQuery(cascade);
+	glBeginQuery(GL_TIME_ELAPSED, cascadeQueries[cascade]);
+	cascadeQueryPending[cascade] = true;
+}
+
+void GLState::collectCascadeQuery(unsigned int cascade) {
+	if (!cascadeQueryPending[cascade])
+		return;
+	GLuint64 ns = 0;
+	glGetQueryObjectui64v(cascadeQueries[cascade], GL_QUERY_RESULT, &ns);
+	shadowStats.gpuMs[cascade] += ns * 1e-6;
+	shadowStats.timed[cascade]++;
+	cascadeQueryPending[cascade] = false;
+}
+
+// e.g. "Shadow cascade 0 (to depth 1.6, 302 texels per unit) over 300 frames: static casters
+// drawn in 2 frames, moving casters in 0 frames; per drawn frame, 12 casters and 0.8 ms GPU time"
+void GLState::reportShadowCache() {
+	unsigned int reportFrames = GLCache::getReportFrames();
+	if (!reportFrames || ++shadowStats.frames < reportFrames)
+		return;
+	for (unsigned int c = 0; c < cascadeCount; c++) {
+		collectCascadeQuery(c);
+		std::cout << "Shadow cascade " << c << " (to depth " << cascades[c].far << ", " << cascades[c].texelsPerUnit
+			<< " texels per unit) over " << shadowStats.frames << " frames: static casters drawn in "
+			<< shadowStats.staticDraws[c] << " frames, moving casters in " << shadowStats.movingDraws[c] << " frames";
+		if (shadowStats.drawn[c])
+			std::cout << "; per drawn frame, " << shadowStats.casters[c] / shadowStats.drawn[c] << " casters";
+		if (shadowStats.timed[c])
+			std::cout << " and " << shadowStats.gpuMs[c] / shadowStats.timed[c] << " ms GPU time";
+		std::cout << std::endl;
+	}
+	shadowStats = ShadowStats();
+}
+
+// Write this frame's object records into the next segment of the ring; returns the
+// offset of the first record
+size_t GLState::writeObjectData() {
+	size_t bytes = objects.size() * objectStride;
+	if (bytes == 0)
+		return 0;
+
+	// Grow the ring when the scene outgrows a segment
+	if (bytes > objectSegmentBytes) {
+		objectSegmentBytes = std::max(bytes, objectSegmentBytes * 2);
+		GLCache::bindBuffer(GL_UNIFORM_BUFFER, objectUbo);
+		glBufferData(GL_UNIFORM_BUFFER, objectSegmentBytes * OBJECT_RING_FRAMES, NULL, GL_DYNAMIC_DRAW);
+		objectSegment = 0;
+	}
+
+	objectStaging.resize(bytes);
+	for (size_t i = 0; i < objects.size(); i++) {
+		Mesh& mesh = *objects[i];
+		ObjectData data;
+		data.posScale = mesh.getPosScale();
+		data.objType = (int)mesh.getMeshType();
+		data.posOffset = mesh.getPosOffset();
+		data.octNormals = mesh.isCompact();
+		memcpy(&objectStaging[i * objectStride], &data, sizeof(data));
+	}
+
+	// Write a different segment than the last frames, which the GPU may still be reading
+	objectSegment = (objectSegment + 1) % OBJECT_RING_FRAMES;
+	size_t base = objectSegment * objectSegmentBytes;
+	GLCache::bindBuffer(GL_UNIFORM_BUFFER, objectUbo);
+	glBufferSubData(GL_UNIFORM_BUFFER, base, bytes, objectStaging.data());
+	return base;
 }
 
 // Called when window is resized
@@ -192,179 +715,184 @@ void GLState::resizeGL(int w, int h) {
 	width = w;
 	height = h;
 	glViewport(0, 0, w, h);
+	occlusion.resize(w, h);
 }
 
-// Set the shading mode (normals, cels, or Phong)
+void GLState::setShadowCacheMode(ShadowCacheMode mode) {
+	shadowCacheMode = mode;
+	shadowCacheValid = false;
+}
+
+void GLState::setShadowCascades(unsigned int count, unsigned int mapSize) {
+	cascadeCount = std::min(std::max(count, 1u), (unsigned int)MAX_CASCADES);
+	shadowMapSize = std::max(mapSize, 1u);
+}
+
+void GLState::setShadowKernel(ShadowKernel kernel) {
+	shadowKernel = kernel;
+	updateShadowKernel();
+}
+
+void GLState::setShadowQuality(ShadowQuality quality) {
+	shadowQuality = quality;
+	updateShadowKernel();
+}
+
+// The n x n samples of a quality level cover about n texels across. The grid is rotated by
+// atan(1/2) so that no two samples share a row or column of texels; the Poisson disk is
+// built by best-candidate sampling (each sample is the farthest from the others of a few
+// random candidates), with a fixed seed so the pattern is the same every run.
+void GLState::updateShadowKernel() {
+	unsigned int n = (unsigned int)shadowQuality + 1;
+	shadowTaps = n * n;
+	if (shadowKernel == SHADOWKERNEL_GRID) {
+		float angle = std::atan(0.5f), c = std::cos(angle), s = std::sin(angle);
+		for (unsigned int i = 0; i < shadowTaps; i++) {
+			glm::vec2 p((float)(i % n) - 0.5f * (n - 1), (float)(i / n) - 0.5f * (n - 1));
+			shadowKernelTaps[i] = glm::vec4(c * p.x - s * p.y, s * p.x + c * p.y, 0.0f, 0.0f);
+		}
+		return;
+	}
+
+	const unsigned int CANDIDATES = 16;
+	float radius = 0.5f * n;
+	std::mt19937 random(1);
+	shadowKernelTaps[0] = glm::vec4(0.0f);
+	for (unsigned int i = 1; i < shadowTaps; i++) {
+		glm::vec2 best(0.0f);
+		float bestDistance = -1.0f;
+		for (unsigned int k = 0; k < CANDIDATES * i; k++) {
+			// Uniform in the disk
+			float r = radius * std::sqrt(random() / 4294967296.0f);
+			float a = 6.2831853f * (random() / 4294967296.0f);
+			glm::vec2 candidate(r * std::cos(a), r * std::sin(a));
+			float distance = std::numeric_limits<float>::max();
+			for (unsigned int j = 0; j < i; j++)
+				distance = std::min(distance, glm::length(candidate - glm::vec2(shadowKernelTaps[j])));
+			if (distance > bestDistance) {
+				bestDistance = distance;
+				best = candidate;
+			}
+		}
+		shadowKernelTaps[i] = glm::vec4(best, 0.0f, 0.0f);
+	}
+}
+
+// Set the shading mode (normals, cels, or Phong); like the other modes, it selects the
+// shader variant that the next frame is drawn with
 void GLState::setShadingMode(ShadingMode sm) {
 	shadingMode = sm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(shadingModeLoc, (int)shadingMode);
-	glUseProgram(0);
 }
 
 // Set the shading mode (normals, cels, or Phong)
 void GLState::setNormalsMode(NormalsMode nm) {
 	normalsMode = nm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(normalsModeLoc, (int)normalsMode);
-	glUseProgram(0);
 }
 
 // Set the tint mode (const or SSS)
 void GLState::setTintMode(TintMode tm) {
 	tintMode = tm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(tintModeLoc, (int)tintMode);
-	glUseProgram(0);
 }
 
 // Set the occlusion mode (on or off)
 void GLState::setOcclusionMode(OcclusionMode om) {
 	occlusionMode = om;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(occlusionModeLoc, (int)occlusionMode);
-	glUseProgram(0);
 }
 
 // Set the specular mode (on or off)
 void GLState::setSpecularMode(SpecularMode om) {
 	specularMode = om;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(specularModeLoc, (int)specularMode);
-	glUseProgram(0);
 }
 
 // Set the texture mode (blank or texture)
 void GLState::setTextureMode(TextureMode tm) {
 	textureMode = tm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(textureModeLoc, (int)textureMode);
-	glUseProgram(0);
 }
 
 // Set the interior line mode (on or off)
 void GLState::setContourMode(ContourMode tm) {
 	contourMode = tm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(contourModeLoc, (int)contourMode);
-	glUseProgram(0);
 }
 
 void GLState::setOutlineMode(OutlineMode om) {
 	outlineMode = om;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(outlineModeLoc, (int)outlineMode);
-	glUseProgram(0);
 }
 
 // Get object color
 glm::vec3 GLState::getObjectColor() const {
-	glm::vec3 objColor;
-	glGetUniformfv(shader, modelColorLoc, glm::value_ptr(objColor));
-	return objColor;
+	return material.modelColor;
 }
 
 // Get ambient strength
 float GLState::getAmbientStrength() const {
-	float ambStr;
-	glGetUniformfv(shader, modelAmbStrLoc, &ambStr);
-	return ambStr;
+	return material.modelAmbStr;
 }
 
 // Get diffuse strength
 float GLState::getDiffuseStrength() const {
-	float diffStr;
-	glGetUniformfv(shader, modelDiffStrLoc, &diffStr);
-	return diffStr;
+	return material.modelDiffStr;
 }
 
 // Get specular strength
 float GLState::getSpecularStrength() const {
-	float specStr;
-	glGetUniformfv(shader, modelSpecStrLoc, &specStr);
-	return specStr;
+	return material.modelSpecStr;
 }
 
 // Get specular exponent
 float GLState::getSpecularExponent() const {
-	float specExp;
-	glGetUniformfv(shader, modelSpecExpLoc, &specExp);
-	return specExp;
+	return material.modelSpecExp;
 }
 
 // Set object color
 void GLState::setObjectColor(glm::vec3 color) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform3fv(modelColorLoc, 1, glm::value_ptr(color));
-	glUseProgram(0);
+	material.modelColor = color;
+	updateMaterial();
 }
 
 // Set ambient strength
 void GLState::setAmbientStrength(float ambStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(modelAmbStrLoc, ambStr);
-	glUseProgram(0);
+	material.modelAmbStr = ambStr;
+	updateMaterial();
 }
 
 // Set diffuse strength
 void GLState::setDiffuseStrength(float diffStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(modelDiffStrLoc, diffStr);
-	glUseProgram(0);
+	material.modelDiffStr = diffStr;
+	updateMaterial();
 }
 
 // Set specular strength
 void GLState::setSpecularStrength(float specStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(modelSpecStrLoc, specStr);
-	glUseProgram(0);
+	material.modelSpecStr = specStr;
+	updateMaterial();
 }
 
 // Set specular exponent
 void GLState::setSpecularExponent(float specExp) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(modelSpecExpLoc, specExp);
-	glUseProgram(0);
+	material.modelSpecExp = specExp;
+	updateMaterial();
 }
 
 void GLState::setMaterialAttrs(
 	glm::vec3 floorColor, glm::vec3 modelColor,
 	float floorAmbStr, float floorDiffStr, float floorSpecStr, float floorSpecExp,
 	float modelAmbStr, float modelDiffStr, float modelSpecStr, float modelSpecExp) {  // set material attributes (initialization)
-	// Update values in shader
-	glUseProgram(shader);
-	glUniform3fv(floorColorLoc, 1, glm::value_ptr(floorColor));
-	glUniform3fv(modelColorLoc, 1, glm::value_ptr(modelColor));
-	glUniform1f(floorAmbStrLoc, floorAmbStr);
-	glUniform1f(floorDiffStrLoc, floorDiffStr);
-	glUniform1f(floorSpecStrLoc, floorSpecStr);
-	glUniform1f(floorSpecExpLoc, floorSpecExp);
-	glUniform1f(modelAmbStrLoc, modelAmbStr);
-	glUniform1f(modelDiffStrLoc, modelDiffStr);
-	glUniform1f(modelSpecStrLoc, modelSpecStr);
-	glUniform1f(modelSpecExpLoc, modelSpecExp);
-	glUseProgram(0);
+	material.floorColor = floorColor;
+	material.modelColor = modelColor;
+	material.floorAmbStr = floorAmbStr;
+	material.floorDiffStr = floorDiffStr;
+	material.floorSpecStr = floorSpecStr;
+	material.floorSpecExp = floorSpecExp;
+	material.modelAmbStr = modelAmbStr;
+	material.modelDiffStr = modelDiffStr;
+	material.modelSpecStr = modelSpecStr;
+	material.modelSpecExp = modelSpecExp;
+	updateMaterial();
+}
+
+void GLState::updateMaterial() {
+	GLCache::bindBuffer(GL_UNIFORM_BUFFER, materialUbo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MaterialData), &material);
 }
 
 // Start rotating the camera (click + drag)
@@ -427,68 +955,155 @@ void GLState::offsetCamera(float offset) {
 
 // Display a given .obj file
 void GLState::showObjFile(const std::string& filename, const unsigned int meshType, const glm::mat4& modelMat) {
-	// Load the .obj file if it's not already loaded
-	auto mesh = std::make_shared<Mesh>(filename, static_cast<Mesh::ObjType>(meshType));
-	mesh->setModelMat(modelMat);
+	showObjFile(filename, meshType, std::vector<glm::mat4>{ modelMat });
+}
+
+// Display instances of a given .obj file
+void GLState::showObjFile(const std::string& filename, const unsigned int meshType, const std::vector<glm::mat4>& instanceMats,
+	bool occluder) {
+	// Load the .obj file if it's not already loaded (occluders keep part of their geometry)
+	std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(static_cast<Mesh::ObjType>(meshType));
+	mesh->setOccluder(occluder);
+	if (asyncLoading) {
+		// Add an empty mesh now and fill it in when the loader is done with it
+		if (!meshLoader)
+			meshLoader.reset(new MeshLoader(Mesh::getLoadThreads()));
+		meshLoader->load(mesh, filename);
+	} else {
+		mesh->load(filename);
+		std::cout << "Finished loading " << filename << std::endl;
+	}
+	// Number the instances after those of the other objects
+	unsigned int firstObjectId = 0;
+	for (auto& obj : objects)
+		firstObjectId += obj->getInstanceCount();
+	mesh->setInstances(instanceMats, firstObjectId);
 	objects.push_back(mesh);
 }
 
-// Create shaders and associated state
+// Create shaders and associated state (the scene shader variants are built in getProgram)
 void GLState::initShaders() {
-	// Compile and link shader files
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/v.glsl"));
-	shaders.push_back(compileShader(GL_GEOMETRY_SHADER, "shaders/g.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
-	shader = linkProgram(shaders);
-	std::vector<GLuint> depthShaders;  // the shader to get depth map
-	depthShaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/depth_v.glsl"));
-	depthShaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/depth_f.glsl"));
-	depthShader = linkProgram(depthShaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
-	for (auto s : depthShaders)
-		glDeleteShader(s);
-	depthShaders.clear();
-
-	// Get uniform locations for shader
-	modelMatLoc		 = glGetUniformLocation(shader, "modelMat");
-	lightSpaceMatLoc = glGetUniformLocation(shader, "lightSpaceMat");
-	objTypeLoc		 = glGetUniformLocation(shader, "objType");
-	viewProjMatLoc	 = glGetUniformLocation(shader, "viewProjMat");
-
-	shadingModeLoc	 = glGetUniformLocation(shader, "shadingMode");
-	normalsModeLoc	 = glGetUniformLocation(shader, "normalsMode");
-	tintModeLoc		 = glGetUniformLocation(shader, "tintMode");
-	occlusionModeLoc = glGetUniformLocation(shader, "occlusionMode");
-	specularModeLoc  = glGetUniformLocation(shader, "specularMode");
-	textureModeLoc	 = glGetUniformLocation(shader, "textureMode");
-	contourModeLoc	 = glGetUniformLocation(shader, "contourMode");
-	outlineModeLoc   = glGetUniformLocation(shader, "outlineMode");
-	
-	camPosLoc		 = glGetUniformLocation(shader, "camPos");
-	floorColorLoc	 = glGetUniformLocation(shader, "floorColor");
-	floorAmbStrLoc	 = glGetUniformLocation(shader, "floorAmbStr");
-	floorDiffStrLoc	 = glGetUniformLocation(shader, "floorDiffStr");
-	floorSpecStrLoc	 = glGetUniformLocation(shader, "floorSpecStr");
-	floorSpecExpLoc	 = glGetUniformLocation(shader, "floorSpecExp");
-	modelColorLoc	 = glGetUniformLocation(shader, "modelColor");
-	modelAmbStrLoc	 = glGetUniformLocation(shader, "modelAmbStr");
-	modelDiffStrLoc	 = glGetUniformLocation(shader, "modelDiffStr");
-	modelSpecStrLoc	 = glGetUniformLocation(shader, "modelSpecStr");
-	modelSpecExpLoc	 = glGetUniformLocation(shader, "modelSpecExp");
-
-	// Get uniform locations for depth shader
-	modelMatDepthLoc = glGetUniformLocation(depthShader, "modelMat");
-	lightSpaceMatDepthLoc = glGetUniformLocation(depthShader, "lightSpaceMat");
-
-	// Bind lights uniform block to binding index
-	glUseProgram(shader);
-	GLuint lightBlockIndex = glGetUniformBlockIndex(shader, "LightBlock");
-	glUniformBlockBinding(shader, lightBlockIndex, Light::BIND_PT);
-	glUseProgram(0);
+	// Compile and link shader files (or load them from the program cache)
+	depthShader = buildProgram({
+		{ GL_VERTEX_SHADER, "shaders/depth_v.glsl" },
+		{ GL_FRAGMENT_SHADER, "shaders/depth_f.glsl" } });
+
+	// Bind uniform blocks to binding indices
+	glUniformBlockBinding(depthShader, glGetUniformBlockIndex(depthShader, "FrameBlock"), FRAME_BIND_PT);
+	glUniformBlockBinding(depthShader, glGetUniformBlockIndex(depthShader, "ObjectBlock"), OBJECT_BIND_PT);
+	cascadeLoc = glGetUniformLocation(depthShader, "cascade");
+
+	hullShader = buildProgram({
+		{ GL_VERTEX_SHADER, "shaders/outline_v.glsl" },
+		{ GL_FRAGMENT_SHADER, "shaders/outline_f.glsl" } });
+	glUniformBlockBinding(hullShader, glGetUniformBlockIndex(hullShader, "FrameBlock"), FRAME_BIND_PT);
+	glUniformBlockBinding(hullShader, glGetUniformBlockIndex(hullShader, "ObjectBlock"), OBJECT_BIND_PT);
+}
+
+// Only the modes that change what an object looks like are part of its key, so modes
+// that a shading mode ignores do not compile duplicate variants
+uint32_t GLState::featureKey(Mesh& mesh) const {
+	Mesh::ObjType type = mesh.getMeshType();
+	uint32_t key = (uint32_t)shadingMode << FEATURE_SHADING_SHIFT;
+	if (normalsMode == NORMALSMODE_FACE && shadingMode != SHADINGMODE_NONE)
+		key |= FEATURE_NORMALS_FACE;
+	if (type == Mesh::MODEL_FLOOR) {
+		// The floor is shaded by its shadow alone, unless showing normals
+		if (shadingMode != SHADINGMODE_NORMALS)
+			key = SHADINGMODE_CEL << FEATURE_SHADING_SHIFT;
+		return key | FEATURE_FLOOR;
+	}
+
+	if (outlineMode == OUTLINE_ON)
+		key |= FEATURE_OUTLINE | (mesh.hasAdjacency() ? FEATURE_ADJACENCY : 0);
+	if (shadingMode == SHADINGMODE_NORMALS)
+		return key;
+	if (textureMode == TEXTUREMODE_CONST)
+		key |= FEATURE_TEXTURE_CONST;
+	if (contourMode == CONTOUR_OFF)
+		key |= FEATURE_CONTOUR_OFF;
+	if (shadingMode == SHADINGMODE_CEL) {
+		if (tintMode == TINTMODE_CONST)
+			key |= FEATURE_TINT_CONST;
+		if (occlusionMode == OCCLUSION_OFF)
+			key |= FEATURE_OCCLUSION_OFF;
+		if (specularMode == SPECULAR_OFF)
+			key |= FEATURE_SPECULAR_OFF;
+	}
+	return key;
+}
+
+GLuint GLState::getProgram(uint32_t key) {
+	auto found = programs.find(key);
+	if (found != programs.end())
+		return found->second;
+
+	// Turn the key into the #defines of the shaders
+	std::stringstream ss;
+	ss << "#define SHADING_MODE " << ((key >> FEATURE_SHADING_SHIFT) & 3) << "\n";
+	ss << "#define NORMALS_MODE " << ((key & FEATURE_NORMALS_FACE) ? NORMALSMODE_FACE : NORMALSMODE_INTERPOLATE) << "\n";
+	ss << "#define TINT_MODE " << ((key & FEATURE_TINT_CONST) ? TINTMODE_CONST : TINTMODE_SSS) << "\n";
+	ss << "#define OCCLUSION_MODE " << ((key & FEATURE_OCCLUSION_OFF) ? OCCLUSION_OFF : OCCLUSION_ON) << "\n";
+	ss << "#define SPECULAR_MODE " << ((key & FEATURE_SPECULAR_OFF) ? SPECULAR_OFF : SPECULAR_ON) << "\n";
+	ss << "#define TEXTURE_MODE " << ((key & FEATURE_TEXTURE_CONST) ? TEXTUREMODE_CONST : TEXTUREMODE_TEX) << "\n";
+	ss << "#define CONTOUR_MODE " << ((key & FEATURE_CONTOUR_OFF) ? CONTOUR_OFF : CONTOUR_ON) << "\n";
+	if (key & FEATURE_OUTLINE)
+		ss << "#define OUTLINE\n";
+	if (key & FEATURE_ADJACENCY)
+		ss << "#define ADJACENCY\n";
+	if (key & FEATURE_FLOOR)
+		ss << "#define FLOOR\n";
+	std::string defines = ss.str();
+
+	// Compile and link shader files (the floor needs no geometry shader)
+	std::vector<ShaderStage> stages;
+	stages.push_back({ GL_VERTEX_SHADER, "shaders/v.glsl" });
+	if (!(key & FEATURE_FLOOR))
+		stages.push_back({ GL_GEOMETRY_SHADER, "shaders/g.glsl" });
+	stages.push_back({ GL_FRAGMENT_SHADER, "shaders/f.glsl" });
+	GLuint program = buildProgram(stages, defines);
+	programs[key] = program;
+
+	// Bind uniform blocks to binding indices
+	GLCache::useProgram(program);
+	const std::pair<const char*, GLuint> blocks[] = {
+		{ "FrameBlock", FRAME_BIND_PT }, { "ObjectBlock", OBJECT_BIND_PT },
+		{ "MaterialBlock", MATERIAL_BIND_PT }
+	};
+	for (auto& block : blocks) {
+		GLuint blockIndex = glGetUniformBlockIndex(program, block.first);
+		if (blockIndex != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, blockIndex, block.second);
+	}
+
+	// Point the samplers at their texture units (see Texture::activeTextures and LightClusters)
+	glUniform1i(glGetUniformLocation(program, "texModelColor"), 0);
+	glUniform1i(glGetUniformLocation(program, "texModelSss"), 1);
+	glUniform1i(glGetUniformLocation(program, "texModelNrm"), 2);
+	glUniform1i(glGetUniformLocation(program, "texModelIlm"), 3);
+	glUniform1i(glGetUniformLocation(program, "shadowMap"), 4);
+	glUniform1i(glGetUniformLocation(program, "lightData"), Light::DATA_UNIT);
+	glUniform1i(glGetUniformLocation(program, "lightGrid"), LightClusters::GRID_UNIT);
+	glUniform1i(glGetUniformLocation(program, "lightIndices"), LightClusters::INDEX_UNIT);
+	return program;
+}
+
+// Create the per-frame, material and per-object uniform buffers
+void GLState::initUBOs() {
+	glGenBuffers(1, &frameUbo);
+	GLCache::bindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+	GLCache::bindBufferBase(GL_UNIFORM_BUFFER, FRAME_BIND_PT, frameUbo);
+	glGenBuffers(1, &materialUbo);
+	GLCache::bindBuffer(GL_UNIFORM_BUFFER, materialUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialData), &material, GL_DYNAMIC_DRAW);
+	GLCache::bindBufferBase(GL_UNIFORM_BUFFER, MATERIAL_BIND_PT, materialUbo);
+
+	// Object records are bound with glBindBufferRange, whose offsets must be aligned
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	objectStride = (sizeof(ObjectData) + alignment - 1) / alignment * alignment;
+	glGenBuffers(1, &objectUbo);
 }
 
 
@@ -546,32 +1161,54 @@ void GLState::readConfig(std::string filename) {
 		ss.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
 
 		ss >> numObjects;  // get number of objects
-		std::vector<std::pair<std::string, unsigned int>> objNamesTypes;  // model names and their types
-		for (unsigned int i = 0; i < numObjects; i++) {
-			// Read .obj filename
-			std::string objName;
+		struct ObjEntry {
+			std::string name;			// .obj filename
 			unsigned int meshType;
-			ss >> objName;
-			ss >> meshType;
-			objNamesTypes.push_back(std::make_pair(objName, meshType));
+			unsigned int instances;		// Copies of the model, each with its own transform
+			bool occluder;				// Whether it hides the objects behind it
+		};
+		std::vector<ObjEntry> objEntries;
+		for (unsigned int i = 0; i < numObjects; i++) {
+			// Read .obj filename, type and optionally "instances N" and "occluder"
+			ObjEntry entry;
+			ss >> entry.name;
+			ss >> entry.meshType;
+			entry.instances = 1;
+			entry.occluder = false;
+			while (true) {
+				std::streampos pos = ss.tellg();
+				std::string keyword;
+				ss >> keyword;
+				if (keyword == "instances") {
+					ss >> entry.instances;
+					if (entry.instances == 0)
+						throw std::runtime_error(entry.name + " must have at least 1 instance");
+				} else if (keyword == "occluder")
+					entry.occluder = true;
+				else {
+					ss.seekg(pos);
+					break;
+				}
+			}
+			objEntries.push_back(entry);
 		}
 
-		for (auto& objNameType : objNamesTypes) {
-			std::string objName = objNameType.first;
-			unsigned int meshType = objNameType.second;
-
-			glm::mat3 rotMat;  // rotation matrix
-			glm::vec3 translation;  // translation vector
-			for (int i = 0; i < 3; i++) {
-				for (int j = 0; j < 3; j++) {
-					ss >> rotMat[i][j];
+		for (auto& entry : objEntries) {
+			// One rotation matrix and translation vector per instance
+			std::vector<glm::mat4> instanceMats;
+			for (unsigned int k = 0; k < entry.instances; k++) {
+				glm::mat3 rotMat;  // rotation matrix
+				glm::vec3 translation;  // translation vector
+				for (int i = 0; i < 3; i++) {
+					for (int j = 0; j < 3; j++) {
+						ss >> rotMat[i][j];
+					}
 				}
+				for (int i = 0; i < 3; i++)
+					ss >> translation[i];
+				instanceMats.push_back(calModelMat(rotMat, translation));  // model matrix
 			}
-			for (int i = 0; i < 3; i++)
-				ss >> translation[i];
-
-			glm::mat4 modelMat = calModelMat(rotMat, translation);  // model matrix
-			showObjFile(objName, static_cast<Mesh::ObjType>(meshType), modelMat);  // add this object to the scene
+			showObjFile(entry.name, static_cast<Mesh::ObjType>(entry.meshType), instanceMats, entry.occluder);  // add this object to the scene
 		}
 
 		// Objects attributes
@@ -611,10 +1248,25 @@ void GLState::readConfig(std::string filename) {
 				ss >> lightColor.r >> lightColor.g >> lightColor.b;
 				ss >> lightPos.x >> lightPos.y >> lightPos.z;
 				lightColor /= 255.0f;
+				// Optionally "range R": a point light fades out to nothing at distance R (the
+				// last light may end the file, so reaching the end is no error here)
+				float range = 0.0f;
+				std::streampos pos = ss.tellg();
+				std::string keyword;
+				ss.exceptions(std::ios::badbit);
+				ss >> keyword;
+				if (keyword == "range")
+					ss >> range;
+				else {
+					ss.clear();
+					ss.seekg(pos);
+				}
+				ss.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
 				lights[i].setEnabled((bool)enabled);
 				lights[i].setType((Light::LightType)type);
 				lights[i].setColor(lightColor);
 				lights[i].setPos(lightPos);
+				lights[i].setRange(range);
 
 			// Disable all other lights
 			} else
@@ -629,6 +1281,41 @@ void GLState::readConfig(std::string filename) {
 	}
 }
 
+float GLState::pixelsPerUnit(Mesh& mesh, float projScale, bool perspective, const glm::vec3& eye) {
+	auto bb = mesh.boundingBox();
+	float pixels = 0.0f;
+	for (unsigned int i = 0; i < mesh.getInstanceCount(); i++) {
+		const glm::mat4& modelMat = mesh.getInstanceMat(i);
+		float scale = glm::max(glm::length(glm::vec3(modelMat[0])),
+			glm::max(glm::length(glm::vec3(modelMat[1])), glm::length(glm::vec3(modelMat[2]))));
+		if (!perspective) {
+			pixels = glm::max(pixels, projScale * scale);
+			continue;
+		}
+
+		// Distance to the nearest point of the bounding sphere, clamped to the near plane
+		glm::vec3 center = glm::vec3(modelMat * glm::vec4((bb.first + bb.second) * 0.5f, 1.0f));
+		float radius = glm::length(bb.second - bb.first) * 0.5f * scale;
+		float dist = glm::max(glm::length(eye - center) - radius, 0.1f);
+		pixels = glm::max(pixels, projScale * scale / dist);
+	}
+	return pixels;
+}
+
+float GLState::nearestDistance(Mesh& mesh, const glm::vec3& eye) {
+	auto bb = mesh.boundingBox();
+	float nearest = std::numeric_limits<float>::max();
+	for (unsigned int i = 0; i < mesh.getInstanceCount(); i++) {
+		const glm::mat4& modelMat = mesh.getInstanceMat(i);
+		float scale = glm::max(glm::length(glm::vec3(modelMat[0])),
+			glm::max(glm::length(glm::vec3(modelMat[1])), glm::length(glm::vec3(modelMat[2]))));
+		glm::vec3 center = glm::vec3(modelMat * glm::vec4((bb.first + bb.second) * 0.5f, 1.0f));
+		float radius = glm::length(bb.second - bb.first) * 0.5f * scale;
+		nearest = glm::min(nearest, glm::max(glm::length(eye - center) - radius, 0.0f));
+	}
+	return nearest;
+}
+
 glm::mat4 GLState::calModelMat(const glm::mat3 rotMat, const glm::vec3 translation) {
 	glm::mat4 modelMat = glm::mat4(1.0);  // initialize the matrix as an identity matrix
 	glm::mat4 rotateMat = glm::mat4(1.0);
@@ -4,11 +4,23 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
 #include "mesh.hpp"
+#include "meshloader.hpp"
 #include "light.hpp"
 #include "texture.hpp"
+#include "edgeoutline.hpp"
+#include "renderqueue.hpp"
+#include "frustumcull.hpp"
+#include "occlusioncull.hpp"
+#include "lightclusters.hpp"
+#include "workerpool.hpp"
+#include "parallel.hpp"
 
 // Manages OpenGL state, e.g. camera transform, objects, shaders
 class GLState {
@@ -60,6 +72,24 @@ public:
 	enum OutlineMode {
 		OUTLINE_ON = 0,      // Toggle outline
 		OUTLINE_OFF = 1,     // Turn off
+		OUTLINE_HULL = 2,    // Inverted hull pass from the outline normals (no geometry shader)
+		OUTLINE_SCREEN = 3,  // Screen-space edge detection post-process (EdgeOutline)
+	};
+	enum ShadowCacheMode {
+		SHADOWCACHE_OFF = 0,	// Draw the depth map every frame
+		SHADOWCACHE_ON = 1,		// Redraw it only when the light or a shadow caster changed
+		SHADOWCACHE_SPLIT = 2,	// Cache the static casters in a depth map of their own and redraw
+								// only the moving ones, over a copy of it
+	};
+	enum ShadowKernel {
+		SHADOWKERNEL_GRID = 0,		// Square grid of samples, rotated to break up the stair steps
+		SHADOWKERNEL_POISSON = 1,	// Poisson disk of samples, rotated per pixel
+	};
+	enum ShadowQuality {
+		SHADOWQUALITY_LOW = 0,		// 1 sample (the 2x2 texels of the hardware comparison)
+		SHADOWQUALITY_MEDIUM = 1,	// 4 samples
+		SHADOWQUALITY_HIGH = 2,		// 9 samples
+		SHADOWQUALITY_ULTRA = 3,	// 16 samples
 	};
 
 	bool isInit() const { return init; }
@@ -126,17 +156,105 @@ public:
 	inline float getRotStep() { return rotStep; }
 	void update_time(float time);
 
+	// Whether meshes and textures load in the background (objects appear once uploaded);
+	// set before initializeGL
+	void setAsyncLoading(bool async) { asyncLoading = async; }
+	bool getAsyncLoading() const { return asyncLoading; }
+	// Whether to skip objects outside the camera frustum in the main pass and outside the
+	// light frustum in the shadow pass
+	void setFrustumCulling(bool cull) { frustumCulling = cull; }
+	bool getFrustumCulling() const { return frustumCulling; }
+	// Whether to skip objects hidden behind the occluders (see Mesh::setOccluder) in the
+	// main pass
+	void setOcclusionCulling(bool cull) { occlusionCulling = cull; }
+	bool getOcclusionCulling() const { return occlusionCulling; }
+	// When to redraw the shadow map
+	void setShadowCacheMode(ShadowCacheMode mode);
+	ShadowCacheMode getShadowCacheMode() const { return shadowCacheMode; }
+	// Shadow cascades (1 to MAX_CASCADES), each a mapSize x mapSize depth map covering a
+	// slice of the camera frustum; set before initializeGL
+	void setShadowCascades(unsigned int count, unsigned int mapSize);
+	unsigned int getShadowCascades() const { return cascadeCount; }
+	unsigned int getShadowMapSize() const { return shadowMapSize; }
+	static const unsigned int MAX_CASCADES = 4;
+	static const unsigned int MAX_SHADOW_MAP_SIZE = 16384;	// The driver's GL_MAX_TEXTURE_SIZE may be lower
+	// Filtering of the shadow edges: the sample pattern and how many samples it has
+	void setShadowKernel(ShadowKernel kernel);
+	void setShadowQuality(ShadowQuality quality);
+	ShadowKernel getShadowKernel() const { return shadowKernel; }
+	ShadowQuality getShadowQuality() const { return shadowQuality; }
+	static const unsigned int MAX_SHADOW_TAPS = 16;
+	// Width in pixels of the screen-space outline (OUTLINE_SCREEN)
+	void setEdgeLineWidth(float width) { edges.setLineWidth(width); }
+	float getEdgeLineWidth() const { return edges.getLineWidth(); }
+
 	// Set object to display
 	void showObjFile(const std::string& filename, const unsigned int meshType, const glm::mat4& modelMat);
+	// Display an object once for every model matrix, with one instanced draw per pass;
+	// occluders hide the objects behind them from the main pass
+	void showObjFile(const std::string& filename, const unsigned int meshType, const std::vector<glm::mat4>& instanceMats,
+		bool occluder = false);
 
 protected:
 	bool init;  // Whether we've been initialized yet
 
 	// Initialization
 	void initShaders();
+	void initUBOs();
+	// Shader variants: the features of the current drawing modes for a type of object,
+	// and the program compiled with them (built on first use)
+	uint32_t featureKey(Mesh& mesh) const;
+	GLuint getProgram(uint32_t key);
+	// Upload the material properties
+	void updateMaterial();
+	// Write the object records of this frame into the object ring
+	size_t writeObjectData();
+	// Count the primitives and GPU time of the previous frame and start the queries for this one
+	void beginPrimitivesQuery();
+	// Gather the world bounds of the instances and of the whole scene
+	void updateBounds();
+	// Fit the shadow cascades to slices of the camera frustum and to the scene bounds;
+	// returns the distance from the light to the farthest point of the scene
+	float fitCascades(const glm::mat4& view, float aspect, float zNear, float zFar);
+	// Test the world bounds of the instances against the camera frustum and the cascades
+	void cullObjects(const glm::mat4& viewProjMat);
+	// Whether any instance of an object is marked in a per-instance vector
+	bool anyInstance(const std::vector<uint8_t>& marks, size_t object) const;
+	// The instances of an object that a pass draws: a run of its draw list (Mesh::setDrawList)
+	struct InstanceRun {
+		uint32_t first = 0;
+		uint32_t count = 0;
+	};
+	// Append the object's instances that "visible" marks to drawList as a run, or return
+	// the equal run among the object's runs so far (so passes that agree share theirs)
+	InstanceRun appendRun(const std::vector<uint8_t>& visible, size_t object,
+		const InstanceRun* runs, unsigned int runCount);
+	// Start testing the objects in the camera frustum against the occluders on a frame
+	// worker, as occlusionJob; returns whether there is anything to do
+	bool startOcclusionCulling(const glm::mat4& viewProjMat);
+	// Count a frame of culling, printing the totals when GLCache reports
+	void reportCulling();
+	// Pick the level of detail of each shadow caster in each cascade and whether it moves;
+	// returns a bit for each cascade whose cached (static) depth map is out of date
+	unsigned int updateShadowCasters();
+	// Draw the shadow casters of a pass and cascade into the bound depth map
+	void drawShadowPass(RenderQueue::Pass pass, unsigned int cascade, size_t objectBase);
+	// Count the GPU time of the cascade's previous draw and start timing this one
+	void beginCascadeQuery(unsigned int cascade);
+	void collectCascadeQuery(unsigned int cascade);
+	// Count a frame of shadow map caching, printing the totals when GLCache reports
+	void reportShadowCache();
 
 	// Calculate model matrix from rotation and translation
 	static glm::mat4 calModelMat(const glm::mat3 rotMat, const glm::vec3 translation);
+	// Size in pixels of one model-space unit of an object, for choosing its level of detail.
+	// projScale is the projection's pixels per unit at distance 1; with a perspective
+	// projection the size is divided by the distance from eye to the object's bounds.
+	// Instanced objects take the largest size of their instances.
+	static float pixelsPerUnit(Mesh& mesh, float projScale, bool perspective, const glm::vec3& eye);
+	// Distance from eye to the bounding sphere of an object's nearest instance (0 inside it),
+	// for sorting draws front to back
+	static float nearestDistance(Mesh& mesh, const glm::vec3& eye);
 
 	// Drawing modes
 	ShadingMode 	shadingMode;
@@ -162,40 +280,204 @@ protected:
 	// Mesh and lights
 	std::vector<std::shared_ptr<Mesh>> objects;		// Pointer to mesh object
 	std::vector<Light> lights;		// Lights
+	bool asyncLoading = true;		// Whether to load meshes in the background
+	std::unique_ptr<MeshLoader> meshLoader;	// Background loader (while meshes are loading)
+	static const size_t UPLOAD_BYTES_PER_FRAME = 4 << 20;	// Mesh data uploaded per frame
 
 	unsigned int numObjects;  // Number of objects in the scene
 	unsigned int activeObj = 1;   // The current active model (1-3)
 	float moveStep = 0.1f;  // Translation step
 	float rotStep = 3.14159265 / 24;
 	float outlineFactor = 0.003f;
+	float lodPixelError = 1.0f;	// Largest simplification error on screen, in pixels
+
+	// Draws of the current frame, sorted before submission
+	RenderQueue queue;
+
+	// Frustum culling
+	bool frustumCulling = true;
+	CullBounds cullBounds;				// World bounds of every instance, object after object
+	std::vector<unsigned int> firstBox;	// Per object: box of its first instance (and the box count last)
+	std::vector<uint8_t> camVisible;	// Per instance: whether it is in the camera frustum
+	std::vector<uint8_t> cascadeVisible[MAX_CASCADES];	// Per instance: whether it is in a cascade
+	std::vector<unsigned int> drawList;	// Of the object being queued (see appendRun)
+	glm::vec3 sceneMinBB, sceneMaxBB;	// World bounds of the objects ready to draw
+	// Occlusion culling (runs while the shadow pass is drawn)
+	bool occlusionCulling = true;
+	OcclusionCuller occlusion;
+	std::vector<const Mesh*> occluders;		// Of this frame
+	std::vector<uint8_t> occlusionTest;		// Per instance: whether to test it (occluders are not)
+	std::vector<uint8_t> unoccluded;		// Per instance: in the camera frustum and not occluded
+	WorkerPool::Batch occlusionJob;
+	// Threads for the per-frame jobs, which the OpenGL thread helps with (declared after
+	// the data of the jobs, so it stops before that is destroyed)
+	static constexpr unsigned int FRAME_THREADS = 3;
+	WorkerPool frameWorkers{ std::min(FRAME_THREADS, hardwareThreads() - 1) };
+	struct CullStats {
+		unsigned long objects = 0;		// Objects ready to draw
+		unsigned long camCulled = 0;	// Of those, culled from the main pass
+		unsigned long lightCulled = 0;	// Culled from the shadow pass
+		unsigned long instances = 0;	// Instances of the objects ready to draw
+		unsigned long camCulledInstances = 0;
+		unsigned long lightCulledInstances = 0;
+		unsigned long tested = 0;		// Instances tested against the occluders
+		unsigned long occluded = 0;		// Of those, hidden
+		unsigned long occluderTriangles = 0;
+		double occlusionMs = 0.0;		// Occlusion culling on the worker
+		double occlusionWaitMs = 0.0;	// The OpenGL thread waiting for it
+		unsigned int frames = 0;
+	} cullStats;
+
+	// Shadow cascades: slices of the camera frustum from near to far, each with an
+	// orthographic light projection around the slice's bounding sphere
+	unsigned int cascadeCount = 3;
+	unsigned int shadowMapSize = 2048;	// Texels per side of each cascade's map
+	struct Cascade {
+		glm::mat4 lightSpaceMat;	// World-to-light transform
+		float far = 0.0f;			// View depth where the slice ends
+		float texelsPerUnit = 0.0f;	// Map texels per world unit
+	};
+	Cascade cascades[MAX_CASCADES];
+	static constexpr float CASCADE_SPLIT_BLEND = 0.6f;	// Logarithmic (1) to uniform (0) splits
+	GLint cascadeLoc = -1;			// Cascade uniform of the depth shader
+
+	// Percentage-closer filtering of the shadow maps
+	ShadowKernel shadowKernel = SHADOWKERNEL_POISSON;
+	ShadowQuality shadowQuality = SHADOWQUALITY_MEDIUM;
+	unsigned int shadowTaps = 0;
+	glm::vec4 shadowKernelTaps[MAX_SHADOW_TAPS];	// Offsets in texels (.xy)
+	void updateShadowKernel();
+
+	// Shadow map caching
+	ShadowCacheMode shadowCacheMode = SHADOWCACHE_SPLIT;
+	struct ShadowCaster {
+		const Mesh* mesh = nullptr;		// Object the record belongs to
+		unsigned long changeCount = 0;	// Mesh::getChangeCount when last seen
+		unsigned int stillFrames = 0;	// Frames since the object last moved
+		bool moving = false;			// This frame: drawn over the static depth maps
+		struct Layer {
+			bool casts = false;			// This frame: ready and in the cascade
+			unsigned int lod = 0;		// This frame: level of detail
+			bool cached = false;		// Drawn into the cached depth map, with:
+			unsigned int cachedLod = 0;
+			unsigned long cachedChange = 0;
+		} cascades[MAX_CASCADES];
+	};
+	std::vector<ShadowCaster> shadowCasters;	// Per object
+	glm::mat4 cachedLightSpaceMats[MAX_CASCADES];	// Of the cached depth maps
+	bool shadowCacheValid = false;		// Whether the cached depth maps may be reused
+	bool movingCastersDrawn[MAX_CASCADES] = {};	// Whether a depth map holds moving casters
+	// Frames an object must stay still before it joins the static casters (which redraws them)
+	static const unsigned int SHADOW_STILL_FRAMES = 30;
+	struct ShadowStats {
+		unsigned long staticDraws[MAX_CASCADES] = {};	// Frames the (static) depth map was drawn
+		unsigned long movingDraws[MAX_CASCADES] = {};	// Frames the moving casters were drawn
+		unsigned long drawn[MAX_CASCADES] = {};			// Frames the cascade was drawn
+		unsigned long casters[MAX_CASCADES] = {};		// Casters drawn
+		double gpuMs[MAX_CASCADES] = {};				// GPU time of the timed frames
+		unsigned long timed[MAX_CASCADES] = {};
+		unsigned int frames = 0;
+	} shadowStats;
+	// GPU time of each cascade, measured with a query while GLCache reports
+	GLuint cascadeQueries[MAX_CASCADES] = {};
+	bool cascadeQueryPending[MAX_CASCADES] = {};	// Whether the query holds a draw not yet counted
+
+	// Primitives generated by the main pass and its GPU time (which includes the shadow
+	// filtering), counted with queries while GLCache reports
+	GLuint primitivesQuery = 0, mainTimeQuery = 0;
+	bool primitivesPending = false;	// Whether the queries hold a frame not yet counted
+	unsigned long primitivesTotal = 0;
+	double mainGpuMs = 0.0;
+	unsigned int primitivesFrames = 0;
 
 	// Textures
 	Texture textures;
+	// Offscreen target and filter of the screen-space outline
+	EdgeOutline edges;
+	// Lights of each cluster of the camera frustum
+	LightClusters clusters;
+	bool texturesReady = false;	// Whether the textures have been created
+
+	// Startup timing
+	std::chrono::steady_clock::time_point startTime;	// When initializeGL was called
+	bool firstFrameDrawn = false;
+	bool loadReported = false;	// Whether the end of loading was reported
+	std::string lastLoaded;		// Asset that finished loading last (critical path)
+
+	// Per-frame shader data, laid out for the std140 FrameBlock uniform block
+	struct FrameData {
+		glm::mat4 viewProjMat;		// World-to-clip transform
+		glm::mat4 lightSpaceMats[MAX_CASCADES];	// World-to-light transform of each cascade
+		glm::vec4 cascadeFar;		// View depth where each cascade ends
+		glm::vec3 camPos;			// World-space camera position
+		float outline;				// Outline width (0 = no outline)
+		int cascadeCount;
+		int shadowTaps;				// Shadow map samples per fragment
+		int shadowRotate;			// Whether the samples are rotated per pixel
+		int padding;
+		glm::vec4 shadowKernel[MAX_SHADOW_TAPS];	// Sample offsets in texels (.xy)
+		glm::vec4 clusterScale;		// Light cluster lookup (LightClusters::getScale)
+		glm::ivec3 clusterCount;	// Light clusters along x, y and depth
+		int globalLights;			// Lights reaching every fragment (LightClusters::getGlobalCount)
+		int shadowLight;			// Light data entry of the light casting the shadows (-1 = none)
+		int padding2[3];
+	};
+	// The std140 offsets of shaders/frame_block.glsl (vec2 array elements take 16 bytes)
+	static_assert(MAX_CASCADES == 4 && MAX_SHADOW_TAPS == 16, "frame_block.glsl sizes its arrays with these");
+	static_assert(offsetof(FrameData, lightSpaceMats) == 64, "FrameBlock layout");
+	static_assert(offsetof(FrameData, cascadeFar) == 320, "FrameBlock layout");
+	static_assert(offsetof(FrameData, camPos) == 336, "FrameBlock layout");
+	static_assert(offsetof(FrameData, outline) == 348, "FrameBlock layout");
+	static_assert(offsetof(FrameData, cascadeCount) == 352, "FrameBlock layout");
+	static_assert(offsetof(FrameData, shadowTaps) == 356, "FrameBlock layout");
+	static_assert(offsetof(FrameData, shadowRotate) == 360, "FrameBlock layout");
+	static_assert(offsetof(FrameData, shadowKernel) == 368, "FrameBlock layout");
+	static_assert(offsetof(FrameData, clusterScale) == 624, "FrameBlock layout");
+	static_assert(offsetof(FrameData, clusterCount) == 640, "FrameBlock layout");
+	static_assert(offsetof(FrameData, globalLights) == 652, "FrameBlock layout");
+	static_assert(offsetof(FrameData, shadowLight) == 656, "FrameBlock layout");
+	static_assert(sizeof(FrameData) == 672, "FrameBlock layout");
+	// Per-mesh shader data, laid out for the std140 ObjectBlock uniform block (the model
+	// matrices and object IDs are per-instance attributes, see Mesh::Instance)
+	struct ObjectData {
+		glm::vec3 posScale;			// Vertex position decoding (see Mesh::getPosScale)
+		int objType;				// Mesh::ObjType
+		glm::vec3 posOffset;
+		int octNormals;				// Whether normals are octahedral-encoded
+	};
+	// Material properties, laid out for the std140 MaterialBlock uniform block
+	struct MaterialData {
+		glm::vec3 floorColor;		// Object color
+		float floorAmbStr;			// Ambient strength
+		float floorDiffStr;			// Diffuse strength
+		float floorSpecStr;			// Specular strength
+		float floorSpecExp;			// Specular exponent
+		float padding0;
+		glm::vec3 modelColor;
+		float modelAmbStr;
+		float modelDiffStr;
+		float modelSpecStr;
+		float modelSpecExp;
+		float padding1;
+	} material;
+	static const GLuint FRAME_BIND_PT = 1;		// Uniform buffer binding points
+	static const GLuint OBJECT_BIND_PT = 2;
+	static const GLuint MATERIAL_BIND_PT = 3;
+	static const unsigned int OBJECT_RING_FRAMES = 3;	// Frames of object data in flight
+
+	// Uniform buffers
+	GLuint frameUbo = 0;			// FrameData, rewritten every frame
+	GLuint materialUbo = 0;			// MaterialData
+	GLuint objectUbo = 0;			// Ring of ObjectData records, one segment per frame
+	size_t objectStride = 0;		// Bytes between records (rounded up to the offset alignment)
+	size_t objectSegmentBytes = 0;	// Capacity of each segment
+	unsigned int objectSegment = 0;	// Segment written this frame
+	std::vector<unsigned char> objectStaging;	// CPU copy of this frame's records
 
 	// Shader state
-	GLuint shader;			       // GPU shader program
+	std::unordered_map<uint32_t, GLuint> programs;	// Shader variants by feature key
 	GLuint depthShader;	           // Depth shader program
-	GLuint modelMatLoc;	           // Model-to-world matrix location, used in shader
-	GLuint modelMatDepthLoc;	   // Model-to-world matrix location, used in depth shader
-	GLuint lightSpaceMatLoc;       // World-to-light matrix location, used in shader
-	GLuint lightSpaceMatDepthLoc;  // World-to-light matrix location, used in depth 
-	GLuint objTypeLoc;             // Object type location (decide which material attributes to use and which texture to map)
-	GLuint viewProjMatLoc;	       // World-to-clip matrix location
-	GLuint shadingModeLoc;	       // Shading mode location
-	GLuint normalsModeLoc;
-	GLuint tintModeLoc;
-	GLuint occlusionModeLoc;
-	GLuint specularModeLoc;
-	GLuint textureModeLoc;
-	GLuint contourModeLoc;
-	GLuint outlineModeLoc;		   // Outline mode location
-	GLuint camPosLoc;		       // Camera position location
-	GLuint floorColorLoc, 	modelColorLoc;		    // Object color
-	GLuint floorAmbStrLoc, 	modelAmbStrLoc;		// Ambient strength location
-	GLuint floorDiffStrLoc, modelDiffStrLoc;		// Diffuse strength location
-	GLuint floorSpecStrLoc, modelSpecStrLoc;		// Specular strength location
-	GLuint floorSpecExpLoc, modelSpecExpLoc;		// Specular exponent location
-	GLuint featureToggleLoc[10];
+	GLuint hullShader;	           // Inverted hull outline program
 	float cur_time;
 };
 
@@ -3,13 +3,15 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "light.hpp"
-#include "util.hpp"
+#include "programcache.hpp"
+#include "glcache.hpp"
 #include <iostream>
 
 // Static Light members (OpenGL state)
 unsigned int Light::refcount = 0;
 std::array<bool, Light::MAX_LIGHTS> Light::enabledLights;
-GLuint Light::ubo = 0;
+GLuint Light::buffer = 0;
+GLuint Light::texture = 0;
 GLuint Light::shader = 0;
 GLuint Light::vao = 0;
 GLuint Light::vbuf = 0;
@@ -21,10 +23,10 @@ float Light::iconScale = 0.06f;
 
 // LightData constructor
 Light::LightData::LightData() :
-	enabled(false),
-	type((int)POINT),
 	pos(0.0, 2.0, 0.0),
-	color(1.0, 1.0, 1.0) {}
+	type((float)POINT),
+	color(1.0, 1.0, 1.0),
+	range(0.0f) {}
 
 // Constructor
 Light::Light() :
@@ -50,10 +52,11 @@ Light::~Light() {
 // Move constructor
 Light::Light(Light&& other) :
 	data(other.data),
+	enabled(other.enabled),
 	index(other.index),
 	rotating(false) {
 
-	other.data.enabled = false;
+	other.enabled = false;
 	other.index = -1;
 	// Increment reference count (temp will decrement upon destructor)
 	refcount++;
@@ -62,10 +65,11 @@ Light::Light(Light&& other) :
 // Move assignment
 Light& Light::operator=(Light&& other) {
 	data = other.data;
+	enabled = other.enabled;
 	index = other.index;
 	rotating = false;
 
-	other.data.enabled = false;
+	other.enabled = false;
 	other.index = -1;
 	// Refcount stays the same
 
@@ -73,9 +77,9 @@ Light& Light::operator=(Light&& other) {
 }
 
 // Allow light to affect the scene
-void Light::setEnabled(bool enabled) {
+void Light::setEnabled(bool enable) {
 	// Assign an index upon enabling
-	if (enabled && index < 0) {
+	if (enable && index < 0) {
 		index = findAvailableIndex();
 		if (index < 0)
 			throw std::runtime_error("Cannot enable more than "
@@ -83,10 +87,10 @@ void Light::setEnabled(bool enabled) {
 		enabledLights[index] = true;
 	}
 
-	data.enabled = enabled;
-	// Update UBO
+	enabled = enable;
+	// Update the light data
 	if (index >= 0)
-		updateUBO();
+		updateBuffer();
 
 	// Relinquish index if disabled
 	if (!enabled && index >= 0) {
@@ -97,27 +101,35 @@ void Light::setEnabled(bool enabled) {
 
 // Point-light or direcitonal-light
 void Light::setType(LightType type) {
-	data.type = type;
+	data.type = (float)type;
 
-	// Update UBO
-	if (data.enabled && index >= 0)
-		updateUBO();
+	// Update the light data
+	if (enabled && index >= 0)
+		updateBuffer();
 }
 
 void Light::setPos(glm::vec3 pos) {
 	data.pos = pos;
 
-	// Update UBO
-	if (data.enabled && index >= 0)
-		updateUBO();
+	// Update the light data
+	if (enabled && index >= 0)
+		updateBuffer();
 }
 
 void Light::setColor(glm::vec3 color) {
 	data.color = color;
 
-	// Update UBO
-	if (data.enabled && index >= 0)
-		updateUBO();
+	// Update the light data
+	if (enabled && index >= 0)
+		updateBuffer();
+}
+
+void Light::setRange(float range) {
+	data.range = range;
+
+	// Update the light data
+	if (enabled && index >= 0)
+		updateBuffer();
 }
 
 // Set initial rotation state
@@ -170,7 +182,7 @@ void Light::offsetLight(float offset) {
 }
 
 void Light::drawIcon(glm::mat4 viewProj) const {
-	glUseProgram(shader);
+	GLCache::useProgram(shader);
 
 	// Get light position in NDC space
 	glm::vec4 clipPos = viewProj * glm::vec4(data.pos, 1.0f);
@@ -189,21 +201,18 @@ void Light::drawIcon(glm::mat4 viewProj) const {
 	// Set color of icon
 	glUniform3fv(colorLoc, 1, glm::value_ptr(data.color));
 
-	glBindVertexArray(vao);
+	GLCache::bindVertexArray(vao);
 
-	if (data.type == POINT)
+	if (getType() == POINT)
 		glDrawArrays(GL_LINES, 0, vcountPoint);
-	else if (data.type == DIRECTIONAL)
+	else if (getType() == DIRECTIONAL)
 		glDrawArrays(GL_LINES, vcountPoint, vcountDir);
-
-	glBindVertexArray(0);
-	glUseProgram(0);
 }
 
-// Create UBO and icon state
+// Create the light data and icon state
 void Light::initializeGL() {
-	// Light data uniform creation
-	initUBO();
+	// Light data creation
+	initBuffer();
 
 	// Icon state creation
 	initShader();
@@ -212,36 +221,37 @@ void Light::initializeGL() {
 
 // Destroy OpenGL state
 void Light::destroyGL() {
-	if (ubo) { glDeleteBuffers(1, &ubo); ubo = 0; }
-	if (shader) { glDeleteProgram(shader); shader = 0; }
-	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
-	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
+	if (texture) { GLCache::deleteTexture(texture); texture = 0; }
+	if (buffer) { GLCache::deleteBuffer(buffer); buffer = 0; }
+	if (shader) { GLCache::deleteProgram(shader); shader = 0; }
+	if (vao) { GLCache::deleteVertexArray(vao); vao = 0; }
+	if (vbuf) { GLCache::deleteBuffer(vbuf); vbuf = 0; }
 }
 
-// Create Light data uniform buffer
-void Light::initUBO() {
+// Create the light data buffer and the texture buffer the shaders read it through (the
+// lights a fragment uses are listed by LightClusters)
+void Light::initBuffer() {
 	enabledLights.fill(false);
 	std::vector<LightData> emptyLights(MAX_LIGHTS);
 
-	// Create the uniform buffer and fill with empty lights
-	glGenBuffers(1, &ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-	glBufferData(GL_UNIFORM_BUFFER, emptyLights.size() * sizeof(LightData),
+	// Create the buffer and fill with empty lights
+	glGenBuffers(1, &buffer);
+	GLCache::bindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, emptyLights.size() * sizeof(LightData),
 		emptyLights.data(), GL_STATIC_DRAW);
 
-	// Set the binding point index of the buffer
-	glBindBufferBase(GL_UNIFORM_BUFFER, BIND_PT, ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glGenTextures(1, &texture);
+	GLCache::bindTexture(DATA_UNIT, texture, GL_TEXTURE_BUFFER);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer);
 }
 
-// Update this light's entry in the uniform buffer
-void Light::updateUBO() {
+// Update this light's entry in the light data
+void Light::updateBuffer() {
 	if (index < 0) return;
 
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, index * sizeof(LightData),
+	GLCache::bindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferSubData(GL_TEXTURE_BUFFER, index * sizeof(LightData),
 		sizeof(LightData), &data);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 // Loop through array of lights to find the first available index
@@ -258,14 +268,9 @@ int Light::findAvailableIndex() {
 
 // Compile and link shader
 void Light::initShader() {
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/icon_v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/icon_f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
+	shader = buildProgram({
+		{ GL_VERTEX_SHADER, "shaders/icon_v.glsl" },
+		{ GL_FRAGMENT_SHADER, "shaders/icon_f.glsl" } });
 
 	// Get uniform locations
 	colorLoc = glGetUniformLocation(shader, "color");
@@ -318,19 +323,15 @@ void Light::initGeometry() {
 
 	// Create vertex array object
 	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	GLCache::bindVertexArray(vao);
 
 	// Send geometry to vertex buffer
 	glGenBuffers(1, &vbuf);
-	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
+	GLCache::bindBuffer(GL_ARRAY_BUFFER, vbuf);
 	glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(glm::vec2),
 		verts.data(), GL_STATIC_DRAW);
 
 	// Specify vertex format
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (GLvoid*)0);
-
-	// Reset state
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
@@ -4,6 +4,7 @@
 #include <array>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "glcache.hpp"
 
 class Light {
 public:
@@ -21,22 +22,29 @@ public:
 		DIRECTIONAL = 1,
 	};
 
-	static const int BIND_PT = 0;
-	static const int MAX_LIGHTS = 1;
+	static const int MAX_LIGHTS = 1024;
+	// Texture unit of the light data: two RGBA32F texels per light (see LightData)
+	static const GLuint DATA_UNIT = 8;
+	static void bindData() { GLCache::bindTexture(DATA_UNIT, texture, GL_TEXTURE_BUFFER); }
 
 	// Render a graphical representation of the light source
 	void drawIcon(glm::mat4 xform) const;
 
 	// Accessors
-	bool getEnabled() const { return data.enabled; }
+	bool getEnabled() const { return enabled; }
 	LightType getType() const { return (LightType)data.type; }
 	glm::vec3 getPos() const { return data.pos; }
 	glm::vec3 getColor() const { return data.color; }
+	float getRange() const { return data.range; }
+	// Whether the light reaches every point (directional, or a point light without a range)
+	bool isGlobal() const { return data.type == DIRECTIONAL || data.range <= 0.0f; }
+	int getIndex() const { return index; }	// Entry in the light data (-1 when disabled)
 	// Modifiers
 	void setEnabled(bool enabled);
 	void setType(LightType type);
 	void setPos(glm::vec3 pos);
 	void setColor(glm::vec3 color);
+	void setRange(float range);
 
 	// Rotation and offset
 	bool isRotating() const { return rotating; }
@@ -46,18 +54,16 @@ public:
 	void offsetLight(float offset);
 
 protected:
-	// Light properties, arranged for UBO storage (std140 layout)
+	// Light properties, arranged as two RGBA32F texels of the light data
 	struct LightData {
 		LightData();
-		int enabled;		// Whether light is on or off
-		int type;			// Point light or directional light
-		glm::vec2 padding0;
 		glm::vec3 pos;		// Position (or direction) of the light
-		float padding1;
+		float type;			// Point light or directional light
 		glm::vec3 color;	// Color of the light
-		float padding2;
+		float range;		// Distance where a point light's influence ends (0 = everywhere)
 	} data;
-	int index = -1;		// Index into UBO (set upon enable)
+	bool enabled = false;	// Whether light is on or off
+	int index = -1;		// Index into the light data (set upon enable)
 
 	// Rotation state
 	bool rotating;			// Whether light is rotating
@@ -67,7 +73,8 @@ protected:
 	// OpenGL state -- shared by all Light objects
 	static unsigned int refcount;	// Number of light objects instantiated
 	static std::array<bool, MAX_LIGHTS> enabledLights;	// Which lights are enabled
-	static GLuint ubo;				// Uniform buffer object for storing light data
+	static GLuint buffer;			// Buffer storing the light data
+	static GLuint texture;			// Texture buffer reading it
 	// Icon drawing state
 	static GLuint shader;			// Icon shader
 	static GLuint vao;				// Vertex array object
@@ -81,8 +88,8 @@ protected:
 	// OpenGL state management
 	void initializeGL();
 	void destroyGL();
-	void initUBO();
-	void updateUBO();
+	void initBuffer();
+	void updateBuffer();
 	int findAvailableIndex();
 	// Icon setup
 	void initShader();
@@ -0,0 +1,187 @@
+#include "lightclusters.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "glcache.hpp"
+
+void LightClusters::assign(const glm::mat4& view, float fovy, float aspect, float nearDepth, float farDepth,
+	const std::vector<Light>& lights, WorkerPool& workers) {
+	auto start = std::chrono::steady_clock::now();
+	zNear = nearDepth;
+	zFar = farDepth;
+	tanY = std::tan(fovy * 0.5f);
+	tanX = tanY * aspect;
+
+	// The global lights go first; the others are clustered by their view-space spheres
+	indices.clear();
+	spheres.clear();
+	for (const Light& light : lights) {
+		if (!light.getEnabled())
+			continue;
+		stats.lights++;
+		if (light.isGlobal())
+			indices.push_back((uint16_t)light.getIndex());
+		else
+			spheres.push_back({ glm::vec3(view * glm::vec4(light.getPos(), 1.0f)), light.getRange(),
+				(uint16_t)light.getIndex() });
+	}
+	globalCount = (unsigned int)indices.size();
+
+	grid.resize((size_t)2 * COUNT_X * COUNT_Y * COUNT_Z);
+	if (spheres.empty()) {
+		// Only global lights: every cluster is empty
+		for (size_t c = 0; c < grid.size(); c += 2) {
+			grid[c] = globalCount;
+			grid[c + 1] = 0;
+		}
+		stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return;
+	}
+	sliceIndices.resize(COUNT_Z);
+	size_t tasks = std::min<size_t>(workers.getThreadCount() + 1, (spheres.size() + SPHERES_PER_TASK - 1) / SPHERES_PER_TASK);
+	workers.parallelFor((size_t)COUNT_Z, (unsigned int)tasks, [&](size_t z0, size_t z1, unsigned int) {
+		assignSlices((int)z0, (int)z1);
+	});
+
+	// Join the slices' lists, turning the counts into offsets
+	uint32_t cap = clusterCap(maxIndices > globalCount ? maxIndices - globalCount : 0);
+	uint32_t offset = globalCount;
+	for (int z = 0; z < COUNT_Z; z++) {
+		const std::vector<uint16_t>& slice = sliceIndices[z];
+		size_t read = 0;
+		for (size_t c = (size_t)z * COUNT_X * COUNT_Y; c < (size_t)(z + 1) * COUNT_X * COUNT_Y; c++) {
+			uint32_t count = grid[2 * c + 1], kept = std::min(count, cap);
+			indices.insert(indices.end(), slice.begin() + read, slice.begin() + read + kept);
+			read += count;
+			grid[2 * c] = offset;
+			grid[2 * c + 1] = kept;
+			offset += kept;
+			stats.busyClusters += count != 0;
+			stats.maxLights = std::max(stats.maxLights, count);
+			stats.dropped += count - kept;
+		}
+	}
+	stats.references += indices.size() - globalCount;
+	stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The largest cap that fits, found by bisection (the entries kept grow with the cap)
+uint32_t LightClusters::clusterCap(size_t entries) const {
+	size_t total = 0;
+	uint32_t most = 0;
+	for (size_t c = 1; c < grid.size(); c += 2) {
+		total += grid[c];
+		most = std::max(most, grid[c]);
+	}
+	if (total <= entries)
+		return most;
+	uint32_t fits = 0, over = most;
+	while (over - fits > 1) {
+		uint32_t mid = fits + (over - fits) / 2;
+		size_t kept = 0;
+		for (size_t c = 1; c < grid.size(); c += 2)
+			kept += std::min(grid[c], mid);
+		(kept <= entries ? fits : over) = mid;
+	}
+	return fits;
+}
+
+// A cluster is the box around its part of the frustum (view space looks down -z); a
+// sphere touches it when the nearest point of the box is within the radius
+void LightClusters::assignSlices(int z0, int z1) {
+	std::vector<const Sphere*> sliceSpheres;
+	for (int z = z0; z < z1; z++) {
+		float depthNear = zNear * std::pow(zFar / zNear, (float)z / COUNT_Z);
+		float depthFar = zNear * std::pow(zFar / zNear, (float)(z + 1) / COUNT_Z);
+		sliceSpheres.clear();
+		for (const Sphere& sphere : spheres)
+			if (-sphere.center.z + sphere.radius >= depthNear && -sphere.center.z - sphere.radius <= depthFar)
+				sliceSpheres.push_back(&sphere);
+
+		std::vector<uint16_t>& out = sliceIndices[z];
+		out.clear();
+		for (int y = 0; y < COUNT_Y; y++) {
+			float y0 = (2.0f * y / COUNT_Y - 1.0f) * tanY, y1 = (2.0f * (y + 1) / COUNT_Y - 1.0f) * tanY;
+			for (int x = 0; x < COUNT_X; x++) {
+				float x0 = (2.0f * x / COUNT_X - 1.0f) * tanX, x1 = (2.0f * (x + 1) / COUNT_X - 1.0f) * tanX;
+				glm::vec3 minBB(std::min(x0 * depthNear, x0 * depthFar), std::min(y0 * depthNear, y0 * depthFar), -depthFar);
+				glm::vec3 maxBB(std::max(x1 * depthNear, x1 * depthFar), std::max(y1 * depthNear, y1 * depthFar), -depthNear);
+				uint32_t count = 0;
+				for (const Sphere* sphere : sliceSpheres) {
+					glm::vec3 d = glm::clamp(sphere->center, minBB, maxBB) - sphere->center;
+					if (glm::dot(d, d) <= sphere->radius * sphere->radius) {
+						out.push_back(sphere->index);
+						count++;
+					}
+				}
+				grid[2 * (((size_t)z * COUNT_Y + y) * COUNT_X + x) + 1] = count;
+			}
+		}
+	}
+}
+
+void LightClusters::init() {
+	GLint texels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &texels);
+	maxIndices = std::max<size_t>((size_t)texels, 65536);
+}
+
+void LightClusters::upload() {
+	if (!gridBuffer) {
+		glGenBuffers(1, &gridBuffer);
+		glGenTextures(1, &gridTexture);
+		GLCache::bindBuffer(GL_TEXTURE_BUFFER, gridBuffer);
+		GLCache::bindTexture(GRID_UNIT, gridTexture, GL_TEXTURE_BUFFER);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, gridBuffer);
+		glGenBuffers(1, &indexBuffer);
+		glGenTextures(1, &indexTexture);
+		GLCache::bindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+		GLCache::bindTexture(INDEX_UNIT, indexTexture, GL_TEXTURE_BUFFER);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R16UI, indexBuffer);
+	}
+	if (indices.empty())
+		indices.push_back(0);	// Keep the buffer from being empty
+
+	// Orphan last frame's storage, which the GPU may still be reading
+	GLCache::bindBuffer(GL_TEXTURE_BUFFER, gridBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid.size() * sizeof(uint32_t), grid.data(), GL_STREAM_DRAW);
+	GLCache::bindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, indices.size() * sizeof(uint16_t), indices.data(), GL_STREAM_DRAW);
+
+	Light::bindData();
+	GLCache::bindTexture(GRID_UNIT, gridTexture, GL_TEXTURE_BUFFER);
+	GLCache::bindTexture(INDEX_UNIT, indexTexture, GL_TEXTURE_BUFFER);
+}
+
+// slice = log(depth / zNear) / log(zFar / zNear) * COUNT_Z
+glm::vec4 LightClusters::getScale(int width, int height) const {
+	float depthScale = COUNT_Z / std::log(zFar / zNear);
+	return glm::vec4((float)COUNT_X / std::max(width, 1), (float)COUNT_Y / std::max(height, 1),
+		depthScale, -std::log(zNear) * depthScale);
+}
+
+void LightClusters::endFrame(unsigned int reportFrames) {
+	stats.frames++;
+	if (reportFrames && stats.frames >= reportFrames) {
+		report(std::cout);
+		stats = Stats();
+	}
+}
+
+// e.g. "Light clusters over 300 frames: 200 lights, 1400 cluster entries in 600 of 3072 clusters, ..."
+void LightClusters::report(std::ostream& ostr) const {
+	if (!stats.frames)
+		return;
+	ostr << "Light clusters over " << stats.frames << " frames: " << stats.lights / stats.frames << " lights, "
+		<< stats.references / stats.frames << " cluster entries in " << stats.busyClusters / stats.frames << " of "
+		<< COUNT_X * COUNT_Y * COUNT_Z << " clusters (at most " << stats.maxLights << " lights in one, "
+		<< stats.dropped / stats.frames << " entries dropped to fit the index buffer), "
+		<< stats.ms / stats.frames << " ms assigning per frame" << std::endl;
+}
+
+void LightClusters::release() {
+	if (gridTexture) { GLCache::deleteTexture(gridTexture); gridTexture = 0; }
+	if (gridBuffer) { GLCache::deleteBuffer(gridBuffer); gridBuffer = 0; }
+	if (indexTexture) { GLCache::deleteTexture(indexTexture); indexTexture = 0; }
+	if (indexBuffer) { GLCache::deleteBuffer(indexBuffer); indexBuffer = 0; }
+}
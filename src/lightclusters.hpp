@@ -0,0 +1,97 @@
+#ifndef LIGHTCLUSTERS_HPP
+#define LIGHTCLUSTERS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+#include "light.hpp"
+#include "workerpool.hpp"
+
+// Clustered forward lighting: the camera frustum is split into a grid of clusters (tiles
+// of the screen by slices of view depth, spaced logarithmically), and every frame each
+// light is assigned on the CPU to the clusters its sphere of influence touches, a band of
+// depth slices per task on the frame workers. The fragment shader finds its cluster and loops over its
+// lights only, so the cost of a pixel follows the lights near it rather than all of them.
+//
+// The shaders read two texture buffers: the grid, an (offset, count) pair per cluster
+// into the index list, and the index list, entries of the light data (Light::getIndex).
+// The lights that reach everywhere (directional lights and point lights without a range)
+// start the index list and belong to no cluster; every fragment loops over them.
+class LightClusters {
+public:
+	LightClusters() {}
+	~LightClusters() { release(); }
+	// Disallow copy, move, & assignment
+	LightClusters(const LightClusters& other) = delete;
+	LightClusters& operator=(const LightClusters& other) = delete;
+	LightClusters(LightClusters&& other) = delete;
+	LightClusters& operator=(LightClusters&& other) = delete;
+
+	// Read the size limit of texture buffers (call on the OpenGL thread before assigning;
+	// until then the minimum that OpenGL 3.3 guarantees is assumed)
+	void init();
+	// Assign the enabled lights to the clusters of a camera (view transform, vertical
+	// field of view in radians, aspect ratio and depth range). Only reads the lights, so
+	// it may run on another thread than OpenGL. When the index list would not fit in a
+	// texture buffer, every cluster over a common cap keeps only its first cap lights.
+	void assign(const glm::mat4& view, float fovy, float aspect, float zNear, float zFar,
+		const std::vector<Light>& lights, WorkerPool& workers);
+	// Upload the grid and index list of the last assignment and bind them (and the light
+	// data) to their texture units
+	void upload();
+
+	// Shader parameters (GLState::FrameData): clusters per pixel of a width x height
+	// target in .xy; .z and .w take log(view depth) to the depth slice
+	glm::vec4 getScale(int width, int height) const;
+	unsigned int getGlobalCount() const { return globalCount; }
+
+	// Count a frame, printing the averages every reportFrames frames (0 = never)
+	void endFrame(unsigned int reportFrames);
+	void report(std::ostream& ostr) const;
+
+	static const int COUNT_X = 16, COUNT_Y = 8, COUNT_Z = 24;	// Clusters along each axis
+	static const size_t SPHERES_PER_TASK = 32;	// Fewest lights worth another task
+	// Texture units of the grid and index list (after the light data)
+	static const GLuint GRID_UNIT = 9;
+	static const GLuint INDEX_UNIT = 10;
+
+protected:
+	// A light with a range, in view space
+	struct Sphere {
+		glm::vec3 center;
+		float radius;
+		uint16_t index;		// Entry in the light data
+	};
+	// Assign the spheres to the clusters of depth slices [z0, z1)
+	void assignSlices(int z0, int z1);
+	// Most lights a cluster may keep for the cluster entries to number at most "entries"
+	uint32_t clusterCap(size_t entries) const;
+	void release();			// Release OpenGL resources
+
+	// Camera of the last assignment
+	float zNear = 0.1f, zFar = 100.0f, tanX = 1.0f, tanY = 1.0f;
+	std::vector<Sphere> spheres;
+	unsigned int globalCount = 0;
+	size_t maxIndices = 65536;			// Texels of a texture buffer (GL_MAX_TEXTURE_BUFFER_SIZE)
+	std::vector<uint32_t> grid;			// (offset, count) per cluster; x fastest, then y, then depth
+	std::vector<uint16_t> indices;		// Global lights, then the lights of each cluster in turn
+	std::vector<std::vector<uint16_t>> sliceIndices;	// Lights of each slice's clusters, in turn
+
+	struct Stats {
+		unsigned long lights = 0;		// Enabled lights
+		unsigned long references = 0;	// Cluster entries of the index list
+		unsigned long busyClusters = 0;	// Clusters with any light
+		unsigned int maxLights = 0;		// Most lights in one cluster
+		unsigned long dropped = 0;		// Cluster entries over the cap
+		double ms = 0.0;				// Assigning
+		unsigned int frames = 0;
+	} stats;
+
+	// OpenGL resources
+	GLuint gridBuffer = 0, gridTexture = 0;
+	GLuint indexBuffer = 0, indexTexture = 0;
+};
+
+#endif
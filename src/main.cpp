@@ -4,7 +4,12 @@
 #include <filesystem>
 #include <algorithm>
 #include <chrono>
+#include <cctype>
+#include <limits>
+#include <stdexcept>
 #include "glstate.hpp"
+#include "glcache.hpp"
+#include "programcache.hpp"
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <GL/freeglut.h>
@@ -36,18 +41,121 @@ void idle();
 void menu(int cmd);
 void cleanup();
 
+// Command-line option values; throw std::runtime_error naming the option if malformed
+// (or, for numbers, outside [min, max])
+unsigned int parseUnsigned(const std::string& option, const std::string& value,
+	unsigned int min = 0, unsigned int max = std::numeric_limits<unsigned int>::max());
+float parseFloat(const std::string& option, const std::string& value);
+
 // Program entry point
 int main(int argc, char** argv) {
 	std::string configFile = "config.txt";
-	if (argc > 1)
-		configFile = std::string(argv[1]);
-
+	bool asyncLoading = true;
+	float edgeWidth = 0.0f;
+	bool frustumCulling = true;
+	bool occlusionCulling = true;
+	GLState::ShadowCacheMode shadowCache = GLState::SHADOWCACHE_SPLIT;
+	unsigned int shadowCascades = 3, shadowMapSize = 2048;
+	GLState::ShadowKernel shadowKernel = GLState::SHADOWKERNEL_POISSON;
+	GLState::ShadowQuality shadowQuality = GLState::SHADOWQUALITY_MEDIUM;
 	try {
+		// Parse the options; any other argument names the config file
+		for (int i = 1; i < argc; i++) {
+			std::string arg(argv[i]);
+			// The argument after an option that takes a value
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc)
+					throw std::runtime_error("Missing value for " + arg);
+				return argv[++i];
+			};
+			if (arg == "--load-threads")
+				Mesh::setLoadThreads(parseUnsigned(arg, value()));	// 1 = serial loading
+			else if (arg == "--no-mesh-cache")
+				Mesh::setUseCache(false);	// Always parse the OBJ files
+			else if (arg == "--optimize-meshes")
+				Mesh::setOptimize(true);	// Reorder triangles for the vertex cache and overdraw
+			else if (arg == "--compact-vertices")
+				Mesh::setCompactVertices(true);	// 20-byte quantized vertices
+			else if (arg == "--mesh-lods")
+				Mesh::setBuildLods(true);	// Simplified levels of detail for distant objects
+			else if (arg == "--stream-meshes")
+				Mesh::setStreamMeshes(true);	// Build vertices per block; keeps only the v/vt/vn records of huge OBJ files
+			else if (arg == "--no-adjacency")
+				Mesh::setBuildAdjacency(false);	// Outline every triangle instead of the silhouette
+			else if (arg == "--no-outline-normals")
+				Mesh::setBuildOutlineNormals(false);	// No inverted hull outline (saves 16 bytes per vertex)
+			else if (arg == "--edge-width")
+				edgeWidth = parseFloat(arg, value());	// Screen-space outline width in pixels
+			else if (arg == "--no-culling")
+				frustumCulling = false;	// Draw objects outside the view and light frusta too
+			else if (arg == "--no-occlusion-culling")
+				occlusionCulling = false;	// Draw objects hidden behind occluders too
+			else if (arg == "--shadow-cache") {
+				// off: draw the shadow map every frame, on: only when it changed, split: keep the
+				// static casters apart and redraw just the moving ones
+				std::string mode = value();
+				if (mode == "off")
+					shadowCache = GLState::SHADOWCACHE_OFF;
+				else if (mode == "on")
+					shadowCache = GLState::SHADOWCACHE_ON;
+				else if (mode == "split")
+					shadowCache = GLState::SHADOWCACHE_SPLIT;
+				else
+					throw std::runtime_error("Invalid value for " + arg + ": " + mode + " (off, on or split)");
+			}
+			else if (arg == "--shadow-cascades")
+				shadowCascades = parseUnsigned(arg, value(), 1, GLState::MAX_CASCADES);	// Slices of the view
+			else if (arg == "--shadow-map-size")
+				shadowMapSize = parseUnsigned(arg, value(), 1, GLState::MAX_SHADOW_MAP_SIZE);	// Texels per side of each cascade
+			else if (arg == "--shadow-kernel") {
+				std::string kernel = value();
+				if (kernel == "grid")
+					shadowKernel = GLState::SHADOWKERNEL_GRID;
+				else if (kernel == "poisson")
+					shadowKernel = GLState::SHADOWKERNEL_POISSON;
+				else
+					throw std::runtime_error("Invalid value for " + arg + ": " + kernel + " (grid or poisson)");
+			}
+			else if (arg == "--shadow-quality") {
+				// low: 1 filtered sample, medium: 4, high: 9, ultra: 16
+				std::string quality = value();
+				if (quality == "low")
+					shadowQuality = GLState::SHADOWQUALITY_LOW;
+				else if (quality == "medium")
+					shadowQuality = GLState::SHADOWQUALITY_MEDIUM;
+				else if (quality == "high")
+					shadowQuality = GLState::SHADOWQUALITY_HIGH;
+				else if (quality == "ultra")
+					shadowQuality = GLState::SHADOWQUALITY_ULTRA;
+				else
+					throw std::runtime_error("Invalid value for " + arg + ": " + quality + " (low, medium, high or ultra)");
+			}
+			else if (arg == "--sync-loading")
+				asyncLoading = false;	// Load every mesh and texture before the first frame
+			else if (arg == "--no-shader-cache")
+				setUseProgramCache(false);	// Always compile the shaders from source
+			else if (arg == "--gl-stats")
+				GLCache::setReportFrames(300);	// Print state cache hit rates and primitives every 300 frames
+			else if (arg.compare(0, 2, "--") == 0)
+				throw std::runtime_error("Unknown option " + arg);
+			else
+				configFile = arg;
+		}
+
 		// Create the window and menu
 		initGLUT(&argc, argv);
 		initMenu();
 		// Initialize OpenGL (buffers, shaders, etc.)
 		glState = std::unique_ptr<GLState>(new GLState());
+		glState->setAsyncLoading(asyncLoading);
+		glState->setFrustumCulling(frustumCulling);
+		glState->setOcclusionCulling(occlusionCulling);
+		glState->setShadowCacheMode(shadowCache);
+		glState->setShadowCascades(shadowCascades, shadowMapSize);
+		glState->setShadowKernel(shadowKernel);
+		glState->setShadowQuality(shadowQuality);
+		if (edgeWidth > 0.0f)
+			glState->setEdgeLineWidth(edgeWidth);
 		glState->initializeGL();
 		glState->readConfig(configFile);
 
@@ -71,13 +179,14 @@ int main(int argc, char** argv) {
 	std::cout << "  4:  Toggle specular for cel shading" << std::endl;
 	std::cout << "  t,T:  Toggle texture mapping" << std::endl;
 	std::cout << "  i,I:  Toggle interior lines" << std::endl;
-	std::cout << "  o,O:  Toggle outlining mode (on or off)" << std::endl;
+	std::cout << "  o,O:  Cycle through outlining mode (geometry shader, inverted hull, screen space or off)" << std::endl;
 	std::cout << "  h,H:  Move the object along y axis" << std::endl;
 	std::cout << "  j,J:  Move the object along x axis" << std::endl;
 	std::cout << "  k,K:  Move the object along z axis" << std::endl;
 	std::cout << "  r,R:  Rotate the object" << std::endl;
 	std::cout << "  l,L:  Cycle through shading type (Cel vs. Phong)" << std::endl;
 	std::cout << "  n,N:  Cycle through shading type (Colored Normals vs. Cel)" << std::endl;
+	std::cout << "  p,P:  Cycle through shadow filtering quality (1, 4, 9 or 16 samples)" << std::endl;
 	std::cout << std::endl;
 
 	// Execute main loop
@@ -276,13 +385,32 @@ void keyPress(unsigned char key, int x, int y) {
 	case 'o': {
 		GLState::OutlineMode smm = glState->getOutlineMode();
 		if (smm == GLState::OUTLINE_ON) {
-			glState->setOutlineMode(GLState::OUTLINE_OFF);
-			std::cout << "Turned off outline" << std::endl;
+			glState->setOutlineMode(GLState::OUTLINE_HULL);
+			std::cout << "Turned on inverted hull outline" << std::endl;
 		}
 		else if (smm == GLState::OUTLINE_OFF) {
 			glState->setOutlineMode(GLState::OUTLINE_ON);
 			std::cout << "Turned on outline" << std::endl;
 		}
+		else if (smm == GLState::OUTLINE_HULL) {
+			glState->setOutlineMode(GLState::OUTLINE_SCREEN);
+			std::cout << "Turned on screen-space outline" << std::endl;
+		}
+		else if (smm == GLState::OUTLINE_SCREEN) {
+			glState->setOutlineMode(GLState::OUTLINE_OFF);
+			std::cout << "Turned off outline" << std::endl;
+		}
+		glutPostRedisplay();
+		break;
+	}
+
+	// Cycle shadow filtering quality
+	case 'p':
+	case 'P': {
+		GLState::ShadowQuality sq = glState->getShadowQuality();
+		sq = (GLState::ShadowQuality)((sq + 1) % (GLState::SHADOWQUALITY_ULTRA + 1));
+		glState->setShadowQuality(sq);
+		std::cout << "Shadow filtering with " << (sq + 1) * (sq + 1) << " samples" << std::endl;
 		glutPostRedisplay();
 		break;
 	}
@@ -509,3 +637,34 @@ void cleanup() {
 	// which releases the OpenGL objects
 	glState.reset(nullptr);
 }
+
+// A whole, non-negative number (std::stoul alone would take "-1" or "4x")
+unsigned int parseUnsigned(const std::string& option, const std::string& value, unsigned int min, unsigned int max) {
+	size_t end = 0;
+	unsigned long n = 0;
+	try {
+		if (!value.empty() && std::isdigit((unsigned char)value[0]))
+			n = std::stoul(value, &end);
+	} catch (const std::logic_error&) {
+		end = 0;
+	}
+	if (end == 0 || end != value.size())
+		throw std::runtime_error("Invalid value for " + option + ": " + value);
+	if (n < min || n > max)
+		throw std::runtime_error("Invalid value for " + option + ": " + value + " (" + std::to_string(min)
+			+ " to " + std::to_string(max) + ")");
+	return (unsigned int)n;
+}
+
+float parseFloat(const std::string& option, const std::string& value) {
+	size_t end = 0;
+	float f = 0.0f;
+	try {
+		f = std::stof(value, &end);
+	} catch (const std::logic_error&) {
+		end = 0;
+	}
+	if (end == 0 || end != value.size())
+		throw std::runtime_error("Invalid value for " + option + ": " + value);
+	return f;
+}
@@ -0,0 +1,112 @@
+#define NOMINMAX
+#include "mappedfile.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Move constructor
+MappedFile::MappedFile(MappedFile&& other) {
+	*this = std::move(other);
+}
+
+// Move assignment
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+	if (this == &other) return *this;
+	close();
+
+	opened = other.opened;
+	ptr = other.ptr;
+	len = other.len;
+#ifdef _WIN32
+	fileHandle = other.fileHandle;
+	mapHandle = other.mapHandle;
+	other.fileHandle = nullptr;
+	other.mapHandle = nullptr;
+#endif
+	other.opened = false;
+	other.ptr = nullptr;
+	other.len = 0;
+
+	return *this;
+}
+
+// Map the whole file into memory
+void MappedFile::open(const std::string& filename) {
+	close();
+
+	auto fail = [&](const char* reason) {
+		close();
+		std::stringstream ss;
+		ss << "Error reading " << filename << ": " << reason;
+		throw std::runtime_error(ss.str());
+	};
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		fail("failed to open file");
+	fileHandle = file;
+	opened = true;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+		fail("failed to get file size");
+	len = (size_t)fileSize.QuadPart;
+	if (len == 0) return;	// Nothing to map
+
+	mapHandle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapHandle)
+		fail("failed to map file");
+	ptr = (const char*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr)
+		fail("failed to map file");
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		fail("failed to open file");
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		fail("failed to get file size");
+	}
+	opened = true;
+	len = (size_t)st.st_size;
+	if (len == 0) {	// Nothing to map
+		::close(fd);
+		return;
+	}
+
+	void* addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);	// The mapping keeps its own reference to the file
+	if (addr == MAP_FAILED)
+		fail("failed to map file");
+	ptr = (const char*)addr;
+	madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+}
+
+// Release the mapping
+void MappedFile::close() {
+#ifdef _WIN32
+	if (ptr) UnmapViewOfFile(ptr);
+	if (mapHandle) CloseHandle((HANDLE)mapHandle);
+	if (fileHandle) CloseHandle((HANDLE)fileHandle);
+	mapHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	if (ptr) munmap((void*)ptr, len);
+#endif
+	opened = false;
+	ptr = nullptr;
+	len = 0;
+}
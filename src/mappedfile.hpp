@@ -0,0 +1,40 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const std::string& filename) { open(filename); }
+	~MappedFile() { close(); }
+	// Disallow copy
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator=(const MappedFile& other) = delete;
+	// Move constructor and assignment
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(MappedFile&& other);
+
+	void open(const std::string& filename);	// Map a file (throws on failure)
+	void close();							// Unmap the file
+
+	// Access
+	bool isOpen() const { return opened; }
+	const char* data() const { return ptr; }
+	size_t size() const { return len; }
+	const char* begin() const { return ptr; }
+	const char* end() const { return ptr + len; }
+
+protected:
+	bool opened = false;		// Whether a file is mapped
+	const char* ptr = nullptr;	// Start of the mapping (null for empty files)
+	size_t len = 0;				// Size of the file in bytes
+#ifdef _WIN32
+	void* fileHandle = nullptr;	// Handle of the open file
+	void* mapHandle = nullptr;	// Handle of the file mapping
+#endif
+};
+
+#endif
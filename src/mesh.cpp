@@ -1,13 +1,37 @@
 #define NOMINMAX
 #include "mesh.hpp"
-#include <fstream>
 #include <iostream>
 #include <sstream>
-
-// Helper functions
-int indexOfNumberLetter(std::string& str, int offset);
-int lastIndexOfNumberLetter(std::string& str);
-std::vector<std::string> split(const std::string &s, char delim);
+#include <cstring>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include <glm/gtc/packing.hpp>
+#include "mappedfile.hpp"
+#include "objparser.hpp"
+#include "meshcache.hpp"
+#include "meshopt.hpp"
+#include "parallel.hpp"
+#include "glcache.hpp"
+
+unsigned int Mesh::loadThreads = 0;
+bool Mesh::useCache = true;
+bool Mesh::optimizeMeshes = false;
+bool Mesh::compactVertices = false;
+bool Mesh::buildLods = false;
+bool Mesh::streamMeshes = false;
+bool Mesh::buildAdjacency = true;
+bool Mesh::buildOutlineNormals = true;
+
+// Pack one vertex in the compact format, quantizing its position to the bounding box
+static void packVertex(const Mesh::Vertex& v, glm::vec3 minBB, glm::vec3 maxBB, Mesh::PackedVertex& p) {
+	quantizePosition(v.pos, minBB, maxBB, p.pos);
+	p.pos[3] = 0;
+	encodeOctahedral(v.fnorm, p.fnorm);
+	encodeOctahedral(v.vnorm, p.vnorm);
+	p.uv[0] = glm::packHalf1x16(v.uv.x);
+	p.uv[1] = glm::packHalf1x16(v.uv.y);
+}
 
 // Constructor - load mesh from file
 Mesh::Mesh(std::string filename, const ObjType mType, bool keepLocalGeometry) {
@@ -18,110 +42,590 @@ Mesh::Mesh(std::string filename, const ObjType mType, bool keepLocalGeometry) {
 
 	vao = 0;
 	vbuf = 0;
+	ibuf = 0;
+	obuf = 0;
+	instbuf = 0;
 	vcount = 0;
+	icount = 0;
+	itype = GL_UNSIGNED_INT;
+	compact = false;
+	adjacencyOffset = 0;
+	uploadedBytes = 0;
 	load(filename, keepLocalGeometry);
 	std::cout << "Finished loading " << filename << std::endl;
 }
 
-// Draw the mesh
-void Mesh::draw() {
-	glBindVertexArray(vao);
-	glDrawArrays(GL_TRIANGLES, 0, vcount);
-	glBindVertexArray(0);
+// Constructor - empty mesh, filled in later by a staged upload
+Mesh::Mesh(const ObjType mType) {
+	minBB = glm::vec3(std::numeric_limits<float>::max());
+	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+
+	meshType = mType;
+
+	vao = 0;
+	vbuf = 0;
+	ibuf = 0;
+	obuf = 0;
+	instbuf = 0;
+	vcount = 0;
+	icount = 0;
+	itype = GL_UNSIGNED_INT;
+	compact = false;
+	adjacencyOffset = 0;
+	uploadedBytes = 0;
+}
+
+// Draw a run of instances of the mesh at a level of detail
+void Mesh::draw(unsigned int lod, unsigned int first, unsigned int count) {
+	if (!isReady())
+		return;
+	if (count == ALL_INSTANCES)
+		count = (unsigned int)(drawList.empty() ? instances.size() : drawList.size()) - first;
+	if (!count)
+		return;
+	bindInstances(first);
+	if (lod > 0 && lod < lods.size()) {
+		size_t offset = lods[lod].indexOffset * (itype == GL_UNSIGNED_SHORT ? 2 : 4);
+		glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)lods[lod].indexCount, itype, (GLvoid*)offset, (GLsizei)count);
+	} else if (icount)
+		glDrawElementsInstanced(GL_TRIANGLES, icount, itype, NULL, (GLsizei)count);
+	else
+		glDrawArraysInstanced(GL_TRIANGLES, 0, vcount, (GLsizei)count);
+}
+
+// Draw a level of detail with its adjacency indices: 6 per triangle, in the same order
+void Mesh::drawAdjacency(unsigned int lod, unsigned int first, unsigned int count) {
+	if (!isReady() || !hasAdjacency())
+		return;
+	if (count == ALL_INSTANCES)
+		count = (unsigned int)(drawList.empty() ? instances.size() : drawList.size()) - first;
+	if (!count)
+		return;
+	bindInstances(first);
+	if (lod >= lods.size())
+		lod = 0;
+	size_t offset = adjacencyOffset + 2 * lods[lod].indexOffset * (itype == GL_UNSIGNED_SHORT ? 2 : 4);
+	glDrawElementsInstanced(GL_TRIANGLES_ADJACENCY, (GLsizei)(2 * lods[lod].indexCount), itype, (GLvoid*)offset,
+		(GLsizei)count);
+}
+
+// OpenGL 3.3 has no base instance for draws, so a run that starts past the first record
+// moves the attribute pointers instead
+void Mesh::bindInstances(unsigned int first) {
+	GLCache::bindVertexArray(vao);
+	if (!instancesDirty && first == boundFirst)
+		return;
+	GLCache::bindBuffer(GL_ARRAY_BUFFER, instbuf);
+	if (instancesDirty) {
+		if (drawList.empty())
+			glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), instances.data(), GL_DYNAMIC_DRAW);
+		else {
+			std::vector<Instance> records(drawList.size());
+			for (size_t k = 0; k < drawList.size(); k++)
+				records[k] = instances[drawList[k]];
+			glBufferData(GL_ARRAY_BUFFER, records.size() * sizeof(Instance), records.data(), GL_DYNAMIC_DRAW);
+		}
+		instancesDirty = false;
+	}
+	if (first != boundFirst) {
+		setInstanceAttributes(first);
+		boundFirst = first;
+	}
+}
+
+void Mesh::setInstanceAttributes(unsigned int first) {
+	size_t base = (size_t)first * sizeof(Instance);
+	for (GLuint c = 0; c < 4; c++)  // model matrix column c
+		glVertexAttribPointer(5 + c, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(base + c * sizeof(glm::vec4)));
+	glVertexAttribIPointer(9, 1, GL_INT, sizeof(Instance), (GLvoid*)(base + offsetof(Instance, objectId)));
+}
+
+void Mesh::setDrawList(const std::vector<unsigned int>& list) {
+	if (list == drawList)
+		return;
+	drawList = list;
+	instancesDirty = true;
+}
+
+std::pair<glm::vec3, glm::vec3> Mesh::worldBoundingBox() {
+	updateWorldBounds();
+	return std::make_pair(worldMinBB, worldMaxBB);
+}
+
+std::pair<glm::vec3, glm::vec3> Mesh::instanceBoundingBox(unsigned int i) {
+	updateWorldBounds();
+	return std::make_pair(instanceMinBB[i], instanceMaxBB[i]);
+}
+
+// Transform the box's center and half extent by each instance (Arvo)
+void Mesh::updateWorldBounds() {
+	if (!worldBoundsDirty)
+		return;
+	glm::vec3 center = (minBB + maxBB) * 0.5f;
+	glm::vec3 extent = glm::max(maxBB - minBB, glm::vec3(0.0f)) * 0.5f;
+	worldMinBB = glm::vec3(std::numeric_limits<float>::max());
+	worldMaxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	instanceMinBB.resize(instances.size());
+	instanceMaxBB.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		const glm::mat4& modelMat = instances[i].modelMat;
+		glm::mat3 absMat = glm::mat3(modelMat);
+		for (int c = 0; c < 3; c++)
+			absMat[c] = glm::abs(absMat[c]);
+		glm::vec3 worldCenter = glm::vec3(modelMat * glm::vec4(center, 1.0f));
+		glm::vec3 worldExtent = absMat * extent;
+		instanceMinBB[i] = worldCenter - worldExtent;
+		instanceMaxBB[i] = worldCenter + worldExtent;
+		worldMinBB = glm::min(worldMinBB, instanceMinBB[i]);
+		worldMaxBB = glm::max(worldMaxBB, instanceMaxBB[i]);
+	}
+	worldBoundsDirty = false;
+}
+
+void Mesh::setInstances(const std::vector<glm::mat4>& modelMats, unsigned int firstObjectId) {
+	if (modelMats.empty())
+		throw std::runtime_error("A mesh needs at least one instance");
+	instances.resize(modelMats.size());
+	for (size_t i = 0; i < modelMats.size(); i++) {
+		instances[i].modelMat = modelMats[i];
+		instances[i].objectId = (int)(firstObjectId + i);
+	}
+	drawList.clear();	// It may name instances that are gone
+	instancesDirty = true;
+	worldBoundsDirty = true;
+	changeCount++;
+}
+
+void Mesh::setInstanceMat(unsigned int i, const glm::mat4& model) {
+	instances.at(i).modelMat = model;
+	instancesDirty = true;
+	worldBoundsDirty = true;
+	changeCount++;
 }
 
 // Load a wavefront OBJ file
 void Mesh::load(std::string filename, bool keepLocalGeometry) {
+	std::unique_ptr<Geometry> geom(new Geometry());
+	loadGeometry(filename, *geom);
+	packVertices(*geom);
+
+	// Keep a local copy of geometry
+	std::vector<Vertex> localVertices;
+	std::vector<unsigned int> localIndices;
+	if (keepLocalGeometry && geom->streamSource) {
+		std::vector<glm::uvec3> corners;
+		ObjFaceReader(*geom->streamFaces).read(corners, geom->vertexCount);
+		localVertices.resize(geom->vertexCount);
+		expandTriangles(*geom->streamSource, corners.data(), geom->vertexCount / 3, localVertices.data());
+	} else if (keepLocalGeometry) {
+		localVertices.assign(geom->vertices, geom->vertices + geom->vertexCount);
+		localIndices.resize(geom->lods[0].indexCount);
+		for (size_t i = 0; i < localIndices.size(); i++)
+			localIndices[i] = geom->index(i);
+	}
+
+	// Upload everything at once
+	beginUpload(std::move(geom));
+	uploadStep(std::numeric_limits<size_t>::max());
+	vertices = std::move(localVertices);
+	indices = std::move(localIndices);
+}
+
+// Create the vertex array and allocate its buffers; the data follows in uploadStep
+void Mesh::beginUpload(std::unique_ptr<Geometry> geom) {
 	// Release resources
 	release();
 
-	std::ifstream file(filename);
-	if (!file.is_open()) {
-		std::stringstream ss;
-		ss << "Error reading " << filename << ": failed to open file";
-		throw std::runtime_error(ss.str());
+	minBB = geom->minBB;
+	maxBB = geom->maxBB;
+	worldBoundsDirty = true;
+	changeCount++;
+	vcount = (GLsizei)geom->vertexCount;
+	icount = geom->indexCount ? (GLsizei)geom->lods[0].indexCount : 0;	// Streamed meshes are not indexed
+	lods = geom->lods;
+	itype = geom->indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	compact = geom->compact;
+	adjacencyOffset = geom->adjacencyCount ? geom->indexCount * geom->indexSize : 0;
+
+	// Report the savings over one full-precision vertex per triangle corner
+	size_t flatBytes = geom->lods[0].indexCount * sizeof(Vertex);
+	size_t vboBytes = geom->vertexCount * (compact ? sizeof(PackedVertex) : sizeof(Vertex));
+	size_t iboBytes = (geom->indexCount + geom->adjacencyCount) * geom->indexSize;
+	size_t oboBytes = geom->outlineNormals ? geom->vertexCount * sizeof(glm::vec4) : 0;
+	if (geom->streamSource)
+		std::cout << geom->filename << ": streaming " << geom->vertexCount << " vertices, "
+			<< vboBytes / 1024 << " KB VBO in blocks of " << STREAM_BLOCK_TRIANGLES << " triangles" << std::endl;
+	else
+		std::cout << geom->filename << ": " << geom->lods[0].indexCount << " -> " << geom->vertexCount << " vertices, "
+		<< flatBytes / 1024 << " KB -> " << vboBytes / 1024 << " KB VBO + " << iboBytes / 1024 << " KB "
+		<< geom->indexSize * 8 << "-bit IBO + " << oboBytes / 1024 << " KB outline normals (" << std::showpos
+		<< (int)std::lround(100.0 * (vboBytes + iboBytes + oboBytes) / flatBytes - 100.0) << std::noshowpos << "%)" << std::endl;
+
+	// Allocate the buffers in OpenGL
+	glGenVertexArrays(1, &vao);
+	GLCache::bindVertexArray(vao);
+
+	glGenBuffers(1, &vbuf);
+	GLCache::bindBuffer(GL_ARRAY_BUFFER, vbuf);
+	glBufferData(GL_ARRAY_BUFFER, vboBytes, NULL, GL_STATIC_DRAW);
+
+	// The element buffer binding is part of the VAO state
+	glGenBuffers(1, &ibuf);
+	GLCache::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibuf);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, iboBytes, NULL, GL_STATIC_DRAW);
+
+	glEnableVertexAttribArray(0);  // pos
+	glEnableVertexAttribArray(1);  // fnorm
+	glEnableVertexAttribArray(2);  // vnorm
+	glEnableVertexAttribArray(3);  // uv
+	if (compact) {
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, pos));
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, fnorm));
+		glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, vnorm));
+		glVertexAttribPointer(3, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, uv));
+	} else {
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
+		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(3 * sizeof(glm::vec3)));  // the last parameter: offset
 	}
 
-	// Store vertex data while reading
-	std::vector<glm::vec3> raw_vertices;
-	std::vector<std::vector<unsigned int>> v_elements;  // indices of vertex positions, texture coordinates and normals
-	std::vector<glm::vec3> raw_normals;
-	std::vector<glm::vec2> raw_uvs;  // texture coordinates
+	// Outline normals live in their own buffer, so that only the hull pass reads them
+	if (oboBytes) {
+		glGenBuffers(1, &obuf);
+		GLCache::bindBuffer(GL_ARRAY_BUFFER, obuf);
+		glBufferData(GL_ARRAY_BUFFER, oboBytes, NULL, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(4);  // outline normal and thickness
+		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), NULL);
+	}
 
-	std::string line;
-	while (getline(file, line)) {
+	// Per-instance attributes (model matrix columns 5-8, object ID 9); the records are
+	// uploaded by the first draw
+	glGenBuffers(1, &instbuf);
+	GLCache::bindBuffer(GL_ARRAY_BUFFER, instbuf);
+	for (GLuint a = 5; a <= 9; a++) {
+		glEnableVertexAttribArray(a);
+		glVertexAttribDivisor(a, 1);
+	}
+	setInstanceAttributes(0);
+	boundFirst = 0;
+	instancesDirty = true;
+
+	// Copy the occluder triangles, keeping only the vertices they use
+	if (occluder && geom->vertices && geom->indexCount) {
+		size_t level = 0;
+		while (level + 1 < geom->lods.size() && geom->lods[level].indexCount / 3 > MAX_OCCLUDER_TRIANGLES)
+			level++;
+		const Lod& lod = geom->lods[level];
+		std::vector<int> remap(geom->vertexCount, -1);
+		occluderIndices.resize(lod.indexCount);
+		for (uint32_t i = 0; i < lod.indexCount; i++) {
+			unsigned int v = geom->index(lod.indexOffset + i);
+			if (remap[v] < 0) {
+				remap[v] = (int)occluderVertices.size();
+				occluderVertices.push_back(geom->vertices[v].pos);
+			}
+			occluderIndices[i] = (unsigned int)remap[v];
+		}
+	} else if (occluder)
+		std::cout << geom->filename << ": streamed meshes cannot be occluders" << std::endl;
 
-		if (line.substr(0, 2) == "v ") {
-			// Read position data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_vertices.push_back(vert);
+	staged = std::move(geom);
+	uploadedBytes = 0;
+}
 
-			// Update bounding box
-			minBB = glm::min(minBB, vert);
-			maxBB = glm::max(maxBB, vert);
+// Copy the next slice of the vertex data, then of the index data and the outline normals
+size_t Mesh::uploadStep(size_t maxBytes) {
+	if (!staged)
+		return 0;
+
+	const unsigned char* vdata = compact ? (const unsigned char*)staged->packedVertices.data()
+		: (const unsigned char*)staged->vertices;
+	size_t vboBytes = staged->vertexCount * (compact ? sizeof(PackedVertex) : sizeof(Vertex));
+	size_t iboBytes = (staged->indexCount + staged->adjacencyCount) * staged->indexSize;
+	size_t oboBytes = staged->outlineNormals ? staged->vertexCount * sizeof(glm::vec4) : 0;
+
+	size_t copied = 0;
+	GLCache::bindVertexArray(vao);
+	if (uploadedBytes < vboBytes && copied < maxBytes) {
+		GLCache::bindBuffer(GL_ARRAY_BUFFER, vbuf);
+		if (staged->streamSource)
+			copied += streamVertices(maxBytes - copied);
+		else {
+			size_t n = std::min(vboBytes - uploadedBytes, maxBytes - copied);
+			glBufferSubData(GL_ARRAY_BUFFER, uploadedBytes, n, vdata + uploadedBytes);
+			uploadedBytes += n;
+			copied += n;
 		}
-		else if (line.substr(0, 2) == "vt") {
-			// Read texture coorindates
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec2 uv(stof(values[0]), stof(values[1]));
-			raw_uvs.push_back(uv);
+	}
+	if (uploadedBytes >= vboBytes && uploadedBytes < vboBytes + iboBytes && copied < maxBytes) {
+		size_t offset = uploadedBytes - vboBytes;
+		size_t n = std::min(iboBytes - offset, maxBytes - copied);
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, n, (const unsigned char*)staged->indices + offset);
+		uploadedBytes += n;
+		copied += n;
+	}
+	if (uploadedBytes >= vboBytes + iboBytes && copied < maxBytes) {
+		size_t offset = uploadedBytes - vboBytes - iboBytes;
+		size_t n = std::min(oboBytes - offset, maxBytes - copied);
+		if (n) {
+			GLCache::bindBuffer(GL_ARRAY_BUFFER, obuf);
+			glBufferSubData(GL_ARRAY_BUFFER, offset, n, (const unsigned char*)staged->outlineNormals + offset);
 		}
-		else if (line.substr(0, 2) == "vn") {
-			// Read the normals
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec3 norm(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_normals.push_back(norm);
+		uploadedBytes += n;
+		copied += n;
+	}
+
+	// Free the CPU copy (or the cache mapping) once everything is on the GPU
+	if (uploadedBytes == vboBytes + iboBytes + oboBytes) {
+		staged.reset();
+		streamCorners = std::vector<glm::uvec3>();
+		streamBlock = std::vector<Vertex>();
+		streamPacked = std::vector<PackedVertex>();
+	}
+	return copied;
+}
+
+// Build whole blocks of triangles into a reused buffer and upload each one, so that only
+// one block of vertices (and the corners of its faces) exists on the CPU at a time. The
+// blocks go in file order; corners of a face split between blocks wait for the next one.
+size_t Mesh::streamVertices(size_t maxBytes) {
+	const ObjData& obj = *staged->streamSource;
+	size_t triBytes = 3 * (compact ? sizeof(PackedVertex) : sizeof(Vertex));
+	size_t triCount = staged->vertexCount / 3;
+
+	size_t copied = 0;
+	while (copied < maxBytes && uploadedBytes < triCount * triBytes) {
+		// At least one triangle per call, so that small budgets still make progress
+		size_t first = uploadedBytes / triBytes;
+		size_t count = std::min(std::min((size_t)STREAM_BLOCK_TRIANGLES, triCount - first),
+			std::max<size_t>((maxBytes - copied) / triBytes, 1));
+		staged->streamFaces->read(streamCorners, count * 3);
+		streamBlock.resize(count * 3);
+		expandTriangles(obj, streamCorners.data(), count, streamBlock.data());
+		streamCorners.erase(streamCorners.begin(), streamCorners.begin() + count * 3);
+		const void* data = streamBlock.data();
+		if (compact) {
+			streamPacked.resize(count * 3);
+			for (size_t i = 0; i < count * 3; i++)
+				packVertex(streamBlock[i], minBB, maxBB, streamPacked[i]);
+			data = streamPacked.data();
 		}
-		else if (line.substr(0, 2) == "f ") {
-			// Read face data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			for (int i = 0; i < int(values.size()) - 2; i++) {
-				// Split up vertex indices
-				std::vector<std::string> v1 = split(values[0], '/');  // Triangle fan for ngons
-				std::vector<std::string> v2 = split(values[i+1], '/');
-				std::vector<std::string> v3 = split(values[i+2], '/');
-
-				// Store position indices
-				std::vector<unsigned int> indices1, indices2, indices3;
-				indices1.push_back(stoul(v1[0]) - 1);
-				indices1.push_back(stoul(v1[1]) - 1);
-				indices1.push_back(stoul(v1[2]) - 1);
-				indices2.push_back(stoul(v2[0]) - 1);
-				indices2.push_back(stoul(v2[1]) - 1);
-				indices2.push_back(stoul(v2[2]) - 1);
-				indices3.push_back(stoul(v3[0]) - 1);
-				indices3.push_back(stoul(v3[1]) - 1);
-				indices3.push_back(stoul(v3[2]) - 1);
-				v_elements.push_back(indices1);
-				v_elements.push_back(indices2);
-				v_elements.push_back(indices3);
+		glBufferSubData(GL_ARRAY_BUFFER, uploadedBytes, count * triBytes, data);
+		uploadedBytes += count * triBytes;
+		copied += count * triBytes;
+	}
+	return copied;
+}
+
+// Pack the vertices for upload in the compact format (streamed vertices are packed per block)
+void Mesh::packVertices(Geometry& geom) {
+	if (!compactVertices)
+		return;
+	geom.compact = true;
+	if (geom.streamSource)
+		return;
+	geom.packedVertices.resize(geom.vertexCount);
+	for (size_t i = 0; i < geom.vertexCount; i++)
+		packVertex(geom.vertices[i], geom.minBB, geom.maxBB, geom.packedVertices[i]);
+}
+
+// Get the geometry of an OBJ file, from its cache if possible
+void Mesh::loadGeometry(const std::string& filename, Geometry& geom) {
+	geom.filename = filename;
+	if (useCache && readMeshCache(filename, geom)) {
+		if ((geom.optimized || !optimizeMeshes) && (geom.hasLods || !buildLods) &&
+			(geom.adjacencyCount || !buildAdjacency) && (geom.outlineNormals || !buildOutlineNormals))
+			return;
+		geom = Geometry();	// The cache predates a requested processing pass; rebuild it
+		geom.filename = filename;
+	}
+
+	// Keep only the records other than faces; the upload reads the faces from the mapped
+	// file and builds the vertices one block at a time
+	if (streamMeshes) {
+		geom.streamSource.reset(new ObjData());
+		readObjData(filename, *geom.streamSource, &geom.mapping);
+		geom.streamFaces.reset(new ObjFaceReader(geom.mapping.begin(), geom.mapping.end(),
+			*geom.streamSource, filename));
+		geom.minBB = geom.streamSource->minBB;
+		geom.maxBB = geom.streamSource->maxBB;
+		geom.vertexCount = geom.streamSource->cornerCount;
+		geom.lods.push_back({ 0, (uint32_t)geom.vertexCount, 0.0f });
+		if (optimizeMeshes || buildLods)
+			std::cout << filename << ": streamed meshes are not optimized and have no LODs" << std::endl;
+		return;
+	}
+
+	// Parse one vertex per triangle corner and append the corners of the simplified levels
+	std::vector<Vertex> corners;
+	readObj(filename, corners, geom.minBB, geom.maxBB);
+	geom.lods.push_back({ 0, (uint32_t)corners.size(), 0.0f });
+	if (buildLods) {
+		appendLods(corners, geom.lods, glm::length(geom.maxBB - geom.minBB));
+		geom.hasLods = true;
+		std::cout << filename << ": LOD triangles";
+		for (const Lod& lod : geom.lods)
+			std::cout << " " << lod.indexCount / 3;
+		std::cout << std::endl;
+	}
+
+	// Weld identical vertices
+	std::vector<unsigned int> remap;
+	size_t unique = weldVertices(corners.data(), corners.size(), sizeof(Vertex), remap);
+	geom.ownedVertices = remapVertices(corners.data(), corners.size(), remap, unique);
+	geom.vertices = geom.ownedVertices.data();
+	geom.vertexCount = geom.ownedVertices.size();
+	corners = std::vector<Vertex>();	// Free the unwelded vertices early
+
+	if (optimizeMeshes) {
+		// Vertices are numbered in order of first use, so level 0 uses the lowest ones
+		size_t baseCount = *std::max_element(remap.begin(), remap.begin() + geom.lods[0].indexCount) + 1;
+		VertexCacheStats before = analyzeVertexCache(remap.data(), geom.lods[0].indexCount, baseCount);
+		for (const Lod& lod : geom.lods) {
+			unsigned int* lodIndices = remap.data() + lod.indexOffset;
+			optimizeVertexCache(lodIndices, lod.indexCount, unique);
+			optimizeOverdraw(lodIndices, lod.indexCount, &geom.vertices[0].pos.x, unique, sizeof(Vertex));
+		}
+		VertexCacheStats after = analyzeVertexCache(remap.data(), geom.lods[0].indexCount, baseCount);
+		geom.optimized = true;
+		std::cout << filename << ": ACMR " << before.acmr << " -> " << after.acmr
+			<< ", ATVR " << before.atvr << " -> " << after.atvr << " (16-entry FIFO)" << std::endl;
+	}
+
+	// Both the adjacency and the outline normals match vertices by position
+	std::vector<unsigned int> posId;
+	size_t posCount = 0;
+	if (buildAdjacency || buildOutlineNormals)
+		posCount = weldPositions(&geom.vertices[0].pos.x, geom.vertexCount, sizeof(Vertex), posId);
+
+	// Adjacency of every level, in the final triangle order
+	std::vector<unsigned int> adjacency;
+	if (buildAdjacency) {
+		adjacency.resize(remap.size() * 2);
+		for (const Lod& lod : geom.lods)
+			buildAdjacencyIndices(adjacency.data() + 2 * lod.indexOffset, remap.data() + lod.indexOffset,
+				lod.indexCount, posId.data());
+	}
+	geom.setIndices(remap, adjacency);
+
+	// Outline normals smoothed over the triangles of every level
+	if (buildOutlineNormals) {
+		geom.ownedOutlineNormals.resize(geom.vertexCount);
+		computeOutlineNormals(geom.ownedOutlineNormals.data(), remap.data(), remap.size(),
+			&geom.vertices[0].pos.x, geom.vertexCount, sizeof(Vertex), posId.data(), posCount);
+		geom.outlineNormals = geom.ownedOutlineNormals.data();
+	}
+
+	if (useCache)
+		writeMeshCache(filename, geom);
+}
+
+// Simplify the mesh repeatedly, each level from the previous one, and append the
+// triangle corners of every level with recomputed face normals
+void Mesh::appendLods(std::vector<Vertex>& corners, std::vector<Lod>& lods, float meshSize) {
+	// Simplify vertices that are unique without the face normal, so that the triangles
+	// around a smooth vertex share it
+	std::vector<Vertex> smooth(corners);
+	for (auto& v : smooth)
+		v.fnorm = glm::vec3(0.0f);
+	std::vector<unsigned int> idx;
+	size_t unique = weldVertices(smooth.data(), smooth.size(), sizeof(Vertex), idx);
+	smooth = remapVertices(smooth.data(), smooth.size(), idx, unique);
+
+	float error = 0.0f;
+	while (lods.size() < MAX_LODS) {
+		float levelError;
+		size_t count = simplifyMesh(idx.data(), idx.data(), idx.size(), &smooth[0].pos.x, unique, sizeof(Vertex),
+			idx.size() / 2, LOD_MAX_ERROR * meshSize, &levelError);
+		if (count < MIN_LOD_TRIANGLES * 3 || count > idx.size() * 3 / 4)
+			break;	// Too coarse, or simplification stalled at the error limit
+		idx.resize(count);
+		error += levelError;
+
+		lods.push_back({ (uint32_t)corners.size(), (uint32_t)count, error });
+		for (size_t i = 0; i < count; i += 3) {
+			Vertex v[3] = { smooth[idx[i]], smooth[idx[i + 1]], smooth[idx[i + 2]] };
+			glm::vec3 n = glm::cross(v[1].pos - v[0].pos, v[2].pos - v[0].pos);
+			for (int k = 0; k < 3; k++) {
+				v[k].fnorm = n;
+				corners.push_back(v[k]);
 			}
 		}
 	}
-	file.close();
+}
+
+// Coarsest level whose error covers at most maxPixelError pixels
+unsigned int Mesh::selectLod(float pixelsPerUnit, float maxPixelError) const {
+	unsigned int lod = 0;
+	while (lod + 1 < lods.size() && lods[lod + 1].error * pixelsPerUnit <= maxPixelError)
+		lod++;
+	return lod;
+}
+
+// Store indices with the narrowest type that can address every vertex
+void Mesh::Geometry::setIndices(const std::vector<unsigned int>& idx, const std::vector<unsigned int>& adjacency) {
+	indexSize = vertexCount <= 0x10000 ? 2 : 4;
+	indexCount = idx.size();
+	adjacencyCount = adjacency.size();
+	ownedIndices.resize((indexCount + adjacencyCount) * indexSize);
+	if (indexSize == 2) {
+		unsigned short* out = (unsigned short*)ownedIndices.data();
+		for (size_t i = 0; i < indexCount; i++)
+			out[i] = (unsigned short)idx[i];
+		for (size_t i = 0; i < adjacencyCount; i++)
+			out[indexCount + i] = (unsigned short)adjacency[i];
+	} else {
+		memcpy(ownedIndices.data(), idx.data(), indexCount * sizeof(unsigned int));
+		memcpy(ownedIndices.data() + indexCount * sizeof(unsigned int), adjacency.data(), adjacencyCount * sizeof(unsigned int));
+	}
+	indices = ownedIndices.data();
+}
+
+// Read a wavefront OBJ file into a vertex array
+void Mesh::readObj(const std::string& filename, std::vector<Vertex>& vertices,
+	glm::vec3& minBB, glm::vec3& maxBB) {
+	ObjData obj;
+	unsigned int threads = readObjData(filename, obj);
+	minBB = obj.minBB;
+	maxBB = obj.maxBB;
+
+	// Create vertex array
+	vertices = std::vector<Vertex>(obj.corners.size());
+
+	// Expand the triangles and fix their winding, in parallel ranges of triangles
+	size_t triCount = obj.corners.size() / 3;
+	parallelFor(triCount, threads, [&](size_t first, size_t last, unsigned int) {
+		expandTriangles(obj, &obj.corners[first * 3], last - first, &vertices[first * 3]);
+	});
+}
+
+// Map the file and parse it in place, in parallel chunks for large files
+unsigned int Mesh::readObjData(const std::string& filename, ObjData& obj, MappedFile* text) {
+	unsigned int threads = 1;
+	{
+		MappedFile file(filename);
+		if (file.size() >= PARALLEL_LOAD_BYTES)
+			threads = loadThreads ? loadThreads : hardwareThreads();
+		parseObj(file.begin(), file.end(), obj, filename, threads, !text);
+		if (text)
+			*text = std::move(file);
+	}
 
 	// Check if the file was invalid
-	if (raw_vertices.empty() || v_elements.empty()) {
+	if (obj.positions.empty() || !obj.cornerCount) {
 		std::stringstream ss;
 		ss << "Error reading " << filename << ": invalid file or no geometry";
 		throw std::runtime_error(ss.str());
 	}
+	return threads;
+}
 
+// Build one vertex per triangle corner
+void Mesh::expandTriangles(const ObjData& obj, const glm::uvec3* corners, size_t triCount, Vertex* out) {
 	// TODO 1 Calculate tangent and bitangent vectors for each triangle, and store the results in the arrays: "tangent" and "bitangent"
 	// TODO 1-1: Calculate tangent and bitangent vectors for each triangle
 
-	// Create vertex array
-	vertices = std::vector<Vertex>(v_elements.size());
-
 	auto computeCross = [=](glm::vec3 v1, glm::vec3 v2) {  // glm::cross
 		return glm::vec3(
 			v1.y * v2.z - v1.z * v2.y,
@@ -134,71 +638,43 @@ void Mesh::load(std::string filename, bool keepLocalGeometry) {
 		return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
 	};
 
-	auto computeNorm = [=](glm::vec3 v) {  // glm::normalize
-		float mag = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
-		return v / mag;
-	};
+	for (size_t t = 0; t < triCount; t++) {
+		const glm::uvec3* c = &corners[t * 3];
+		Vertex* v = out + t * 3;
 
-	for (int i = 0; i < int(v_elements.size()); i += 3) {
 		// Store positions
-		vertices[i+0].pos = raw_vertices[v_elements[i+0][0]];
-		vertices[i+1].pos = raw_vertices[v_elements[i+1][0]];
-		vertices[i+2].pos = raw_vertices[v_elements[i+2][0]];
+		v[0].pos = obj.positions[c[0][0]];
+		v[1].pos = obj.positions[c[1][0]];
+		v[2].pos = obj.positions[c[2][0]];
 
 		// Store normals
-		vertices[i+0].vnorm = raw_normals[v_elements[i+0][2]];
-		vertices[i+1].vnorm = raw_normals[v_elements[i+1][2]];
-		vertices[i+2].vnorm = raw_normals[v_elements[i+2][2]];
+		v[0].vnorm = obj.normals[c[0][2]];
+		v[1].vnorm = obj.normals[c[1][2]];
+		v[2].vnorm = obj.normals[c[2][2]];
 
 		// Store texture coordinates:
-		vertices[i+0].uv = raw_uvs[v_elements[i+0][1]];
-		vertices[i+1].uv = raw_uvs[v_elements[i+1][1]];
-		vertices[i+2].uv = raw_uvs[v_elements[i+2][1]];
+		v[0].uv = obj.uvs[c[0][1]];
+		v[1].uv = obj.uvs[c[1][1]];
+		v[2].uv = obj.uvs[c[2][1]];
+
+		glm::vec3 e1 = v[1].pos - v[0].pos;
+		glm::vec3 e2 = v[2].pos - v[0].pos;
 
-		glm::vec3 e1 = vertices[i + 1].pos - vertices[i+0].pos;
-		glm::vec3 e2 = vertices[i + 2].pos - vertices[i+0].pos;
-	
 		glm::vec3 n = computeCross(e1, e2);
-		glm::vec3 vn = (vertices[i+0].vnorm + vertices[i+1].vnorm + vertices[i+2].vnorm) * 0.33f;
+		glm::vec3 vn = (v[0].vnorm + v[1].vnorm + v[2].vnorm) * 0.33f;
 		if (computeDot(n, vn) < 0) {
 			// change from 0, 1, 2 (CW) to 0, 2, 1 (CCW)
-			Vertex temp = vertices[i + 1];
-			vertices[i + 1] = vertices[i + 2];
-			vertices[i + 2] = temp;
+			Vertex temp = v[1];
+			v[1] = v[2];
+			v[2] = temp;
 			n = -n;
 		}
 
 		// copy over face normal over vertices
-		vertices[i + 0].fnorm = n;
-		vertices[i + 1].fnorm = n;
-		vertices[i + 2].fnorm = n;
-
+		v[0].fnorm = n;
+		v[1].fnorm = n;
+		v[2].fnorm = n;
 	}
-	vcount = (GLsizei)vertices.size();
-
-	// Load vertices into OpenGL
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-
-	glGenBuffers(1, &vbuf);
-	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
-
-	glEnableVertexAttribArray(0);  // pos
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
-	glEnableVertexAttribArray(1);  // fnorm
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
-	glEnableVertexAttribArray(2);  // vnorm
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
-	glEnableVertexAttribArray(3);  // uv
-	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(3 * sizeof(glm::vec3)));  // the last parameter: offset
-
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Delete local copy of geometry
-	if (!keepLocalGeometry)
-		vertices.clear();
 }
 
 // Release resources
@@ -207,31 +683,19 @@ void Mesh::release() {
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
 	vertices.clear();
-	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
-	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
+	indices.clear();
+	if (vao) { GLCache::deleteVertexArray(vao); vao = 0; }
+	if (vbuf) { GLCache::deleteBuffer(vbuf); vbuf = 0; }
+	if (ibuf) { GLCache::deleteBuffer(ibuf); ibuf = 0; }
+	if (obuf) { GLCache::deleteBuffer(obuf); obuf = 0; }
+	if (instbuf) { GLCache::deleteBuffer(instbuf); instbuf = 0; }
 	vcount = 0;
-}
-
-int indexOfNumberLetter(std::string& str, int offset) {
-	for (int i = offset; i < int(str.length()); ++i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return (int)str.length();
-}
-int lastIndexOfNumberLetter(std::string& str) {
-	for (int i = int(str.length()) - 1; i >= 0; --i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return 0;
-}
-std::vector<std::string> split(const std::string &s, char delim) {
-	std::vector<std::string> elems;
-
-	std::stringstream ss(s);
-    std::string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-
-    return elems;
+	icount = 0;
+	lods.clear();
+	adjacencyOffset = 0;
+	compact = false;
+	occluderVertices.clear();
+	occluderIndices.clear();
+	staged.reset();
+	uploadedBytes = 0;
 }
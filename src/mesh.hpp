@@ -4,8 +4,12 @@
 #include <string>
 #include <vector>
 #include <utility>
+#include <cstdint>
+#include <memory>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "mappedfile.hpp"
+#include "objparser.hpp"
 
 class Mesh {
 public:
@@ -15,6 +19,8 @@ public:
 	};
 
 	Mesh(std::string filename, const ObjType mType, bool keepLocalGeometry = false);
+	// Create an empty mesh that draws nothing until geometry is uploaded with beginUpload
+	Mesh(const ObjType mType);
 	~Mesh() { release(); }
 	// Disallow copy, move, & assignment
 	Mesh(const Mesh& other) = delete;
@@ -25,14 +31,74 @@ public:
 	// Return the bounding box of this object
 	std::pair<glm::vec3, glm::vec3> boundingBox() const
 	{ return std::make_pair(minBB, maxBB); }
+	// Return the world-space bounding box around all instances (updated when they move)
+	std::pair<glm::vec3, glm::vec3> worldBoundingBox();
+	// Return the world-space bounding box of one instance
+	std::pair<glm::vec3, glm::vec3> instanceBoundingBox(unsigned int i);
 
 	void load(std::string filename, bool keepLocalGeometry = false);
-	void draw();
+	// Draw a level of detail of the instances [first, first + count) of the draw list
+	// (see setDrawList), or of every instance
+	void draw(unsigned int lod = 0, unsigned int first = 0, unsigned int count = ALL_INSTANCES);
+	// Draw a level of detail as GL_TRIANGLES_ADJACENCY, for geometry shaders that look at
+	// the neighbouring triangles (only if hasAdjacency())
+	void drawAdjacency(unsigned int lod = 0, unsigned int first = 0, unsigned int count = ALL_INSTANCES);
+	inline bool hasAdjacency() const { return adjacencyOffset != 0; }
+	// Whether the vertices have outline normals (attribute 4) for the inverted hull pass
+	inline bool hasOutlineNormals() const { return obuf != 0; }
+	// Whether the geometry is completely uploaded and the mesh can be drawn
+	inline bool isReady() const { return vao && !staged; }
+	// Occluders keep a CPU copy of the triangles of a coarse level of detail (the finest with
+	// at most MAX_OCCLUDER_TRIANGLES) for software occlusion culling; set before loading
+	inline void setOccluder(bool occluder) { this->occluder = occluder; }
+	inline bool isOccluder() const { return occluder; }
+	inline const std::vector<glm::vec3>& getOccluderVertices() const { return occluderVertices; }
+	inline const std::vector<unsigned int>& getOccluderIndices() const { return occluderIndices; }
+
+	// A level of detail: a range of the index buffer. Level 0 is the full mesh, and
+	// each further level is simplified from the previous one to about half the triangles.
+	struct Lod {
+		uint32_t indexOffset;	// First index of the level
+		uint32_t indexCount;	// Number of indices of the level
+		float error;			// Simplification error in model units (0 for the full mesh)
+	};
+	inline unsigned int getLodCount() const { return (unsigned int)lods.size(); }
+	inline const Lod& getLod(unsigned int lod) const { return lods[lod]; }
+	// Pick the coarsest level whose error stays within maxPixelError on screen, where
+	// pixelsPerUnit is the projected size of one model unit in pixels
+	unsigned int selectLod(float pixelsPerUnit, float maxPixelError) const;
+
+	// Instances: all instances of a mesh are drawn by one instanced draw call, each with
+	// its own model matrix (attributes 5-8) and object ID (attribute 9). A new mesh has a
+	// single instance with the identity transform.
+	struct Instance {
+		glm::mat4 modelMat;		// Model-to-world transform
+		int objectId;			// Index of the instance in the scene (for EdgeOutline)
+	};
+	// Replace the instances; they are numbered from firstObjectId in order
+	void setInstances(const std::vector<glm::mat4>& modelMats, unsigned int firstObjectId);
+	inline unsigned int getInstanceCount() const { return (unsigned int)instances.size(); }
+	inline const glm::mat4& getInstanceMat(unsigned int i) const { return instances[i].modelMat; }
+	void setInstanceMat(unsigned int i, const glm::mat4& model);
+	// Culled drawing: the instances that a frame's draws show, as runs of instance numbers
+	// packed one after another (e.g. those in view, then those in each shadow cascade);
+	// each draw then names its run. The instance buffer holds the records of the list, and
+	// is rebuilt only when the list changes. An empty list draws the instances in order.
+	void setDrawList(const std::vector<unsigned int>& list);
+	static const unsigned int ALL_INSTANCES = ~0u;	// Draw count of the whole list
+	// Incremented whenever the instances or the geometry change, so that results drawn from
+	// the mesh (such as a cached shadow map) can tell when they are out of date
+	inline unsigned long getChangeCount() const { return changeCount; }
 
 	// Access:
-	inline void setModelMat(const glm::mat4 model) { modelMat = model; }
-	inline glm::mat4 getModelMat() { return modelMat; }
+	// The model matrix of the first instance
+	inline void setModelMat(const glm::mat4 model) { setInstanceMat(0, model); }
+	inline glm::mat4 getModelMat() { return instances[0].modelMat; }
 	inline ObjType getMeshType() { return meshType; }
+	// Vertex decoding: model-space position = posOffset + posScale * pos
+	inline bool isCompact() const { return compact; }
+	inline glm::vec3 getPosScale() const { return compact ? maxBB - minBB : glm::vec3(1.0f); }
+	inline glm::vec3 getPosOffset() const { return compact ? minBB : glm::vec3(0.0f); }
 
 	// Mesh vertex format
 	struct Vertex {
@@ -41,25 +107,169 @@ public:
 		glm::vec3 vnorm;	    // Normal (up vector in tangent space)
 		glm::vec2 uv;           // Texture coordinates
 	};
+	// Compact vertex format (20 bytes): position quantized to the bounding box as
+	// 16-bit unorm, octahedral normals as 2x16-bit snorm and half-float UVs
+	struct PackedVertex {
+		uint16_t pos[4];		// Position (w is padding)
+		int16_t fnorm[2];		// Octahedral face normal
+		int16_t vnorm[2];		// Octahedral vertex normal
+		uint16_t uv[2];			// Half-float texture coordinates
+	};
 	// Local geometry data
 	std::vector<Vertex> vertices;
+	std::vector<unsigned int> indices;
+
+	// CPU-side geometry of a mesh, either parsed from an OBJ file or mapped from its cache
+	struct Geometry {
+		std::string filename;				// OBJ file the geometry belongs to
+		const Vertex* vertices = nullptr;	// Unique vertices (point into ownedVertices or mapping)
+		size_t vertexCount = 0;
+		const void* indices = nullptr;		// Triangle list indices (point into ownedIndices or mapping)
+		size_t indexCount = 0;
+		unsigned int indexSize = 0;			// Bytes per index (2 or 4)
+		bool optimized = false;				// Triangles reordered for the vertex cache and overdraw
+		bool hasLods = false;				// Simplified levels were generated (there may be none)
+		size_t adjacencyCount = 0;			// Adjacency indices after the triangle indices (0 = none)
+		const glm::vec4* outlineNormals = nullptr;	// Per vertex: smoothed normal and outline thickness
+													// (see computeOutlineNormals), or null
+		bool compact = false;				// Upload as PackedVertex records (see packVertices)
+		std::vector<Lod> lods;				// Levels of detail, level 0 is the full mesh
+		glm::vec3 minBB, maxBB;				// Bounding box
+		std::vector<PackedVertex> packedVertices;	// Compact copy of the vertices (see packVertices)
+		std::vector<Vertex> ownedVertices;	// Storage for parsed geometry
+		std::vector<unsigned char> ownedIndices;
+		std::vector<glm::vec4> ownedOutlineNormals;
+		MappedFile mapping;					// Storage for cached geometry, or the text of a streamed OBJ file
+		// Streamed geometry: the OBJ file's v, vt and vn records, with its faces read from
+		// the mapping and expanded into one vertex per triangle corner a block at a time
+		// during the upload (vertices and indices stay null)
+		std::unique_ptr<ObjData> streamSource;
+		std::unique_ptr<ObjFaceReader> streamFaces;
+
+		// Store 32-bit indices (and their adjacency indices, if any), narrowed to 16 bits
+		// when every vertex fits
+		void setIndices(const std::vector<unsigned int>& idx, const std::vector<unsigned int>& adjacency = {});
+		// Index i as 32 bits
+		unsigned int index(size_t i) const {
+			return indexSize == 2 ? ((const unsigned short*)indices)[i] : ((const unsigned int*)indices)[i];
+		}
+	};
+
+	// Read a wavefront OBJ file into a vertex array and bounding box (no OpenGL calls)
+	static void readObj(const std::string& filename, std::vector<Vertex>& vertices,
+		glm::vec3& minBB, glm::vec3& maxBB);
+	// Get the geometry of an OBJ file from its binary cache, or parse the OBJ, weld
+	// identical vertices into an indexed mesh, optionally reorder its triangles and
+	// (re)write the cache (no OpenGL calls)
+	static void loadGeometry(const std::string& filename, Geometry& geom);
+	// Fill geom.packedVertices if new meshes use the compact vertex format (no OpenGL calls)
+	static void packVertices(Geometry& geom);
+
+	// Staged upload: create the OpenGL buffers for the geometry, then copy it into them
+	// in slices of at most maxBytes per uploadStep call (streamed geometry rounds up to
+	// whole triangles). Returns the bytes copied.
+	void beginUpload(std::unique_ptr<Geometry> geom);
+	size_t uploadStep(size_t maxBytes);
+
+	// Number of threads used to parse and build large meshes (0 = all hardware threads)
+	static void setLoadThreads(unsigned int threads) { loadThreads = threads; }
+	static unsigned int getLoadThreads() { return loadThreads; }
+	// Whether to use the binary mesh cache (.meshbin files next to the OBJ files)
+	static void setUseCache(bool use) { useCache = use; }
+	static bool getUseCache() { return useCache; }
+	// Whether to reorder triangles for the post-transform vertex cache and to reduce overdraw
+	static void setOptimize(bool optimize) { optimizeMeshes = optimize; }
+	static bool getOptimize() { return optimizeMeshes; }
+	// Whether to upload new meshes in the compact PackedVertex format
+	static void setCompactVertices(bool compact) { compactVertices = compact; }
+	static bool getCompactVertices() { return compactVertices; }
+	// Whether to generate simplified levels of detail when parsing meshes
+	static void setBuildLods(bool build) { buildLods = build; }
+	static bool getBuildLods() { return buildLods; }
+	// Whether to stream parsed meshes to the GPU in blocks instead of building the whole
+	// vertex array first. Only the OBJ records other than faces stay in memory (the file
+	// is mapped and its faces read again per block); skips welding, reordering and LODs
+	static void setStreamMeshes(bool stream) { streamMeshes = stream; }
+	static bool getStreamMeshes() { return streamMeshes; }
+	// Whether to build GL_TRIANGLES_ADJACENCY indices for silhouette outlines when parsing meshes
+	static void setBuildAdjacency(bool build) { buildAdjacency = build; }
+	static bool getBuildAdjacency() { return buildAdjacency; }
+	// Whether to build the smoothed outline normals of the inverted hull when parsing meshes
+	static void setBuildOutlineNormals(bool build) { buildOutlineNormals = build; }
+	static bool getBuildOutlineNormals() { return buildOutlineNormals; }
 
 protected:
 	void release();		// Release OpenGL resources
+	// Map and parse an OBJ file into its records; returns the threads to use for it. Given
+	// "text", the faces are only checked (see ObjFaceReader) and the mapping is kept there.
+	static unsigned int readObjData(const std::string& filename, ObjData& obj, MappedFile* text = nullptr);
+	// Build the vertices of triCount triangles from their corners (3 per triangle) with
+	// fixed winding and face normals
+	static void expandTriangles(const ObjData& obj, const glm::uvec3* corners, size_t triCount, Vertex* out);
+	// Build and upload blocks of streamed triangles; returns the bytes copied
+	size_t streamVertices(size_t maxBytes);
+	// Append the triangle corners of simplified levels of detail to corners
+	static void appendLods(std::vector<Vertex>& corners, std::vector<Lod>& lods, float meshSize);
 
 	// Bounding box
 	glm::vec3 minBB;
 	glm::vec3 maxBB;
 
-	// Model matrix; apply this matrix to the model to transfer local coordinates to world coordinates
-	glm::mat4 modelMat = glm::mat4(1.0f);
+	// Instances; their model matrices transfer local coordinates to world coordinates
+	std::vector<Instance> instances = { { glm::mat4(1.0f), 0 } };
+	bool instancesDirty = true;	// Whether the instance buffer is out of date
+	std::vector<unsigned int> drawList;	// Instances in the instance buffer (empty = all in order)
+	unsigned int boundFirst = 0;		// Record the instance attributes start at
+	glm::vec3 worldMinBB, worldMaxBB;	// World-space bounds of the instances
+	std::vector<glm::vec3> instanceMinBB, instanceMaxBB;	// World-space bounds of each instance
+	bool worldBoundsDirty = true;		// Whether they must be recomputed
+	unsigned long changeCount = 0;		// See getChangeCount
+	// Bind the vertex array, uploading the instances first if they changed, with the
+	// instance attributes starting at record "first" of the instance buffer
+	void bindInstances(unsigned int first);
+	// Point the instance attributes (5-9) at record "first" of the bound instance buffer
+	static void setInstanceAttributes(unsigned int first);
+	void updateWorldBounds();
 
 	ObjType meshType;  // 0 for floor and 1 for cube
 
+	static unsigned int loadThreads;	// Threads for loading (0 = all hardware threads)
+	static bool useCache;				// Whether to read and write .meshbin caches
+	static bool optimizeMeshes;			// Whether to run the triangle order optimizations
+	static bool compactVertices;		// Whether to upload PackedVertex instead of Vertex
+	static bool buildLods;				// Whether to generate levels of detail
+	static bool streamMeshes;			// Whether to stream parsed meshes in blocks
+	static bool buildAdjacency;			// Whether to generate adjacency indices
+	static bool buildOutlineNormals;	// Whether to generate outline normals
+	static const size_t MAX_LODS = 5;			// Levels including the full mesh
+	static const size_t MIN_LOD_TRIANGLES = 64;	// Stop simplifying below this
+	static constexpr float LOD_MAX_ERROR = 0.05f;	// Largest error per level, relative to the mesh size
+	static const size_t PARALLEL_LOAD_BYTES = 4 << 20;	// Smaller files are loaded on one thread
+	static const size_t STREAM_BLOCK_TRIANGLES = 16384;	// Triangles built at a time when streaming
+	static const size_t MAX_OCCLUDER_TRIANGLES = 4096;	// Preferred size of the occluder level
+
+	// Software occlusion culling
+	bool occluder = false;
+	std::vector<glm::vec3> occluderVertices;	// Model-space positions
+	std::vector<unsigned int> occluderIndices;	// Triangle list
+
 	// OpenGL resources
 	GLuint vao;		// Vertex array object
 	GLuint vbuf;	// Vertex buffer
+	GLuint ibuf;	// Index buffer
+	GLuint obuf;	// Outline normal buffer (0 = none)
+	GLuint instbuf;	// Instance buffer (Instance records)
 	GLsizei vcount;	// Number of vertices
+	GLsizei icount;	// Number of indices (0 = draw vertices in order)
+	GLenum itype;	// Type of the indices
+	bool compact;	// Whether the vertex buffer holds PackedVertex records
+	std::vector<Lod> lods;	// Levels of detail
+	size_t adjacencyOffset;	// Byte offset of the adjacency indices in the index buffer (0 = none)
+	std::unique_ptr<Geometry> staged;	// Geometry still being uploaded
+	size_t uploadedBytes;	// Bytes of the staged vertex and index data copied so far
+	std::vector<glm::uvec3> streamCorners;		// Corners read for the next blocks
+	std::vector<Vertex> streamBlock;			// Block of streamed vertices
+	std::vector<PackedVertex> streamPacked;		// Block of streamed vertices, packed
 
 private:
 };
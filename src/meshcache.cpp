@@ -0,0 +1,165 @@
+#define NOMINMAX
+#include "meshcache.hpp"
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <system_error>
+#include <functional>
+#include <thread>
+#include <utility>
+namespace fs = std::filesystem;
+
+namespace {
+
+const char MESHCACHE_MAGIC[8] = "MESHBIN";
+
+// Size and last write time of a file
+bool statFile(const std::string& filename, uint64_t& size, int64_t& time) {
+	std::error_code ec;
+	size = (uint64_t)fs::file_size(filename, ec);
+	if (ec) return false;
+	time = (int64_t)fs::last_write_time(filename, ec).time_since_epoch().count();
+	return !ec;
+}
+
+// Hash the contents of a file
+uint64_t hashFile(const std::string& filename) {
+	MappedFile file(filename);
+	return hashBytes(file.data(), file.size());
+}
+
+}
+
+// <name>.obj -> <name>.meshbin
+std::string meshCachePath(const std::string& objFilename) {
+	return fs::path(objFilename).replace_extension(".meshbin").string();
+}
+
+// 64-bit FNV-1a, consuming 8 bytes per step
+uint64_t hashBytes(const char* data, size_t size) {
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * prime;
+	return hash;
+}
+
+// Map a valid cache file
+bool readMeshCache(const std::string& objFilename, Mesh::Geometry& geom) {
+	std::string cachePath = meshCachePath(objFilename);
+	uint64_t objSize;
+	int64_t objTime;
+	if (!statFile(objFilename, objSize, objTime) || !fs::exists(cachePath))
+		return false;
+
+	try {
+		MappedFile cache(cachePath);
+
+		// Check that the header and file size match this build's vertex format
+		MeshCacheHeader header;
+		if (cache.size() < sizeof(header)) return false;
+		memcpy(&header, cache.data(), sizeof(header));
+		uint64_t adjacencyCount = (header.flags & MESHCACHE_ADJACENCY) ? 2 * header.indexCount : 0;
+		uint64_t outlineBytes = (header.flags & MESHCACHE_OUTLINE_NORMALS) ? header.vertexCount * sizeof(glm::vec4) : 0;
+		if (memcmp(header.magic, MESHCACHE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != MESHCACHE_VERSION ||
+			header.vertexSize != sizeof(Mesh::Vertex) ||
+			header.vertexCount == 0 || header.indexCount == 0 || header.lodCount == 0 ||
+			(header.indexSize != 2 && header.indexSize != 4) ||
+			cache.size() != sizeof(header) + header.vertexCount * sizeof(Mesh::Vertex) + outlineBytes
+				+ (header.indexCount + adjacencyCount) * header.indexSize + header.lodCount * sizeof(Mesh::Lod))
+			return false;
+
+		// Copy the LOD table (it may be unaligned after 16-bit indices) and check its ranges
+		std::vector<Mesh::Lod> lods(header.lodCount);
+		memcpy(lods.data(), cache.data() + cache.size() - lods.size() * sizeof(Mesh::Lod), lods.size() * sizeof(Mesh::Lod));
+		for (const Mesh::Lod& lod : lods)
+			if ((uint64_t)lod.indexOffset + lod.indexCount > header.indexCount)
+				return false;
+
+		// Check that the OBJ has not changed since the cache was written
+		if (header.sourceSize != objSize)
+			return false;
+		if (header.sourceTime != objTime) {
+			if (header.sourceHash != hashFile(objFilename))
+				return false;
+
+			// Only the timestamp changed; re-stamp the cache so the next run skips the hash
+			std::fstream file(cachePath, std::ios::in | std::ios::out | std::ios::binary);
+			file.seekp(offsetof(MeshCacheHeader, sourceTime));
+			file.write((const char*)&objTime, sizeof(objTime));
+		}
+
+		geom.vertices = (const Mesh::Vertex*)(cache.data() + sizeof(header));
+		geom.vertexCount = (size_t)header.vertexCount;
+		if (outlineBytes)
+			geom.outlineNormals = (const glm::vec4*)(cache.data() + sizeof(header) + geom.vertexCount * sizeof(Mesh::Vertex));
+		geom.indices = cache.data() + sizeof(header) + geom.vertexCount * sizeof(Mesh::Vertex) + outlineBytes;
+		geom.indexCount = (size_t)header.indexCount;
+		geom.indexSize = header.indexSize;
+		geom.optimized = (header.flags & MESHCACHE_OPTIMIZED) != 0;
+		geom.hasLods = (header.flags & MESHCACHE_LODS) != 0;
+		geom.adjacencyCount = (size_t)adjacencyCount;
+		geom.lods = std::move(lods);
+		geom.minBB = glm::vec3(header.minBB[0], header.minBB[1], header.minBB[2]);
+		geom.maxBB = glm::vec3(header.maxBB[0], header.maxBB[1], header.maxBB[2]);
+		geom.mapping = std::move(cache);
+		return true;
+
+	} catch (const std::exception& e) {
+		std::cerr << "Ignoring mesh cache " << cachePath << ": " << e.what() << std::endl;
+		return false;
+	}
+}
+
+// Write the cache to a temporary file, then move it into place
+void writeMeshCache(const std::string& objFilename, const Mesh::Geometry& geom) {
+	std::string cachePath = meshCachePath(objFilename);
+	// Unique per thread, in case two loader threads write the cache of the same OBJ
+	std::string tempPath = cachePath + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+	try {
+		MeshCacheHeader header = {};
+		memcpy(header.magic, MESHCACHE_MAGIC, sizeof(header.magic));
+		header.version = MESHCACHE_VERSION;
+		header.vertexSize = sizeof(Mesh::Vertex);
+		header.vertexCount = geom.vertexCount;
+		header.indexCount = geom.indexCount;
+		header.indexSize = geom.indexSize;
+		header.flags = (geom.optimized ? MESHCACHE_OPTIMIZED : 0) | (geom.hasLods ? MESHCACHE_LODS : 0)
+			| (geom.adjacencyCount ? MESHCACHE_ADJACENCY : 0) | (geom.outlineNormals ? MESHCACHE_OUTLINE_NORMALS : 0);
+		header.lodCount = (uint32_t)geom.lods.size();
+		for (int i = 0; i < 3; i++) {
+			header.minBB[i] = geom.minBB[i];
+			header.maxBB[i] = geom.maxBB[i];
+		}
+		if (!statFile(objFilename, header.sourceSize, header.sourceTime))
+			throw std::runtime_error("failed to stat " + objFilename);
+		header.sourceHash = hashFile(objFilename);
+
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			file.exceptions(std::ios::badbit | std::ios::failbit);
+			file.write((const char*)&header, sizeof(header));
+			file.write((const char*)geom.vertices, geom.vertexCount * sizeof(Mesh::Vertex));
+			if (geom.outlineNormals)
+				file.write((const char*)geom.outlineNormals, geom.vertexCount * sizeof(glm::vec4));
+			file.write((const char*)geom.indices, (geom.indexCount + geom.adjacencyCount) * geom.indexSize);
+			file.write((const char*)geom.lods.data(), geom.lods.size() * sizeof(Mesh::Lod));
+		}
+		fs::rename(tempPath, cachePath);
+
+	} catch (const std::exception& e) {
+		std::error_code ec;
+		fs::remove(tempPath, ec);
+		std::cerr << "Warning: failed to write mesh cache " << cachePath << ": " << e.what() << std::endl;
+	}
+}
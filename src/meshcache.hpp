@@ -0,0 +1,55 @@
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include <string>
+#include <cstdint>
+#include "mesh.hpp"
+
+// Binary mesh cache: the final vertex and index arrays of a mesh, stored next to its
+// OBJ file as <name>.meshbin so later runs can map it instead of parsing the OBJ again.
+//
+// File layout: MeshCacheHeader, followed by vertexCount Mesh::Vertex records (and
+// vertexCount glm::vec4 outline normals with MESHCACHE_OUTLINE_NORMALS), indexCount indices of indexSize bytes each (followed by 2 * indexCount adjacency
+// indices with MESHCACHE_ADJACENCY) and lodCount Mesh::Lod records.
+struct MeshCacheHeader {
+	char magic[8];			// "MESHBIN" + NUL
+	uint32_t version;		// MESHCACHE_VERSION
+	uint32_t vertexSize;	// sizeof(Mesh::Vertex)
+	uint64_t vertexCount;	// Number of vertices
+	uint64_t indexCount;	// Number of indices
+	uint32_t indexSize;		// Bytes per index (2 or 4)
+	uint32_t flags;			// MESHCACHE_* flags
+	uint32_t lodCount;		// Number of levels of detail (at least 1)
+	float minBB[3];			// Bounding box
+	float maxBB[3];
+	uint64_t sourceSize;	// Size of the OBJ file in bytes
+	int64_t sourceTime;		// Last write time of the OBJ file
+	uint64_t sourceHash;	// Hash of the OBJ file contents
+};
+
+// Bump whenever the layout of the cache or of Mesh::Vertex changes
+const uint32_t MESHCACHE_VERSION = 6;
+
+// Header flags
+const uint32_t MESHCACHE_OPTIMIZED = 1;	// Triangles are in vertex cache / overdraw order
+const uint32_t MESHCACHE_LODS = 2;		// Simplified levels of detail were generated
+const uint32_t MESHCACHE_ADJACENCY = 4;	// GL_TRIANGLES_ADJACENCY indices follow the indices
+const uint32_t MESHCACHE_OUTLINE_NORMALS = 8;	// Outline normals follow the vertices
+
+// Path of the cache file that belongs to an OBJ file
+std::string meshCachePath(const std::string& objFilename);
+
+// Hash of a block of memory (64-bit FNV-1a over 8-byte words)
+uint64_t hashBytes(const char* data, size_t size);
+
+// Map the cache of an OBJ file into geom if it is valid for the current OBJ.
+// The timestamp is the fast check; when only the timestamp differs, the OBJ is
+// hashed and an unchanged file keeps its cache. Returns false if the cache is
+// missing, stale or corrupt.
+bool readMeshCache(const std::string& objFilename, Mesh::Geometry& geom);
+
+// Write the cache of an OBJ file from freshly parsed geometry.
+// Failing to write the cache is not fatal; a warning is printed instead.
+void writeMeshCache(const std::string& objFilename, const Mesh::Geometry& geom);
+
+#endif
@@ -0,0 +1,123 @@
+#include "meshloader.hpp"
+#include <iostream>
+#include <algorithm>
+#include "parallel.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Milliseconds between two time points
+static double elapsedMs(Clock::time_point from, Clock::time_point to) {
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// Start the worker threads
+MeshLoader::MeshLoader(unsigned int threads) {
+	if (threads == 0)
+		threads = hardwareThreads();
+	workers.reserve(threads);
+	for (unsigned int i = 0; i < threads; i++)
+		workers.emplace_back(&MeshLoader::work, this);
+}
+
+// Stop the workers; queued jobs are dropped and running jobs finish first
+MeshLoader::~MeshLoader() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& w : workers)
+		w.join();
+}
+
+void MeshLoader::load(std::shared_ptr<Mesh> mesh, const std::string& filename) {
+	Job job;
+	job.mesh = mesh;
+	job.filename = filename;
+	job.queuedAt = Clock::now();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queued.push_back(std::move(job));
+	}
+	wake.notify_one();
+}
+
+// Take jobs until stopped; loadGeometry makes no OpenGL calls, so it is safe here
+void MeshLoader::work() {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() { return stopping || !queued.empty(); });
+			if (stopping)
+				return;
+			job = std::move(queued.front());
+			queued.pop_front();
+			running++;
+		}
+		job.startedAt = Clock::now();
+
+		try {
+			job.geom.reset(new Mesh::Geometry());
+			Mesh::loadGeometry(job.filename, *job.geom);
+			Mesh::packVertices(*job.geom);
+		} catch (...) {
+			job.geom.reset();
+			job.error = std::current_exception();
+		}
+		job.loadedAt = Clock::now();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		finished.push_back(std::move(job));
+		running--;
+	}
+}
+
+// Upload finished meshes in order of completion, one slice at a time
+bool MeshLoader::update(size_t maxBytes) {
+	size_t budget = maxBytes;
+	while (budget > 0) {
+		if (!uploading.mesh) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (finished.empty())
+					break;
+				uploading = std::move(finished.front());
+				finished.pop_front();
+			}
+
+			// Report failures; the mesh stays empty and is never drawn
+			if (uploading.error) {
+				try {
+					std::rethrow_exception(uploading.error);
+				} catch (const std::exception& e) {
+					std::cerr << "Failed to load " << uploading.filename << ": " << e.what() << std::endl;
+				}
+				uploading = Job();
+				continue;
+			}
+			auto start = Clock::now();
+			uploading.mesh->beginUpload(std::move(uploading.geom));
+			uploading.uploadMs += elapsedMs(start, Clock::now());
+		}
+
+		auto start = Clock::now();
+		budget -= std::min(budget, uploading.mesh->uploadStep(budget));
+		auto now = Clock::now();
+		uploading.uploadMs += elapsedMs(start, now);
+		uploading.uploadFrames++;
+		if (uploading.mesh->isReady()) {
+			// Time waiting for a worker, loading on it, then waiting for and doing the upload
+			std::cout << "Finished loading " << uploading.filename << " after "
+				<< elapsedMs(uploading.queuedAt, now) << " ms (queued "
+				<< elapsedMs(uploading.queuedAt, uploading.startedAt) << " ms, loaded "
+				<< elapsedMs(uploading.startedAt, uploading.loadedAt) << " ms, upload "
+				<< uploading.uploadMs << " ms over " << uploading.uploadFrames << " frames)" << std::endl;
+			lastLoaded = uploading.filename;
+			uploading = Job();
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return uploading.mesh || running > 0 || !queued.empty() || !finished.empty();
+}
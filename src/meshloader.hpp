@@ -0,0 +1,62 @@
+#ifndef MESHLOADER_HPP
+#define MESHLOADER_HPP
+
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+#include "mesh.hpp"
+
+// Loads meshes in the background: worker threads parse OBJ files (or map their caches)
+// into Mesh::Geometry, and the OpenGL thread uploads the finished geometry to the GPU
+// a few megabytes at a time from update(), so no frame waits for a whole mesh.
+class MeshLoader {
+public:
+	MeshLoader(unsigned int threads = 0);	// 0 = all hardware threads
+	~MeshLoader();
+	// Disallow copy, move, & assignment
+	MeshLoader(const MeshLoader& other) = delete;
+	MeshLoader& operator=(const MeshLoader& other) = delete;
+	MeshLoader(MeshLoader&& other) = delete;
+	MeshLoader& operator=(MeshLoader&& other) = delete;
+
+	// Queue an OBJ file to be loaded into an empty mesh
+	void load(std::shared_ptr<Mesh> mesh, const std::string& filename);
+	// Upload finished geometry, copying at most maxBytes (call on the OpenGL thread).
+	// Returns whether any mesh is still loading.
+	bool update(size_t maxBytes);
+	// The OBJ file that finished last
+	const std::string& getLastLoaded() const { return lastLoaded; }
+
+protected:
+	struct Job {
+		std::shared_ptr<Mesh> mesh;				// Mesh to fill
+		std::string filename;					// OBJ file
+		std::unique_ptr<Mesh::Geometry> geom;	// Loaded geometry
+		std::exception_ptr error;				// Set if loading failed
+		// Timing breakdown
+		std::chrono::steady_clock::time_point queuedAt, startedAt, loadedAt;
+		double uploadMs = 0.0;					// Time spent in OpenGL calls
+		unsigned int uploadFrames = 0;			// Number of update calls the upload took
+	};
+
+	void work();	// Worker thread loop
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;				// Guards the members below
+	std::condition_variable wake;	// Signals queued jobs or stopping
+	std::deque<Job> queued;			// Waiting for a worker
+	std::deque<Job> finished;		// Waiting for upload
+	unsigned int running = 0;		// Jobs being loaded by workers
+	bool stopping = false;			// Whether the workers should exit
+
+	Job uploading;					// Job being uploaded (OpenGL thread only)
+	std::string lastLoaded;			// OBJ file that finished last
+};
+
+#endif
@@ -0,0 +1,611 @@
+#define NOMINMAX
+#include "meshopt.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+// Hash a vertex (murmur-style mixing of 32-bit words)
+uint32_t hashVertex(const unsigned char* v, size_t stride) {
+	uint32_t h = 0x9747b28cu;
+	size_t i = 0;
+	for (; i + 4 <= stride; i += 4) {
+		uint32_t k;
+		memcpy(&k, v + i, 4);
+		k *= 0xcc9e2d51u;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593u;
+		h ^= k;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64u;
+	}
+	for (; i < stride; i++)
+		h = (h ^ v[i]) * 0x01000193u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+// Forsyth vertex scoring
+const int FORSYTH_CACHE_SIZE = 32;
+const float FORSYTH_LAST_TRI_SCORE = 0.75f;
+const float FORSYTH_CACHE_DECAY = 1.5f;
+const float FORSYTH_VALENCE_SCALE = 2.0f;
+const float FORSYTH_VALENCE_POWER = 0.5f;
+
+// Symmetric 4x4 error quadric (upper triangle) plus the total weight of its planes
+struct Quadric {
+	double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+	double weight;
+};
+
+// Quadric of the plane n.p + d = 0 (n normalized), scaled by weight
+Quadric planeQuadric(glm::dvec3 n, double d, double weight) {
+	Quadric q;
+	q.a00 = n.x * n.x * weight; q.a01 = n.x * n.y * weight; q.a02 = n.x * n.z * weight; q.a03 = n.x * d * weight;
+	q.a11 = n.y * n.y * weight; q.a12 = n.y * n.z * weight; q.a13 = n.y * d * weight;
+	q.a22 = n.z * n.z * weight; q.a23 = n.z * d * weight;
+	q.a33 = d * d * weight;
+	q.weight = weight;
+	return q;
+}
+
+void addQuadric(Quadric& q, const Quadric& r) {
+	q.a00 += r.a00; q.a01 += r.a01; q.a02 += r.a02; q.a03 += r.a03;
+	q.a11 += r.a11; q.a12 += r.a12; q.a13 += r.a13;
+	q.a22 += r.a22; q.a23 += r.a23;
+	q.a33 += r.a33;
+	q.weight += r.weight;
+}
+
+// Weighted mean squared distance of p to the planes of q
+double quadricError(const Quadric& q, glm::dvec3 p) {
+	double e = q.a00 * p.x * p.x + q.a11 * p.y * p.y + q.a22 * p.z * p.z + q.a33
+		+ 2.0 * (q.a01 * p.x * p.y + q.a02 * p.x * p.z + q.a12 * p.y * p.z
+		+ q.a03 * p.x + q.a13 * p.y + q.a23 * p.z);
+	return q.weight > 0.0 ? std::max(e, 0.0) / q.weight : 0.0;
+}
+
+float forsythScore(int cachePos, unsigned int remaining) {
+	if (remaining == 0)
+		return -1.0f;	// No triangles left to draw
+	float score = 0.0f;
+	if (cachePos >= 3)
+		score = std::pow(1.0f - (cachePos - 3) / float(FORSYTH_CACHE_SIZE - 3), FORSYTH_CACHE_DECAY);
+	else if (cachePos >= 0)
+		score = FORSYTH_LAST_TRI_SCORE;	// Used by the last triangle, fixed score to avoid favoring any order
+	// Prefer vertices with few triangles left so they can leave the cache for good
+	return score + FORSYTH_VALENCE_SCALE * std::pow((float)remaining, -FORSYTH_VALENCE_POWER);
+}
+
+}
+
+// Weld identical vertices using an open-addressing hash table
+size_t weldVertices(const void* vertices, size_t count, size_t stride, std::vector<unsigned int>& remap) {
+	const unsigned char* data = (const unsigned char*)vertices;
+	const unsigned int empty = ~0u;
+
+	// Power-of-two table at most half full
+	size_t tableSize = 1;
+	while (tableSize < count * 2) tableSize <<= 1;
+	std::vector<unsigned int> table(tableSize, empty);	// Index of the first vertex of each bucket
+	const size_t mask = tableSize - 1;
+
+	remap.resize(count);
+	unsigned int unique = 0;
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char* v = data + i * stride;
+		size_t bucket = hashVertex(v, stride) & mask;
+		// Linear probing until we find an equal vertex or an empty bucket
+		while (table[bucket] != empty && memcmp(data + (size_t)table[bucket] * stride, v, stride) != 0)
+			bucket = (bucket + 1) & mask;
+
+		if (table[bucket] == empty) {
+			table[bucket] = (unsigned int)i;
+			remap[i] = unique++;
+		} else
+			remap[i] = remap[table[bucket]];
+	}
+	return unique;
+}
+
+// FIFO cache simulation using timestamps: a vertex is in the cache if it was
+// transformed less than cacheSize misses ago
+VertexCacheStats analyzeVertexCache(const unsigned int* indices, size_t indexCount,
+	size_t vertexCount, unsigned int cacheSize) {
+	std::vector<size_t> timestamps(vertexCount, 0);
+	size_t time = cacheSize + 1;
+	size_t misses = 0;
+	for (size_t i = 0; i < indexCount; i++) {
+		unsigned int v = indices[i];
+		if (time - timestamps[v] > cacheSize) {
+			timestamps[v] = time++;
+			misses++;
+		}
+	}
+
+	VertexCacheStats stats;
+	stats.acmr = indexCount ? misses / float(indexCount / 3) : 0.0f;
+	stats.atvr = vertexCount ? misses / float(vertexCount) : 0.0f;
+	return stats;
+}
+
+// Greedily emit the triangle with the highest score, where a triangle's score is the
+// sum of its vertex scores and only triangles touching the cache are rescored
+void optimizeVertexCache(unsigned int* indices, size_t indexCount, size_t vertexCount) {
+	const size_t triCount = indexCount / 3;
+	if (triCount == 0) return;
+
+	// Triangles that use each vertex; the first "remaining" entries are the ones not yet emitted
+	std::vector<unsigned int> remaining(vertexCount, 0);
+	for (size_t i = 0; i < triCount * 3; i++)
+		remaining[indices[i]]++;
+	std::vector<size_t> adjOffset(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		adjOffset[v + 1] = adjOffset[v] + remaining[v];
+	std::vector<unsigned int> adjacency(triCount * 3);
+	{
+		std::vector<size_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+		for (size_t i = 0; i < triCount * 3; i++)
+			adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+	}
+
+	std::vector<int> cachePos(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		vertexScore[v] = forsythScore(-1, remaining[v]);
+	std::vector<float> triScore(triCount);
+	for (size_t t = 0; t < triCount; t++)
+		triScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+
+	std::vector<unsigned int> output(triCount * 3);
+	std::vector<bool> emitted(triCount, false);
+	std::vector<unsigned int> cache, newCache;
+	cache.reserve(FORSYTH_CACHE_SIZE + 3);
+	newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+	size_t best = std::max_element(triScore.begin(), triScore.end()) - triScore.begin();
+	size_t cursor = 0;	// Fallback scan position when no cached triangle is left
+	for (size_t out = 0; out < triCount; out++) {
+		if (best == triCount) {
+			while (emitted[cursor]) cursor++;
+			best = cursor;
+		}
+		const unsigned int* tri = indices + best * 3;
+		std::copy(tri, tri + 3, output.begin() + out * 3);
+		emitted[best] = true;
+
+		// Remove the triangle from the live lists of its vertices
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = tri[k];
+			unsigned int* adj = adjacency.data() + adjOffset[v];
+			unsigned int* last = adj + remaining[v] - 1;
+			*std::find(adj, last + 1, (unsigned int)best) = *last;
+			remaining[v]--;
+		}
+
+		// Move the triangle's vertices to the front of the LRU cache
+		newCache.clear();
+		for (int k = 0; k < 3; k++)
+			if (std::find(newCache.begin(), newCache.end(), tri[k]) == newCache.end())
+				newCache.push_back(tri[k]);
+		for (unsigned int v : cache)
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				newCache.push_back(v);
+		for (size_t i = FORSYTH_CACHE_SIZE; i < newCache.size(); i++) {
+			cachePos[newCache[i]] = -1;	// Evicted
+			vertexScore[newCache[i]] = forsythScore(-1, remaining[newCache[i]]);
+		}
+		newCache.resize(std::min<size_t>(newCache.size(), FORSYTH_CACHE_SIZE));
+		std::swap(cache, newCache);
+		for (size_t i = 0; i < cache.size(); i++) {
+			cachePos[cache[i]] = (int)i;
+			vertexScore[cache[i]] = forsythScore((int)i, remaining[cache[i]]);
+		}
+
+		// Rescore the live triangles of cached vertices and pick the best one
+		best = triCount;
+		float bestScore = -1.0f;
+		for (unsigned int v : cache) {
+			const unsigned int* adj = adjacency.data() + adjOffset[v];
+			for (unsigned int i = 0; i < remaining[v]; i++) {
+				unsigned int t = adj[i];
+				const unsigned int* tv = indices + t * 3;
+				triScore[t] = vertexScore[tv[0]] + vertexScore[tv[1]] + vertexScore[tv[2]];
+				if (triScore[t] > bestScore) {
+					bestScore = triScore[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	std::copy(output.begin(), output.end(), indices);
+}
+
+// Split into clusters, then sort clusters by how far they face away from the mesh center
+void optimizeOverdraw(unsigned int* indices, size_t indexCount, const float* positions,
+	size_t vertexCount, size_t positionStride, float threshold) {
+	const size_t triCount = indexCount / 3;
+	const unsigned int cacheSize = 16;
+	if (triCount == 0) return;
+
+	auto position = [&](unsigned int v) {
+		const float* p = (const float*)((const unsigned char*)positions + v * positionStride);
+		return glm::vec3(p[0], p[1], p[2]);
+	};
+
+	// Cache misses of each triangle in the input order; a triangle that misses on
+	// all three vertices starts a hard cluster
+	std::vector<size_t> timestamps(vertexCount, 0);
+	size_t time = cacheSize + 1;
+	auto misses = [&](const unsigned int* tri) {
+		unsigned int m = 0;
+		for (int k = 0; k < 3; k++)
+			if (time - timestamps[tri[k]] > cacheSize) {
+				timestamps[tri[k]] = time++;
+				m++;
+			}
+		return m;
+	};
+	std::vector<unsigned int> triMisses(triCount);
+	std::vector<size_t> hard;
+	for (size_t t = 0; t < triCount; t++) {
+		triMisses[t] = misses(indices + t * 3);
+		if (triMisses[t] == 3)
+			hard.push_back(t);
+	}
+	if (hard.empty() || hard[0] != 0)
+		hard.insert(hard.begin(), 0);
+	hard.push_back(triCount);
+
+	// Split hard clusters further while the running ACMR of the piece stays close to
+	// the ACMR of the whole hard cluster
+	std::vector<size_t> clusters;
+	for (size_t h = 0; h + 1 < hard.size(); h++) {
+		size_t begin = hard[h], end = hard[h + 1];
+		size_t clusterMisses = 0;
+		for (size_t t = begin; t < end; t++)
+			clusterMisses += triMisses[t];
+		float limit = threshold * clusterMisses / float(end - begin);
+
+		time += cacheSize + 1;	// Flush the cache
+		clusters.push_back(begin);
+		size_t start = begin, pieceMisses = 0;
+		for (size_t t = begin; t + 1 < end; t++) {
+			pieceMisses += misses(indices + t * 3);
+			if (pieceMisses <= limit * (t - start + 1)) {
+				time += cacheSize + 1;
+				start = t + 1;
+				pieceMisses = 0;
+				clusters.push_back(start);
+			}
+		}
+	}
+	clusters.push_back(triCount);
+
+	// Area-weighted centroid of the mesh and of each cluster, and cluster normals
+	size_t clusterCount = clusters.size() - 1;
+	std::vector<glm::vec3> centroid(clusterCount), normal(clusterCount);
+	std::vector<float> area(clusterCount, 0.0f);
+	glm::vec3 meshCentroid(0.0f);
+	float meshArea = 0.0f;
+	for (size_t c = 0; c < clusterCount; c++) {
+		centroid[c] = normal[c] = glm::vec3(0.0f);
+		for (size_t t = clusters[c]; t < clusters[c + 1]; t++) {
+			glm::vec3 p0 = position(indices[t * 3]), p1 = position(indices[t * 3 + 1]), p2 = position(indices[t * 3 + 2]);
+			glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+			float a = glm::length(n);
+			centroid[c] += (p0 + p1 + p2) * (a / 3.0f);
+			normal[c] += n;
+			area[c] += a;
+		}
+		meshCentroid += centroid[c];
+		meshArea += area[c];
+		if (area[c] > 0.0f)
+			centroid[c] /= area[c];
+	}
+	if (meshArea > 0.0f)
+		meshCentroid /= meshArea;
+
+	std::vector<float> sortKey(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++) {
+		float len = glm::length(normal[c]);
+		sortKey[c] = len > 0.0f ? glm::dot(centroid[c] - meshCentroid, normal[c] / len) : 0.0f;
+	}
+	std::vector<size_t> order(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++)
+		order[c] = c;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sortKey[a] > sortKey[b]; });
+
+	std::vector<unsigned int> output;
+	output.reserve(triCount * 3);
+	for (size_t c : order)
+		output.insert(output.end(), indices + clusters[c] * 3, indices + clusters[c + 1] * 3);
+	std::copy(output.begin(), output.end(), indices);
+}
+
+// Iterate passes of independent collapses, cheapest first, rebuilding the adjacency between passes
+size_t simplifyMesh(unsigned int* destination, const unsigned int* indices, size_t indexCount,
+	const float* positions, size_t vertexCount, size_t positionStride,
+	size_t targetIndexCount, float targetError, float* resultError) {
+	std::vector<unsigned int> tris(indices, indices + indexCount / 3 * 3);
+	float maxError = 0.0f;
+
+	// Merge vertices that share a position into one topological vertex
+	std::vector<glm::vec3> points(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) {
+		const float* p = (const float*)((const unsigned char*)positions + v * positionStride);
+		points[v] = glm::vec3(p[0], p[1], p[2]);
+	}
+	std::vector<unsigned int> posId;
+	size_t posCount = weldVertices(points.data(), vertexCount, sizeof(glm::vec3), posId);
+	std::vector<glm::dvec3> posOf(posCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		posOf[posId[v]] = glm::dvec3(points[v]);
+	points = std::vector<glm::vec3>();
+
+	// Lock seams (more than one vertex used at a position) ...
+	std::vector<unsigned int> wedge(posCount, ~0u);
+	std::vector<bool> locked(posCount, false);
+	for (unsigned int v : tris) {
+		unsigned int p = posId[v];
+		if (wedge[p] == ~0u)
+			wedge[p] = v;
+		else if (wedge[p] != v)
+			locked[p] = true;
+	}
+	// ... and borders and non-manifold edges (directed edges without exactly one twin)
+	{
+		std::vector<uint64_t> edges;
+		edges.reserve(tris.size());
+		for (size_t i = 0; i < tris.size(); i += 3)
+			for (int k = 0; k < 3; k++) {
+				uint64_t a = posId[tris[i + k]], b = posId[tris[i + (k + 1) % 3]];
+				if (a != b) edges.push_back(a << 32 | b);
+			}
+		std::sort(edges.begin(), edges.end());
+		for (size_t i = 0; i < edges.size(); i++) {
+			uint64_t e = edges[i], twin = e << 32 | e >> 32;
+			auto range = std::equal_range(edges.begin(), edges.end(), twin);
+			bool duplicate = (i > 0 && edges[i - 1] == e) || (i + 1 < edges.size() && edges[i + 1] == e);
+			if (range.second - range.first != 1 || duplicate)
+				locked[e >> 32] = locked[e & 0xffffffffu] = true;
+		}
+	}
+
+	// Area-weighted plane quadrics of the adjacent triangles
+	std::vector<Quadric> quadrics(posCount, Quadric());
+	for (size_t i = 0; i < tris.size(); i += 3) {
+		glm::dvec3 p0 = posOf[posId[tris[i]]], p1 = posOf[posId[tris[i + 1]]], p2 = posOf[posId[tris[i + 2]]];
+		glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+		double len = glm::length(n);
+		if (len == 0.0) continue;
+		n /= len;
+		Quadric q = planeQuadric(n, -glm::dot(n, p0), len * 0.5);
+		for (int k = 0; k < 3; k++)
+			addQuadric(quadrics[posId[tris[i + k]]], q);
+	}
+
+	struct Collapse {
+		unsigned int from, to;	// Vertices
+		float error;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<size_t> adjOffset(posCount + 1);
+	std::vector<unsigned int> adjacency;		// Triangles around each position
+	std::vector<unsigned int> remap(vertexCount);
+	std::vector<bool> touched(posCount);
+	std::vector<unsigned int> ring;
+
+	while (tris.size() > targetIndexCount) {
+		size_t triCount = tris.size() / 3;
+
+		std::fill(adjOffset.begin(), adjOffset.end(), 0);
+		for (unsigned int v : tris)
+			adjOffset[posId[v] + 1]++;
+		for (size_t p = 0; p < posCount; p++)
+			adjOffset[p + 1] += adjOffset[p];
+		adjacency.resize(tris.size());
+		{
+			std::vector<size_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+			for (size_t i = 0; i < tris.size(); i++)
+				adjacency[fill[posId[tris[i]]]++] = (unsigned int)(i / 3);
+		}
+
+		// Candidate collapses along every edge, in both directions where allowed
+		collapses.clear();
+		for (size_t i = 0; i < tris.size(); i += 3)
+			for (int k = 0; k < 3; k++) {
+				unsigned int va = tris[i + k], vb = tris[i + (k + 1) % 3];
+				unsigned int pa = posId[va], pb = posId[vb];
+				for (int dir = 0; dir < 2; dir++) {
+					if (!locked[pa]) {
+						Quadric q = quadrics[pa];
+						addQuadric(q, quadrics[pb]);
+						collapses.push_back({ va, vb, (float)std::sqrt(quadricError(q, posOf[pb])) });
+					}
+					std::swap(va, vb);
+					std::swap(pa, pb);
+				}
+			}
+		std::sort(collapses.begin(), collapses.end(),
+			[](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+		// Apply the cheapest collapses that do not interact with each other
+		for (size_t v = 0; v < vertexCount; v++)
+			remap[v] = (unsigned int)v;
+		std::fill(touched.begin(), touched.end(), false);
+		size_t removeGoal = (tris.size() - targetIndexCount) / 3;
+		size_t removed = 0;
+		for (const Collapse& c : collapses) {
+			if (c.error > targetError || removed >= removeGoal)
+				break;
+			unsigned int pa = posId[c.from], pb = posId[c.to];
+			if (touched[pa] || touched[pb])
+				continue;
+
+			// Link condition: the edge may share at most two neighbors, or the collapse pinches the surface
+			ring.clear();
+			for (size_t j = adjOffset[pa]; j < adjOffset[pa + 1]; j++)
+				for (int k = 0; k < 3; k++)
+					ring.push_back(posId[tris[adjacency[j] * 3 + k]]);
+			std::sort(ring.begin(), ring.end());
+			ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+			size_t shared = 0;
+			for (size_t j = adjOffset[pb]; j < adjOffset[pb + 1]; j++)
+				for (int k = 0; k < 3; k++) {
+					unsigned int p = posId[tris[adjacency[j] * 3 + k]];
+					if (p != pa && p != pb && std::binary_search(ring.begin(), ring.end(), p)) {
+						shared++;
+						ring.erase(std::lower_bound(ring.begin(), ring.end(), p));
+					}
+				}
+			if (shared > 2)
+				continue;
+
+			// Reject collapses that flip or nearly flip a remaining triangle
+			bool flips = false;
+			for (size_t j = adjOffset[pa]; j < adjOffset[pa + 1] && !flips; j++) {
+				const unsigned int* t = &tris[adjacency[j] * 3];
+				glm::dvec3 p[3], q[3];
+				bool hasB = false;
+				for (int k = 0; k < 3; k++) {
+					p[k] = q[k] = posOf[posId[t[k]]];
+					if (posId[t[k]] == pa) q[k] = posOf[pb];
+					if (posId[t[k]] == pb) hasB = true;
+				}
+				if (hasB) continue;		// Degenerates and is removed
+				glm::dvec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::dvec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+				flips = glm::dot(n0, n1) <= 0.25 * glm::length(n0) * glm::length(n1);
+			}
+			if (flips)
+				continue;
+
+			// Collapse and keep the neighborhood fixed for the rest of this pass
+			remap[c.from] = c.to;
+			addQuadric(quadrics[pb], quadrics[pa]);
+			for (size_t j = adjOffset[pa]; j < adjOffset[pa + 1]; j++)
+				for (int k = 0; k < 3; k++)
+					touched[posId[tris[adjacency[j] * 3 + k]]] = true;
+			maxError = std::max(maxError, c.error);
+			removed += 2;
+		}
+		if (removed == 0)
+			break;
+
+		// Remap and drop the triangles that became degenerate
+		size_t out = 0;
+		for (size_t t = 0; t < triCount; t++) {
+			unsigned int a = remap[tris[t * 3]], b = remap[tris[t * 3 + 1]], c = remap[tris[t * 3 + 2]];
+			if (posId[a] == posId[b] || posId[b] == posId[c] || posId[c] == posId[a])
+				continue;
+			tris[out++] = a;
+			tris[out++] = b;
+			tris[out++] = c;
+		}
+		tris.resize(out);
+	}
+
+	std::copy(tris.begin(), tris.end(), destination);
+	if (resultError) *resultError = maxError;
+	return tris.size();
+}
+
+// Weld a packed copy of the positions
+size_t weldPositions(const float* positions, size_t vertexCount, size_t positionStride,
+	std::vector<unsigned int>& posId) {
+	const unsigned char* posData = (const unsigned char*)positions;
+	std::vector<glm::vec3> points(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		memcpy(&points[v], posData + v * positionStride, sizeof(glm::vec3));
+	return weldVertices(points.data(), vertexCount, sizeof(glm::vec3), posId);
+}
+
+// Key directed edges by the welded positions of their ends, so that UV and normal
+// seams do not split the surface
+void buildAdjacencyIndices(unsigned int* destination, const unsigned int* indices, size_t indexCount,
+	const unsigned int* posId) {
+	// Opposite vertex of each directed edge a -> b
+	auto edgeKey = [&](unsigned int a, unsigned int b) { return (uint64_t)posId[a] << 32 | posId[b]; };
+	std::unordered_map<uint64_t, unsigned int> opposite;
+	opposite.reserve(indexCount);
+	for (size_t i = 0; i + 2 < indexCount; i += 3)
+		for (int e = 0; e < 3; e++)
+			opposite.emplace(edgeKey(indices[i + e], indices[i + (e + 1) % 3]), indices[i + (e + 2) % 3]);
+
+	// Neighbours share the reversed edge; a border edge gets its own triangle's third vertex
+	for (size_t i = 0; i + 2 < indexCount; i += 3)
+		for (int e = 0; e < 3; e++) {
+			unsigned int a = indices[i + e], b = indices[i + (e + 1) % 3], c = indices[i + (e + 2) % 3];
+			auto it = opposite.find(edgeKey(b, a));
+			destination[i * 2 + e * 2] = a;
+			destination[i * 2 + e * 2 + 1] = it != opposite.end() ? it->second : c;
+		}
+}
+
+// Accumulate unnormalized face normals per welded position, then find the face that
+// leans furthest from the average
+void computeOutlineNormals(glm::vec4* destination, const unsigned int* indices, size_t indexCount,
+	const float* positions, size_t vertexCount, size_t positionStride,
+	const unsigned int* posId, size_t posCount) {
+	const unsigned char* posData = (const unsigned char*)positions;
+	auto point = [&](unsigned int v) {
+		glm::vec3 p;
+		memcpy(&p, posData + v * positionStride, sizeof(glm::vec3));
+		return p;
+	};
+
+	std::vector<glm::vec3> normals(posCount, glm::vec3(0.0f));
+	for (size_t i = 0; i + 2 < indexCount; i += 3) {
+		glm::vec3 a = point(indices[i]), b = point(indices[i + 1]), c = point(indices[i + 2]);
+		glm::vec3 n = glm::cross(b - a, c - a);
+		for (int k = 0; k < 3; k++)
+			normals[posId[indices[i + k]]] += n;
+	}
+	for (auto& n : normals) {
+		float len = glm::length(n);
+		n = len > 0.0f ? n / len : glm::vec3(0.0f);
+	}
+
+	// Offsetting by w along the average normal moves each face by w * cos(angle)
+	std::vector<float> minCos(posCount, 1.0f);
+	for (size_t i = 0; i + 2 < indexCount; i += 3) {
+		glm::vec3 a = point(indices[i]), b = point(indices[i + 1]), c = point(indices[i + 2]);
+		glm::vec3 n = glm::cross(b - a, c - a);
+		float len = glm::length(n);
+		if (len == 0.0f)
+			continue;
+		for (int k = 0; k < 3; k++) {
+			unsigned int p = posId[indices[i + k]];
+			minCos[p] = std::min(minCos[p], glm::dot(normals[p], n / len));
+		}
+	}
+	for (size_t v = 0; v < vertexCount; v++)
+		destination[v] = glm::vec4(normals[posId[v]], 1.0f / std::max(minCos[posId[v]], 0.5f));
+}
+
+// Project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the diagonals
+void encodeOctahedral(glm::vec3 n, int16_t out[2]) {
+	float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	glm::vec2 e = l1 > 0.0f ? glm::vec2(n.x, n.y) / l1 : glm::vec2(0.0f);
+	if (n.z < 0.0f) {
+		glm::vec2 s(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+		e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * s;
+	}
+	for (int i = 0; i < 2; i++)
+		out[i] = (int16_t)std::lround(glm::clamp(e[i], -1.0f, 1.0f) * 32767.0f);
+}
+
+// Flat axes of the box quantize to 0
+void quantizePosition(glm::vec3 p, glm::vec3 minBB, glm::vec3 maxBB, uint16_t out[3]) {
+	glm::vec3 extent = maxBB - minBB;
+	for (int i = 0; i < 3; i++) {
+		float t = extent[i] > 0.0f ? (p[i] - minBB[i]) / extent[i] : 0.0f;
+		out[i] = (uint16_t)std::lround(glm::clamp(t, 0.0f, 1.0f) * 65535.0f);
+	}
+}
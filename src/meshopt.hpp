@@ -0,0 +1,91 @@
+#ifndef MESHOPT_HPP
+#define MESHOPT_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Mesh processing passes that work on raw vertex data and triangle index lists,
+// independent of the vertex format and of OpenGL.
+
+// Find identical vertices (bitwise comparison of "stride" bytes) with a hash table.
+// remap[i] receives the index of the first vertex equal to vertex i, numbered in
+// order of first appearance. Returns the number of unique vertices.
+size_t weldVertices(const void* vertices, size_t count, size_t stride, std::vector<unsigned int>& remap);
+
+// Gather the unique vertices of a remap table into a new array
+template <typename T>
+std::vector<T> remapVertices(const T* vertices, size_t count, const std::vector<unsigned int>& remap, size_t uniqueCount) {
+	std::vector<T> out(uniqueCount);
+	for (size_t i = 0; i < count; i++)
+		out[remap[i]] = vertices[i];
+	return out;
+}
+
+// Post-transform vertex cache statistics of a triangle list
+struct VertexCacheStats {
+	float acmr;		// Average cache miss ratio: transformed vertices per triangle (0.5 - 3)
+	float atvr;		// Average transformed vertex ratio: transformed vertices per vertex (1 = optimal)
+};
+
+// Simulate a FIFO post-transform cache of cacheSize entries over a triangle list
+VertexCacheStats analyzeVertexCache(const unsigned int* indices, size_t indexCount,
+	size_t vertexCount, unsigned int cacheSize = 16);
+
+// Reorder triangles in place for the post-transform vertex cache (Forsyth's
+// linear-speed algorithm, scored for a 32-entry LRU cache)
+void optimizeVertexCache(unsigned int* indices, size_t indexCount, size_t vertexCount);
+
+// Reorder clusters of a cache-optimized triangle list in place so that outward-facing
+// clusters are drawn first and hide the clusters behind them (Sander et al., "Fast
+// Triangle Reordering for Vertex Locality and Reduced Overdraw"). Clusters are split
+// where the vertex cache restarts anyway, or where splitting keeps the ACMR within
+// "threshold" times that of the input. positions points to the x, y, z floats of the
+// first vertex; consecutive vertices are positionStride bytes apart.
+void optimizeOverdraw(unsigned int* indices, size_t indexCount, const float* positions,
+	size_t vertexCount, size_t positionStride, float threshold = 1.05f);
+
+// Simplify a triangle list by quadric-error half-edge collapses (Garland & Heckbert)
+// until it has at most targetIndexCount indices or the next collapse would move the
+// surface by more than targetError (in position units). Vertices are expected to be
+// unique by attribute; vertices sharing a position form one topological vertex, which
+// is locked when its attributes differ across its triangles (UV or normal seam) or
+// when it lies on a border. Collapses never interpolate attributes, and collapses that
+// flip a triangle are rejected. destination may alias indices. Returns the new index
+// count; resultError receives the largest error introduced.
+size_t simplifyMesh(unsigned int* destination, const unsigned int* indices, size_t indexCount,
+	const float* positions, size_t vertexCount, size_t positionStride,
+	size_t targetIndexCount, float targetError, float* resultError = nullptr);
+
+// Number the distinct positions of a vertex array: posId receives the number of each
+// vertex's position, so vertices split only by UV or normal get the same one. Returns
+// the count of distinct positions.
+size_t weldPositions(const float* positions, size_t vertexCount, size_t positionStride,
+	std::vector<unsigned int>& posId);
+
+// Build a GL_TRIANGLES_ADJACENCY index list (6 indices per triangle: v0, n01, v1, n12,
+// v2, n20) from a triangle list, where nAB is the third vertex of the triangle across
+// edge AB. Triangles are matched by position (posId from weldPositions), so seams do not
+// break adjacency; a border edge gets the triangle's own third vertex. destination
+// receives 2 * indexCount indices.
+void buildAdjacencyIndices(unsigned int* destination, const unsigned int* indices, size_t indexCount,
+	const unsigned int* posId);
+
+// Build outline normals for an inverted hull: per vertex, the area-weighted normal of
+// all triangles around its position (so the hull does not split at hard edges and
+// seams) in xyz, and in w the thickness factor that keeps the hull at the outline
+// width from every face around the vertex (1 on flat areas, at most 2 at sharp
+// creases). Unreferenced vertices get a zero normal. posId and posCount come from
+// weldPositions. destination receives vertexCount records.
+void computeOutlineNormals(glm::vec4* destination, const unsigned int* indices, size_t indexCount,
+	const float* positions, size_t vertexCount, size_t positionStride,
+	const unsigned int* posId, size_t posCount);
+
+// Octahedral encoding of a direction into two 16-bit snorm values (zero vectors map to +z)
+void encodeOctahedral(glm::vec3 n, int16_t out[2]);
+
+// Quantize a position to 16-bit unorm coordinates within a bounding box
+void quantizePosition(glm::vec3 p, glm::vec3 minBB, glm::vec3 maxBB, uint16_t out[3]);
+
+#endif
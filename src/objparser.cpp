@@ -0,0 +1,340 @@
+#define NOMINMAX
+#include "objparser.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include "parallel.hpp"
+
+namespace {
+
+// Where the text being parsed came from (for error messages)
+struct ObjSource {
+	const char* fileBegin;
+	const std::string& filename;
+};
+
+// Powers of ten that are exactly representable as doubles
+const double pow10Table[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+// End of the line that contains p (position of the '\n', or end)
+inline const char* lineEnd(const char* p, const char* end) {
+	const char* nl = (const char*)memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+	while (p < end && isBlank(*p)) p++;
+	return p;
+}
+
+// Parse a decimal number such as "-1.25e-3" starting at p.
+// Returns the position just past the number, or nullptr if there is none.
+const char* parseFloat(const char* p, const char* end, float& out) {
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = *p == '-';
+		p++;
+	}
+
+	// Accumulate up to 19 significant digits into an integer mantissa
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0;
+	bool any = false;
+	for (; p < end && isDigit(*p); p++, any = true) {
+		if (digits < 19) {
+			mant = mant * 10 + (*p - '0');
+			if (mant) digits++;
+		} else
+			exp10++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && isDigit(*p); p++, any = true) {
+			if (digits < 19) {
+				mant = mant * 10 + (*p - '0');
+				if (mant) digits++;
+				exp10--;
+			}
+		}
+	}
+	if (!any) return nullptr;
+
+	// Optional exponent
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		bool expNeg = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			expNeg = *q == '-';
+			q++;
+		}
+		if (q < end && isDigit(*q)) {
+			int e = 0;
+			for (; q < end && isDigit(*q); q++)
+				if (e < 100000) e = e * 10 + (*q - '0');
+			exp10 += expNeg ? -e : e;
+			p = q;
+		}
+	}
+
+	double value = (double)mant;
+	if (exp10 < 0)
+		value = exp10 >= -22 ? value / pow10Table[-exp10] : value / std::pow(10.0, -exp10);
+	else if (exp10 > 0)
+		value = exp10 <= 22 ? value * pow10Table[exp10] : value * std::pow(10.0, exp10);
+	out = (float)(neg ? -value : value);
+	return p;
+}
+
+// Parse a (possibly negative) decimal integer starting at p.
+// Returns the position just past the number, or nullptr if there is none.
+const char* parseInt(const char* p, const char* end, long long& out) {
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = *p == '-';
+		p++;
+	}
+	if (p >= end || !isDigit(*p)) return nullptr;
+	long long value = 0;
+	for (; p < end && isDigit(*p); p++)
+		if (value < (1LL << 40)) value = value * 10 + (*p - '0');
+	out = neg ? -value : value;
+	return p;
+}
+
+// Throw an error pointing at the line containing p
+[[noreturn]] void parseError(const ObjSource& src, const char* p, const char* reason) {
+	size_t line = 1;
+	for (const char* c = src.fileBegin; c < p; c++)
+		if (*c == '\n') line++;
+	std::stringstream ss;
+	ss << "Error reading " << src.filename << ": line " << line << ": " << reason;
+	throw std::runtime_error(ss.str());
+}
+
+// Parse n whitespace-separated floats of a "v", "vt" or "vn" record
+template <int N>
+void parseFloats(const char* p, const char* end, float* out, const ObjSource& src) {
+	for (int i = 0; i < N; i++) {
+		p = parseFloat(skipBlanks(p, end), end, out[i]);
+		if (!p) parseError(src, end, "expected a number");
+	}
+}
+
+// Turn a 1-based (or negative, relative) OBJ index into a 0-based index
+inline unsigned int resolveIndex(long long idx, size_t defined, size_t total,
+	const ObjSource& src, const char* p) {
+	long long resolved = idx > 0 ? idx - 1 : (long long)defined + idx;
+	if (idx == 0 || resolved < 0 || resolved >= (long long)total)
+		parseError(src, p, "face index out of range");
+	return (unsigned int)resolved;
+}
+
+// Number of corners listed on a face line
+size_t countCorners(const char* p, const char* end) {
+	size_t n = 0;
+	while (true) {
+		p = skipBlanks(p, end);
+		if (p >= end || *p == '#') break;
+		n++;
+		while (p < end && !isBlank(*p)) p++;
+	}
+	return n;
+}
+
+// Parse the v/vt/vn corners of a face line, calling emit(first, previous, corner) for
+// each triangle of its fan. "at" gives the records that precede the line in the file.
+template <typename Emit>
+void parseFace(const char* lineStart, const char* eol, const ObjCounts& at, const ObjCounts& total,
+	const ObjSource& src, Emit&& emit) {
+	glm::uvec3 first, prev;
+	int n = 0;
+	const char* q = lineStart + 2;
+	while (true) {
+		q = skipBlanks(q, eol);
+		if (q >= eol || *q == '#') break;
+
+		long long v, t, vn;
+		q = parseInt(q, eol, v);
+		if (q && q < eol && *q == '/') q = parseInt(q + 1, eol, t); else q = nullptr;
+		if (q && q < eol && *q == '/') q = parseInt(q + 1, eol, vn); else q = nullptr;
+		if (!q || (q < eol && !isBlank(*q)))
+			parseError(src, lineStart, "face corners must be v/vt/vn index triples");
+
+		glm::uvec3 corner(
+			resolveIndex(v, at.positions, total.positions, src, lineStart),
+			resolveIndex(t, at.uvs, total.uvs, src, lineStart),
+			resolveIndex(vn, at.normals, total.normals, src, lineStart));
+		if (n == 0)
+			first = corner;
+		else if (n >= 2)
+			emit(first, prev, corner);
+		prev = corner;
+		n++;
+	}
+}
+
+// Parse the records in [begin, end) into arrays that are already sized to hold them.
+// "at" gives the number of records of each kind that precede begin in the file.
+void fillObj(const char* begin, const char* end, ObjData& obj, ObjCounts at,
+	const ObjCounts& total, glm::vec3& minBB, glm::vec3& maxBB, const ObjSource& src, bool keepCorners) {
+	const char* p = begin;
+	while (p < end) {
+		const char* lineStart = skipBlanks(p, end);
+		const char* eol = lineEnd(lineStart, end);
+		p = eol + 1;
+		if (eol - lineStart < 2) continue;
+
+		const char c0 = lineStart[0], c1 = lineStart[1];
+		if (c0 == 'v' && isBlank(c1)) {
+			// Position
+			glm::vec3& vert = obj.positions[at.positions++];
+			parseFloats<3>(lineStart + 2, eol, &vert.x, src);
+			minBB = glm::min(minBB, vert);
+			maxBB = glm::max(maxBB, vert);
+		}
+		else if (c0 == 'v' && c1 == 't') {
+			// Texture coordinates
+			parseFloats<2>(lineStart + 2, eol, &obj.uvs[at.uvs++].x, src);
+		}
+		else if (c0 == 'v' && c1 == 'n') {
+			// Normal
+			parseFloats<3>(lineStart + 2, eol, &obj.normals[at.normals++].x, src);
+		}
+		else if (c0 == 'f' && isBlank(c1)) {
+			// Face: v/vt/vn corners, split into a triangle fan for ngons
+			parseFace(lineStart, eol, at, total, src, [&](glm::uvec3 a, glm::uvec3 b, glm::uvec3 c) {
+				if (!keepCorners)
+					return;
+				obj.corners[at.corners++] = a;
+				obj.corners[at.corners++] = b;
+				obj.corners[at.corners++] = c;
+			});
+		}
+	}
+}
+
+}
+
+// Count the records in [begin, end)
+ObjCounts countObj(const char* begin, const char* end) {
+	ObjCounts counts;
+	const char* p = begin;
+	while (p < end) {
+		const char* lineStart = skipBlanks(p, end);
+		const char* eol = lineEnd(lineStart, end);
+		p = eol + 1;
+		if (eol - lineStart < 2) continue;
+
+		const char c0 = lineStart[0], c1 = lineStart[1];
+		if (c0 == 'v' && isBlank(c1))
+			counts.positions++;
+		else if (c0 == 'v' && c1 == 't')
+			counts.uvs++;
+		else if (c0 == 'v' && c1 == 'n')
+			counts.normals++;
+		else if (c0 == 'f' && isBlank(c1)) {
+			size_t n = countCorners(lineStart + 2, eol);
+			if (n >= 3) counts.corners += 3 * (n - 2);
+		}
+	}
+	return counts;
+}
+
+// Parse a whole OBJ file held in memory
+void parseObj(const char* begin, const char* end, ObjData& obj, const std::string& filename,
+	unsigned int threads, bool keepCorners) {
+	ObjSource src{ begin, filename };
+
+	// Split the text into chunks that start at the beginning of a line
+	std::vector<const char*> bounds(1, begin);
+	threads = std::max(1u, threads);
+	for (unsigned int t = 1; t < threads; t++) {
+		const char* p = std::max(bounds.back(), begin + (end - begin) * t / threads);
+		if (p > begin && p < end && p[-1] != '\n')
+			p = std::min(lineEnd(p, end) + 1, end);
+		if (p < end && p > bounds.back())
+			bounds.push_back(p);
+	}
+	bounds.push_back(end);
+	unsigned int chunks = (unsigned int)bounds.size() - 1;
+
+	// Count the records of each chunk; the running totals give each chunk's
+	// offset into the output arrays and the base for its relative indices
+	std::vector<ObjCounts> offsets(chunks + 1);
+	parallelFor(chunks, chunks, [&](size_t first, size_t last, unsigned int) {
+		for (size_t c = first; c < last; c++)
+			offsets[c + 1] = countObj(bounds[c], bounds[c + 1]);
+	});
+	for (unsigned int c = 1; c <= chunks; c++) {
+		offsets[c].positions += offsets[c - 1].positions;
+		offsets[c].uvs += offsets[c - 1].uvs;
+		offsets[c].normals += offsets[c - 1].normals;
+		offsets[c].corners += offsets[c - 1].corners;
+	}
+	const ObjCounts& total = offsets[chunks];
+
+	// Size the arrays exactly, then fill every chunk's slice in place
+	obj.positions.resize(total.positions);
+	obj.uvs.resize(total.uvs);
+	obj.normals.resize(total.normals);
+	obj.corners.resize(keepCorners ? total.corners : 0);
+	obj.cornerCount = total.corners;
+
+	std::vector<glm::vec3> minBBs(chunks, glm::vec3(std::numeric_limits<float>::max()));
+	std::vector<glm::vec3> maxBBs(chunks, glm::vec3(std::numeric_limits<float>::lowest()));
+	parallelFor(chunks, chunks, [&](size_t first, size_t last, unsigned int) {
+		for (size_t c = first; c < last; c++)
+			fillObj(bounds[c], bounds[c + 1], obj, offsets[c], total, minBBs[c], maxBBs[c], src, keepCorners);
+	});
+
+	// Merge the bounding boxes
+	obj.minBB = glm::vec3(std::numeric_limits<float>::max());
+	obj.maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	for (unsigned int c = 0; c < chunks; c++) {
+		obj.minBB = glm::min(obj.minBB, minBBs[c]);
+		obj.maxBB = glm::max(obj.maxBB, maxBBs[c]);
+	}
+}
+
+ObjFaceReader::ObjFaceReader(const char* begin, const char* end, const ObjData& obj, const std::string& filename)
+	: begin(begin), end(end), p(begin), filename(filename) {
+	total.positions = obj.positions.size();
+	total.uvs = obj.uvs.size();
+	total.normals = obj.normals.size();
+	total.corners = obj.cornerCount;
+}
+
+// Count the records passed on the way, for the relative indices of later faces
+void ObjFaceReader::read(std::vector<glm::uvec3>& corners, size_t minCorners) {
+	ObjSource src{ begin, filename };
+	while (p < end && corners.size() < minCorners) {
+		const char* lineStart = skipBlanks(p, end);
+		const char* eol = lineEnd(lineStart, end);
+		p = eol + 1;
+		if (eol - lineStart < 2) continue;
+
+		const char c0 = lineStart[0], c1 = lineStart[1];
+		if (c0 == 'v' && isBlank(c1))
+			at.positions++;
+		else if (c0 == 'v' && c1 == 't')
+			at.uvs++;
+		else if (c0 == 'v' && c1 == 'n')
+			at.normals++;
+		else if (c0 == 'f' && isBlank(c1)) {
+			parseFace(lineStart, eol, at, total, src, [&](glm::uvec3 a, glm::uvec3 b, glm::uvec3 c) {
+				corners.push_back(a);
+				corners.push_back(b);
+				corners.push_back(c);
+			});
+		}
+	}
+}
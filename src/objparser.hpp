@@ -0,0 +1,59 @@
+#ifndef OBJPARSER_HPP
+#define OBJPARSER_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+// Records of a Wavefront OBJ file, with faces split into triangle fans
+struct ObjData {
+	std::vector<glm::vec3> positions;	// "v" records
+	std::vector<glm::vec2> uvs;			// "vt" records
+	std::vector<glm::vec3> normals;		// "vn" records
+	std::vector<glm::uvec3> corners;	// Position, uv and normal index (0-based) of each triangle corner
+	size_t cornerCount = 0;				// Triangle corners in the file (kept in corners or not)
+	glm::vec3 minBB;					// Bounding box of the positions
+	glm::vec3 maxBB;
+};
+
+// Number of records of each kind in (part of) an OBJ file
+struct ObjCounts {
+	size_t positions = 0;
+	size_t uvs = 0;
+	size_t normals = 0;
+	size_t corners = 0;
+};
+
+// Count the records in [begin, end) so the output arrays can be sized up front
+ObjCounts countObj(const char* begin, const char* end);
+
+// Parse the OBJ text in [begin, end) in place, without any per-token allocation.
+// With more than one thread, the text is split into chunks at line boundaries that
+// are counted and parsed in parallel, each writing straight into its slice of the
+// output arrays. Without keepCorners the faces are only checked, and ObjFaceReader reads
+// them later. The filename is only used for error messages.
+void parseObj(const char* begin, const char* end, ObjData& obj, const std::string& filename,
+	unsigned int threads = 1, bool keepCorners = true);
+
+// Reads the triangle corners of an OBJ file in file order, a few faces at a time, so
+// that the corners of the whole file are never held at once. The text must be the one
+// given to parseObj (which checked the faces) and outlive the reader.
+class ObjFaceReader {
+public:
+	ObjFaceReader(const char* begin, const char* end, const ObjData& obj, const std::string& filename);
+
+	// Append the corners of whole faces until "corners" holds at least minCorners or
+	// every face has been read
+	void read(std::vector<glm::uvec3>& corners, size_t minCorners);
+
+protected:
+	const char* begin;
+	const char* end;
+	const char* p;			// Start of the next line to read
+	ObjCounts at;			// Records before p
+	ObjCounts total;		// Records in the file
+	std::string filename;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "occlusioncull.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define OCCLUSIONCULL_SSE
+#include <xmmintrin.h>
+#endif
+
+// Corners closer than this to the eye (in w) are not projected
+static const float NEAR_W = 0.1f;
+
+void OcclusionCuller::resize(int windowWidth, int windowHeight) {
+	width = WIDTH;
+	height = std::max(1, (int)std::lround((double)WIDTH * windowHeight / std::max(windowWidth, 1)));
+	depth.assign((size_t)width * height, 0.0f);
+}
+
+void OcclusionCuller::run(const glm::mat4& viewProj, const std::vector<const Mesh*>& occluders,
+	const CullBounds& bounds, const std::vector<uint8_t>& test, std::vector<uint8_t>& visible) {
+	auto start = std::chrono::steady_clock::now();
+	tested = occluded = 0;
+	if (depth.size() != (size_t)width * height)
+		depth.assign((size_t)width * height, 0.0f);
+	setup(viewProj, occluders);
+	if (!triangles.empty()) {
+		rasterize();
+		for (size_t i = 0; i < bounds.size(); i++) {
+			if (!visible[i] || !test[i])
+				continue;
+			tested++;
+			if (!testBox(viewProj, bounds.getMin(i), bounds.getMax(i))) {
+				visible[i] = 0;
+				occluded++;
+			}
+		}
+	}
+	ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void OcclusionCuller::setup(const glm::mat4& viewProj, const std::vector<const Mesh*>& occluders) {
+	triangles.clear();
+	std::vector<glm::vec4> clip;
+	for (const Mesh* mesh : occluders) {
+		const std::vector<glm::vec3>& positions = mesh->getOccluderVertices();
+		const std::vector<unsigned int>& indices = mesh->getOccluderIndices();
+		for (unsigned int inst = 0; inst < mesh->getInstanceCount(); inst++) {
+			glm::mat4 mvp = viewProj * mesh->getInstanceMat(inst);
+			clip.resize(positions.size());
+			for (size_t v = 0; v < positions.size(); v++)
+				clip[v] = mvp * glm::vec4(positions[v], 1.0f);
+
+			for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+				Triangle t;
+				bool behind = false;
+				for (int c = 0; c < 3; c++) {
+					const glm::vec4& p = clip[indices[i + c]];
+					if (p.w < NEAR_W) {
+						behind = true;
+						break;
+					}
+					t.invW[c] = 1.0f / p.w;
+					t.v[c] = glm::vec2((p.x * t.invW[c] * 0.5f + 0.5f) * width, (p.y * t.invW[c] * 0.5f + 0.5f) * height);
+				}
+				// Keep counter-clockwise (front-facing) triangles in front of the near plane
+				glm::vec2 e1 = t.v[1] - t.v[0], e2 = t.v[2] - t.v[0];
+				if (!behind && e1.x * e2.y - e1.y * e2.x > 0.0f)
+					triangles.push_back(t);
+			}
+		}
+	}
+}
+
+// Edge functions and 1/w are planes over the screen: value = c + dx * x + dy * y at pixel
+// centers. A pixel is covered when all three edge functions are non-negative.
+void OcclusionCuller::rasterize() {
+	std::fill(depth.begin(), depth.end(), 0.0f);
+	for (const Triangle& t : triangles) {
+		float minX = std::min(t.v[0].x, std::min(t.v[1].x, t.v[2].x));
+		float maxX = std::max(t.v[0].x, std::max(t.v[1].x, t.v[2].x));
+		float minY = std::min(t.v[0].y, std::min(t.v[1].y, t.v[2].y));
+		float maxY = std::max(t.v[0].y, std::max(t.v[1].y, t.v[2].y));
+		int xs = std::max((int)std::floor(minX - 0.5f), 0) & ~3;	// Whole groups of 4
+		int xe = std::min((int)std::ceil(maxX - 0.5f), width - 1);
+		int ys = std::max((int)std::floor(minY - 0.5f), 0);
+		int ye = std::min((int)std::ceil(maxY - 0.5f), height - 1);
+		if (xs > xe || ys > ye)
+			continue;
+
+		// Edge k is opposite corner k
+		float ec[3], edx[3], edy[3];
+		for (int k = 0; k < 3; k++) {
+			const glm::vec2& a = t.v[(k + 1) % 3];
+			const glm::vec2& b = t.v[(k + 2) % 3];
+			edx[k] = a.y - b.y;
+			edy[k] = b.x - a.x;
+			ec[k] = -(edx[k] * a.x + edy[k] * a.y);
+		}
+		float area = ec[0] + edx[0] * t.v[0].x + edy[0] * t.v[0].y;
+		float zc = 0.0f, zdx = 0.0f, zdy = 0.0f;
+		for (int k = 0; k < 3; k++) {
+			zc += ec[k] * t.invW[k] / area;
+			zdx += edx[k] * t.invW[k] / area;
+			zdy += edy[k] * t.invW[k] / area;
+		}
+
+		for (int y = ys; y <= ye; y++) {
+			float py = y + 0.5f;
+			float* row = &depth[(size_t)y * width];
+#ifdef OCCLUSIONCULL_SSE
+			const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			const __m128 zero = _mm_setzero_ps();
+			__m128 rowE[3], dxE[3];
+			for (int k = 0; k < 3; k++) {
+				rowE[k] = _mm_set1_ps(ec[k] + edy[k] * py);
+				dxE[k] = _mm_set1_ps(edx[k]);
+			}
+			__m128 rowZ = _mm_set1_ps(zc + zdy * py), dxZ = _mm_set1_ps(zdx);
+			for (int x = xs; x <= xe; x += 4) {
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+				__m128 inside = _mm_cmpge_ps(_mm_add_ps(rowE[0], _mm_mul_ps(dxE[0], px)), zero);
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(rowE[1], _mm_mul_ps(dxE[1], px)), zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(rowE[2], _mm_mul_ps(dxE[2], px)), zero));
+				if (!_mm_movemask_ps(inside))
+					continue;
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 nearer = _mm_max_ps(old, _mm_add_ps(rowZ, _mm_mul_ps(dxZ, px)));
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for (int x = xs; x <= xe; x++) {
+				float px = x + 0.5f;
+				bool inside = true;
+				for (int k = 0; k < 3 && inside; k++)
+					inside = ec[k] + edx[k] * px + edy[k] * py >= 0.0f;
+				if (inside)
+					row[x] = std::max(row[x], zc + zdx * px + zdy * py);
+			}
+#endif
+		}
+	}
+}
+
+// The box is hidden when every pixel of its screen rectangle (grown by a pixel to make up
+// for sampling at pixel centers) holds an occluder nearer than the box's nearest corner
+bool OcclusionCuller::testBox(const glm::mat4& viewProj, const glm::vec3& minBB, const glm::vec3& maxBB) const {
+	glm::vec2 lo(std::numeric_limits<float>::max()), hi(std::numeric_limits<float>::lowest());
+	float boxInvW = 0.0f;
+	for (int c = 0; c < 8; c++) {
+		glm::vec3 corner(c & 1 ? maxBB.x : minBB.x, c & 2 ? maxBB.y : minBB.y, c & 4 ? maxBB.z : minBB.z);
+		glm::vec4 p = viewProj * glm::vec4(corner, 1.0f);
+		if (p.w < NEAR_W)
+			return true;
+		float invW = 1.0f / p.w;
+		glm::vec2 s((p.x * invW * 0.5f + 0.5f) * width, (p.y * invW * 0.5f + 0.5f) * height);
+		lo = glm::min(lo, s);
+		hi = glm::max(hi, s);
+		boxInvW = std::max(boxInvW, invW);
+	}
+	int x0 = std::max((int)std::floor(lo.x) - 1, 0), x1 = std::min((int)std::floor(hi.x) + 1, width - 1);
+	int y0 = std::max((int)std::floor(lo.y) - 1, 0), y1 = std::min((int)std::floor(hi.y) + 1, height - 1);
+	if (x0 > x1 || y0 > y1)
+		return true;
+
+	for (int y = y0; y <= y1; y++) {
+		const float* row = &depth[(size_t)y * width];
+#ifdef OCCLUSIONCULL_SSE
+		const __m128 boxZ = _mm_set1_ps(boxInvW);
+		for (int x = x0 & ~3; x <= x1; x += 4) {
+			// Lanes outside [x0, x1] do not count
+			int lanes = 0xf;
+			if (x < x0) lanes &= 0xf << (x0 - x);
+			if (x + 3 > x1) lanes &= 0xf >> (x + 3 - x1);
+			if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), boxZ)) & lanes)
+				return true;
+		}
+#else
+		for (int x = x0; x <= x1; x++)
+			if (row[x] <= boxInvW)
+				return true;
+#endif
+	}
+	return false;
+}
@@ -0,0 +1,55 @@
+#ifndef OCCLUSIONCULL_HPP
+#define OCCLUSIONCULL_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "frustumcull.hpp"
+
+// Software occlusion culling: the occluder meshes (see Mesh::setOccluder) are rasterized
+// on the CPU into a small depth buffer, four pixels at a time with SSE (one at a time
+// without it), and the screen rectangle of each object's bounding box is then tested
+// against it. The buffer holds 1/w, the inverse view depth, which is linear in screen
+// space; 0 is infinitely far. The buffer is small enough for one thread: a run is a
+// single job, started on a worker while the OpenGL thread draws the shadow pass.
+class OcclusionCuller {
+public:
+	// Buffer size; the height follows the aspect ratio of the window
+	void resize(int windowWidth, int windowHeight);
+
+	// Rasterize every instance of the occluders, then clear visible[i] for each box that
+	// is entirely behind them. Boxes whose visible[i] or test[i] is already 0 are skipped.
+	// Only reads the meshes, so it may run while the OpenGL thread draws them.
+	void run(const glm::mat4& viewProj, const std::vector<const Mesh*>& occluders,
+		const CullBounds& bounds, const std::vector<uint8_t>& test, std::vector<uint8_t>& visible);
+
+	// Statistics of the last run
+	size_t getTriangleCount() const { return triangles.size(); }	// Front-facing occluder triangles
+	size_t getTestedCount() const { return tested; }
+	size_t getOccludedCount() const { return occluded; }
+	double getMs() const { return ms; }		// Time the run took
+
+	static const int WIDTH = 256;	// Buffer width in pixels (a multiple of 4)
+
+protected:
+	// An occluder triangle in buffer pixels, counter-clockwise
+	struct Triangle {
+		glm::vec2 v[3];
+		glm::vec3 invW;		// 1/w at each corner
+	};
+	// Project the occluders' triangles, dropping back faces and those crossing the near plane
+	void setup(const glm::mat4& viewProj, const std::vector<const Mesh*>& occluders);
+	// Rasterize all triangles
+	void rasterize();
+	// Whether a world-space box may be visible
+	bool testBox(const glm::mat4& viewProj, const glm::vec3& minBB, const glm::vec3& maxBB) const;
+
+	int width = WIDTH, height = WIDTH / 2;
+	std::vector<float> depth;			// width * height values of 1/w, bottom row first
+	std::vector<Triangle> triangles;	// Of the current run
+	size_t tested = 0, occluded = 0;
+	double ms = 0.0;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// Number of hardware threads (at least 1)
+inline unsigned int hardwareThreads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Split [0, count) into one contiguous range per task and call fn(begin, end, task)
+// for each range, using up to "tasks" threads. The calling thread runs task 0.
+// Exceptions thrown by any task are rethrown on the calling thread.
+template <typename Fn>
+void parallelFor(size_t count, unsigned int tasks, Fn&& fn) {
+	tasks = (unsigned int)std::min<size_t>(std::max(1u, tasks), std::max<size_t>(count, 1));
+	if (tasks == 1) {
+		fn((size_t)0, count, 0u);
+		return;
+	}
+
+	std::vector<std::exception_ptr> errors(tasks);
+	auto run = [&](unsigned int task) {
+		try {
+			fn(count * task / tasks, count * (task + 1) / tasks, task);
+		} catch (...) {
+			errors[task] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	workers.reserve(tasks - 1);
+	for (unsigned int t = 1; t < tasks; t++)
+		workers.emplace_back(run, t);
+	run(0);
+	for (auto& w : workers)
+		w.join();
+
+	for (auto& e : errors)
+		if (e) std::rethrow_exception(e);
+}
+
+#endif
@@ -0,0 +1,172 @@
+#include "programcache.hpp"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <filesystem>
+#include <system_error>
+#include "util.hpp"
+#include "meshcache.hpp"
+namespace fs = std::filesystem;
+
+namespace {
+
+const char PROGRAMCACHE_MAGIC[8] = "PROGBIN";
+const char* PROGRAMCACHE_DIR = "shaders/cache";
+
+bool useCache = true;
+ProgramCacheStats stats;
+
+// Driver string, or "" if the query fails
+std::string glString(GLenum name) {
+	const GLubyte* str = glGetString(name);
+	return str ? (const char*)str : "";
+}
+
+// Hash of everything a program binary depends on
+uint64_t programKey(const std::vector<ShaderStage>& stages, const std::string& defines) {
+	std::stringstream ss;
+	ss << PROGRAMCACHE_VERSION << '\n' << glString(GL_VENDOR) << '\n' << glString(GL_RENDERER) << '\n'
+		<< glString(GL_VERSION) << '\n' << defines << '\n';
+	for (auto& stage : stages)
+		ss << stage.first << '\n' << readShaderSource(stage.second) << '\n';
+	std::string text = ss.str();
+	return hashBytes(text.data(), text.size());
+}
+
+// shaders/cache/<16 hex digits>.progbin
+std::string programCachePath(uint64_t key) {
+	std::stringstream ss;
+	ss << PROGRAMCACHE_DIR << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".progbin";
+	return ss.str();
+}
+
+// Load a cached binary into a new program; returns 0 if it is missing or rejected
+GLuint readProgramCache(uint64_t key) {
+	std::string path = programCachePath(key);
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return 0;
+
+	ProgramCacheHeader header;
+	if (!file.read((char*)&header, sizeof(header)) ||
+		memcmp(header.magic, PROGRAMCACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != PROGRAMCACHE_VERSION || header.key != key || header.length == 0)
+		return 0;
+	std::vector<char> binary((size_t)header.length);
+	if (!file.read(binary.data(), binary.size()))
+		return 0;
+
+	// The driver may refuse binaries from another build of itself
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, binary.data(), (GLsizei)binary.size());
+	GLint status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+// Write the cache to a temporary file, then move it into place
+void writeProgramCache(uint64_t key, GLuint program) {
+	std::string path = programCachePath(key);
+	std::string tempPath = path + ".tmp";
+	try {
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			throw std::runtime_error("the driver returned no binary");
+		std::vector<char> binary(length);
+		ProgramCacheHeader header = {};
+		glGetProgramBinary(program, length, &length, &header.format, binary.data());
+		memcpy(header.magic, PROGRAMCACHE_MAGIC, sizeof(header.magic));
+		header.version = PROGRAMCACHE_VERSION;
+		header.key = key;
+		header.length = (uint64_t)length;
+
+		fs::create_directories(PROGRAMCACHE_DIR);
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			file.exceptions(std::ios::badbit | std::ios::failbit);
+			file.write((const char*)&header, sizeof(header));
+			file.write(binary.data(), length);
+		}
+		fs::rename(tempPath, path);
+
+	} catch (const std::exception& e) {
+		std::error_code ec;
+		fs::remove(tempPath, ec);
+		std::cerr << "Warning: failed to write program cache " << path << ": " << e.what() << std::endl;
+	}
+}
+
+}
+
+bool programBinarySupported() {
+	static int supported = -1;	// Not queried yet
+	if (supported < 0) {
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		bool available = major > 4 || (major == 4 && minor >= 1);
+		GLint extCount = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extCount);
+		for (GLint i = 0; i < extCount && !available; i++) {
+			const GLubyte* ext = glGetStringi(GL_EXTENSIONS, i);
+			available = ext && strcmp((const char*)ext, "GL_ARB_get_program_binary") == 0;
+		}
+		GLint formats = 0;
+		if (available)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		supported = formats > 0;
+	}
+	return supported != 0;
+}
+
+void setUseProgramCache(bool use) {
+	useCache = use;
+}
+
+bool getUseProgramCache() {
+	return useCache;
+}
+
+GLuint buildProgram(const std::vector<ShaderStage>& stages, const std::string& defines) {
+	auto start = std::chrono::steady_clock::now();
+	bool cached = useCache && programBinarySupported();
+	uint64_t key = cached ? programKey(stages, defines) : 0;
+
+	GLuint program = cached ? readProgramCache(key) : 0;
+	if (program)
+		stats.loaded++;
+	else {
+		// Compile and link shader files
+		std::vector<GLuint> shaders;
+		try {
+			for (auto& stage : stages)
+				shaders.push_back(compileShader(stage.first, stage.second, defines));
+			program = linkProgram(shaders, cached);
+		} catch (...) {
+			for (auto s : shaders)
+				glDeleteShader(s);
+			throw;
+		}
+		// Cleanup extra state
+		for (auto s : shaders)
+			glDeleteShader(s);
+		if (cached)
+			writeProgramCache(key, program);
+		stats.compiled++;
+	}
+
+	stats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return program;
+}
+
+const ProgramCacheStats& getProgramCacheStats() {
+	return stats;
+}
@@ -0,0 +1,51 @@
+#ifndef PROGRAMCACHE_HPP
+#define PROGRAMCACHE_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include "gl_core_3_3.h"
+
+// Binary shader program cache: linked programs saved with glGetProgramBinary as
+// shaders/cache/<key>.progbin, so later runs can load them instead of compiling and
+// linking the GLSL again. The key hashes the stage sources (with their includes), the
+// #defines and the driver's vendor, renderer and version strings; a binary that the
+// driver rejects is rebuilt from source and replaced.
+//
+// File layout: ProgramCacheHeader, followed by length bytes of driver binary.
+struct ProgramCacheHeader {
+	char magic[8];		// "PROGBIN" + NUL
+	uint32_t version;	// PROGRAMCACHE_VERSION
+	uint32_t format;	// Binary format returned by glGetProgramBinary
+	uint64_t key;		// Hash of the sources, defines and driver
+	uint64_t length;	// Bytes of binary
+};
+
+// Bump whenever the layout of the cache changes
+const uint32_t PROGRAMCACHE_VERSION = 1;
+
+// A shader stage: its type and source file
+typedef std::pair<GLenum, std::string> ShaderStage;
+
+// Whether the driver can save programs (OpenGL 4.1 or GL_ARB_get_program_binary,
+// with at least one binary format)
+bool programBinarySupported();
+// Whether to read and write the cache (on by default)
+void setUseProgramCache(bool use);
+bool getUseProgramCache();
+
+// Compile and link the stages with the given #define lines (see compileShader), or load
+// the program from the cache. Uniform values and block bindings are not restored from
+// the cache, so set them after every build.
+GLuint buildProgram(const std::vector<ShaderStage>& stages, const std::string& defines = "");
+
+// Totals over all buildProgram calls
+struct ProgramCacheStats {
+	unsigned int loaded = 0;	// Programs loaded from the cache
+	unsigned int compiled = 0;	// Programs compiled from source
+	double ms = 0.0;			// Time spent in buildProgram
+};
+const ProgramCacheStats& getProgramCacheStats();
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef RENDERQUEUE_HPP
+#define RENDERQUEUE_HPP
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <ostream>
+
+// The draws of a frame, radix-sorted by a 64-bit key before they are submitted, so that
+// draws sharing a program and textures go together and each pass is drawn front to back
+// (the costly fragment shaders are then mostly rejected by the depth test). Key layout,
+// most significant first:
+//   bits 62-63  pass (Pass)
+//   bits 50-61  low bits of the program (GLState feature key; shadow cascade in the shadow
+//               passes), for ordering only: Item::program holds the whole value
+//   bits 42-49  texture set (0 = none, 1 = the model textures)
+//   bits 18-41  depth: distance from the viewer, quantized from [0, 1]
+//   bits  0-17  object index (keeps equal draws in scene order)
+class RenderQueue {
+public:
+	enum Pass {
+		PASS_SHADOW = 0,		// Depth map from the light (the static casters, when cached apart)
+		PASS_SHADOW_MOVING = 1,	// Moving casters over a copy of the static depth map
+		PASS_MAIN = 2,			// Scene from the camera
+		PASS_HULL = 3,			// Inverted hull outlines
+		PASS_COUNT
+	};
+	struct Item {
+		uint64_t key;
+		uint32_t program;	// GLState feature key, or shadow cascade
+		uint32_t object;	// Index in GLState's objects
+		uint32_t lod;		// Level of detail to draw
+		uint32_t firstInstance;	// Run of the object's draw list to draw (see Mesh::setDrawList)
+		uint32_t instanceCount;
+	};
+
+	// Build a key; depth is clamped to [0, 1]
+	static uint64_t makeKey(Pass pass, uint32_t program, uint32_t textureSet, float depth, uint32_t object);
+	static Pass getPass(uint64_t key) { return (Pass)(key >> 62); }
+	static uint32_t getTextureSet(uint64_t key) { return (uint32_t)(key >> 42) & 0xff; }
+
+	// Start a new frame
+	void clear() { items.clear(); }
+	void push(Pass pass, uint32_t program, uint32_t textureSet, float depth, uint32_t object, uint32_t lod,
+		uint32_t firstInstance, uint32_t instanceCount) {
+		items.push_back({ makeKey(pass, program, textureSet, depth, object), program, object, lod,
+			firstInstance, instanceCount });
+	}
+	// Sort the items by key, counting the state changes saved over scene order
+	void sort();
+	const std::vector<Item>& getItems() const { return items; }
+	// Items [first, last) of a pass (after sort)
+	std::pair<size_t, size_t> passRange(Pass pass) const;
+
+	// Count a frame, printing the statistics every reportFrames frames (0 = never)
+	void endFrame(unsigned int reportFrames);
+	void report(std::ostream& ostr) const;
+
+protected:
+	// Program and texture set changes when the items are drawn in their current order
+	void countChanges(unsigned long& programs, unsigned long& textureSets) const;
+
+	std::vector<Item> items;
+	std::vector<Item> scratch;	// Radix sort buffer
+
+	// Statistics since the last report
+	struct Stats {
+		unsigned long draws = 0;
+		unsigned long programChanges = 0;		// In sorted order
+		unsigned long textureChanges = 0;
+		unsigned long sceneProgramChanges = 0;	// In scene order, pass by pass
+		unsigned long sceneTextureChanges = 0;
+		unsigned int frames = 0;
+	} stats;
+};
+
+#endif
@@ -1,47 +1,98 @@
 #include <iostream>
 #include <cassert>
+#include <chrono>
+#include <stdexcept>
+#include <string>
 #include "texture.hpp"
+#include "parallel.hpp"
+#include "glcache.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+Texture::~Texture() {
+	if (decoder.joinable())
+		decoder.join();
+	for (auto& image : images)
+		if (image.data) stbi_image_free(image.data);
+}
+
 void Texture::load() {
-	texModelColor = prepareTexture("textures/ANS_base.png");
-	texModelSss   = prepareTexture("textures/ANS_Sss.png");
-	texModelNrm   = prepareTexture("textures/ANS_nrm.png");
-	texModelIlm   = prepareTexture("textures/ANS_ilm.png");
+	beginLoad();
+	finishLoad(true);
+}
+
+// Decode all images at the same time on a background thread
+void Texture::beginLoad() {
+	images[0].filename = "textures/ANS_base.png";
+	images[1].filename = "textures/ANS_Sss.png";
+	images[2].filename = "textures/ANS_nrm.png";
+	images[3].filename = "textures/ANS_ilm.png";
+	decoder = std::thread([this]() {
+		parallelFor(NUM_IMAGES, NUM_IMAGES, [this](size_t first, size_t last, unsigned int) {
+			for (size_t i = first; i < last; i++)
+				decodeImage(images[i]);
+		});
+		decoded = true;
+	});
+}
+
+// Create the textures from the decoded images
+bool Texture::finishLoad(bool wait) {
+	if (created)
+		return true;
+	if (!decoder.joinable() || (!wait && !decoded))
+		return false;
+	decoder.join();
+
+	auto start = std::chrono::steady_clock::now();
+	texModelColor = prepareTexture(images[0]);
+	texModelSss   = prepareTexture(images[1]);
+	texModelNrm   = prepareTexture(images[2]);
+	texModelIlm   = prepareTexture(images[3]);
+	for (auto& image : images) {
+		std::cout << "Decoded " << image.filename << " in " << image.decodeMs << " ms" << std::endl;
+		if (image.data) stbi_image_free(image.data);
+		image.data = nullptr;
+	}
+	double createMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Created textures in " << createMs << " ms" << std::endl;
+	created = true;
+	return true;
+}
+
+// Read an image file (no OpenGL calls)
+void Texture::decodeImage(Image& image) {
+	auto start = std::chrono::steady_clock::now();
+	image.data = stbi_load(image.filename, &image.width, &image.height, &image.channels, 0);
+	image.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 void Texture::activeTextures() {
-	// Activate the texture unit; more than one texture is allowed to use: GL_TEXTURE0, GL_TEXTURE1, ...
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, texModelColor);  // bind the texture
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, texModelSss);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, texModelNrm);
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, texModelIlm);
+	// Bind each texture to its unit; more than one texture is allowed to use: GL_TEXTURE0, GL_TEXTURE1, ...
+	GLCache::bindTexture(0, texModelColor);
+	GLCache::bindTexture(1, texModelSss);
+	GLCache::bindTexture(2, texModelNrm);
+	GLCache::bindTexture(3, texModelIlm);
 }
 
 void Texture::activeDepthMap() {
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
+	GLCache::bindTexture(4, depthMap, GL_TEXTURE_2D_ARRAY);
 }
 
-unsigned int Texture::prepareTexture(const char* filename) {
+unsigned int Texture::prepareTexture(const Image& image) {
 	GLuint texture;
-	int image_height = 0, image_width = 0, num_channels = 0;
+	const char* filename = image.filename;
+	int image_height = image.height, image_width = image.width, num_channels = image.channels;
+	unsigned char* image_data = image.data;
 
 	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+	GLCache::bindTexture(0, texture);
 	// Sets wrapping and filtering of the texture.
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	// the height&width of the image must be multiples of 4
-	unsigned char* image_data = stbi_load(filename, &image_width, &image_height, &num_channels, 0);
-
 	// Do some simple checking
 	if (image_data == nullptr) {
 		std::cerr << "Image reading failed: " << filename << std::endl;
@@ -88,26 +139,59 @@ unsigned int Texture::prepareTexture(const char* filename) {
 	// Generates mipmapping for better sampling.
 	glGenerateMipmap(GL_TEXTURE_2D);
 
-	stbi_image_free(image_data);
 	assert(glGetError() == GL_NO_ERROR);
 
 	return texture;
 }
 
+void Texture::setShadowMapSize(unsigned int size, unsigned int layers) {
+	shadowSize = size;
+	shadowLayers = layers;
+}
+
 void Texture::prepareDepthMap() {
-	glGenFramebuffers(1, &depthMapFBO);  // Generate a frame buffer
+	createDepthTarget(depthMapFBOs, depthMap);
+}
 
-	glGenTextures(1, &depthMap);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// Attach depth texture to the depth frame buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void Texture::prepareStaticDepthMap() {
+	if (!staticDepthMap)
+		createDepthTarget(staticDepthMapFBOs, staticDepthMap);
+}
+
+void Texture::copyStaticDepthMap(unsigned int layer) {
+	GLCache::bindFramebuffer(depthMapFBOs[layer]);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, staticDepthMapFBOs[layer]);
+	glBlitFramebuffer(0, 0, shadowSize, shadowSize, 0, 0, shadowSize, shadowSize, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, depthMapFBOs[layer]);	// As GLCache expects
+}
+
+void Texture::createDepthTarget(std::vector<GLuint>& fbos, GLuint& texture) {
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (shadowSize > (unsigned int)maxSize)
+		throw std::runtime_error("Shadow map size " + std::to_string(shadowSize) + " is over this driver's limit of "
+			+ std::to_string(maxSize) + " texels");
+	glGenTextures(1, &texture);
+	GLCache::bindTexture(4, texture, GL_TEXTURE_2D_ARRAY);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT, shadowSize, shadowSize, shadowLayers, 0,
+		GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	// Sampling compares against the stored depths and filters the 2x2 results (lit where the
+	// fragment is no farther than the caster)
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// Attach each layer to a depth frame buffer of its own
+	fbos.resize(shadowLayers);
+	glGenFramebuffers((GLsizei)fbos.size(), fbos.data());  // Generate the frame buffers
+	for (unsigned int layer = 0; layer < shadowLayers; layer++) {
+		GLCache::bindFramebuffer(fbos[layer]);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+	}
+	GLCache::bindFramebuffer(0);
 }
@@ -4,12 +4,15 @@
 #define TEXTURE_HPP
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include "gl_core_3_3.h"
 
 class Texture {
 public:
 	Texture() {}
-	~Texture() {}
+	~Texture();
 	// Disallow copy, move, & assignment
 	Texture(const Texture& other) = delete;
 	Texture& operator=(const Texture& other) = delete;
@@ -17,28 +20,62 @@ public:
 	Texture& operator=(Texture&& other) = delete;
 
 	void load();  // Load images (in ./textures/) as textures
+	// Background loading: decode the images on worker threads, then create the textures
+	// on the OpenGL thread. finishLoad returns whether the textures exist; unless
+	// wait is set, it returns false at once while the images are still being decoded.
+	void beginLoad();
+	bool finishLoad(bool wait);
+	// Shadow maps: one layer of a depth texture array per cascade, each size x size texels;
+	// set before prepareDepthMap
+	void setShadowMapSize(unsigned int size, unsigned int layers);
 	void prepareDepthMap();
+	// Second depth map holding only the static shadow casters, which a layer of the depth
+	// map is restored from before the moving casters are drawn over them (created on first use)
+	void prepareStaticDepthMap();
+	void copyStaticDepthMap(unsigned int layer);
 	void activeTextures();
 	void activeDepthMap();
 
 	// Access
 	inline void getShadowWidthHeight(int& width, int&height) const {
-		width = SHADOW_WIDTH;
-		height = SHADOW_HEIGHT;
+		width = shadowSize;
+		height = shadowSize;
 	}
-	inline GLuint getdepthMapFBO() { return depthMapFBO; }
+	inline unsigned int getShadowLayers() const { return shadowLayers; }
+	inline GLuint getdepthMapFBO(unsigned int layer) { return depthMapFBOs[layer]; }
+	inline GLuint getStaticDepthMapFBO(unsigned int layer) { return staticDepthMapFBOs[layer]; }
 
 protected:
-	GLuint texModelColor; // Model color texture
-	GLuint texModelSss; 	 // Model tint texture
-	GLuint texModelNrm; 	 // Model normal texture
-	GLuint texModelIlm; 	 // Model inner line Texture
+	GLuint texModelColor = 0; // Model color texture
+	GLuint texModelSss = 0; 	 // Model tint texture
+	GLuint texModelNrm = 0; 	 // Model normal texture
+	GLuint texModelIlm = 0; 	 // Model inner line Texture
 
-	const unsigned int SHADOW_WIDTH = 2048, SHADOW_HEIGHT = 2048;  // depth map resolution
-	GLuint depthMapFBO = 0;  // depth map as frame buffer
+	// Decoded image file
+	struct Image {
+		const char* filename;
+		unsigned char* data = nullptr;	// Pixels from stbi_load (null if decoding failed)
+		int width = 0, height = 0, channels = 0;
+		double decodeMs = 0.0;			// Time spent decoding
+	};
+	static const int NUM_IMAGES = 4;
+	Image images[NUM_IMAGES];
+	std::thread decoder;				// Decodes the images in parallel
+	std::atomic<bool> decoded{ false };	// Whether the decoder is done
+	bool created = false;				// Whether the textures exist
+
+	unsigned int shadowSize = 2048;	// depth map resolution
+	unsigned int shadowLayers = 1;	// Cascades
+	std::vector<GLuint> depthMapFBOs;	// depth map as frame buffers, one per layer
 	GLuint depthMap = 0;     // depth map
+	std::vector<GLuint> staticDepthMapFBOs;	// Static shadow casters only
+	GLuint staticDepthMap = 0;
 
-	unsigned int prepareTexture(const char* filename);
+	static void decodeImage(Image& image);
+	// Create a depth texture array of the shadow map size and a frame buffer drawing into
+	// each layer
+	void createDepthTarget(std::vector<GLuint>& fbos, GLuint& texture);
+	unsigned int prepareTexture(const Image& image);
 };
 
 #endif
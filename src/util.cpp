@@ -3,20 +3,47 @@
 #include <fstream>
 #include "util.hpp"
 
-// Compile a single shader stage
-GLuint compileShader(GLenum type, const std::string& filename) {
-	// Read the file
+// Read a whole text file
+std::string readFile(const std::string& filename) {
 	std::ifstream file(filename);
 	if (!file.is_open()) {
 		std::stringstream ss;
 		ss << "Failed to open " << filename << std::endl;
 		throw std::runtime_error(ss.str());
 	}
-
-	// Read the shader source
 	std::stringstream buffer;
 	buffer << file.rdbuf();
-	std::string bufStr = buffer.str();
+	return buffer.str();
+}
+
+// Included text is source string 1 in errors, and #line directives keep the line numbers
+// of both files
+std::string readShaderSource(const std::string& filename) {
+	std::string dir = filename.substr(0, filename.find_last_of('/') + 1);
+	std::istringstream source(readFile(filename));
+	std::string out, line;
+	for (int number = 1; std::getline(source, line); number++) {
+		if (line.compare(0, 10, "#include \"") == 0 && line.find('"', 10) != std::string::npos) {
+			std::string included = readFile(dir + line.substr(10, line.find('"', 10) - 10));
+			if (!included.empty() && included.back() != '\n')
+				included += '\n';
+			out += "#line 1 1\n" + included + "#line " + std::to_string(number + 1) + " 0\n";
+		} else
+			out += line + '\n';
+	}
+	return out;
+}
+
+// Compile a single shader stage
+GLuint compileShader(GLenum type, const std::string& filename, const std::string& defines) {
+	// Read the shader source
+	std::string bufStr = readShaderSource(filename);
+	// Insert the defines after the #version line, keeping the file's line numbers in errors
+	if (!defines.empty()) {
+		size_t lineEnd = bufStr.compare(0, 8, "#version") == 0 ? bufStr.find('\n') : std::string::npos;
+		size_t at = lineEnd == std::string::npos ? 0 : lineEnd + 1;
+		bufStr.insert(at, defines + "#line " + std::to_string(at ? 2 : 1) + "\n");
+	}
 	const char* bufCStr = bufStr.c_str();
 	GLint length = (GLint)bufStr.length();
 
@@ -37,7 +64,7 @@ GLuint compileShader(GLenum type, const std::string& filename) {
 
 		// Construct an error message with the compile log
 		std::stringstream ss;
-		ss << "Error compiling " << filename << ":" << std::endl << std::endl;
+		ss << "Error compiling " << filename << ":" << std::endl << defines << std::endl;
 		ss << logText.data() << std::endl;
 
 		// Cleanup shader and throw an exception
@@ -49,8 +76,10 @@ GLuint compileShader(GLenum type, const std::string& filename) {
 }
 
 // Link compiled shader stages into a single program
-GLuint linkProgram(std::vector<GLuint>& shaders) {
+GLuint linkProgram(std::vector<GLuint>& shaders, bool retrievable) {
 	GLuint program = glCreateProgram();
+	if (retrievable)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
 	// Attach the shaders and link the program
 	for (auto it = shaders.begin(); it != shaders.end(); ++it)
@@ -5,7 +5,15 @@
 #include <vector>
 #include "gl_core_3_3.h"
 
-GLuint compileShader(GLenum type, const std::string& filename);
-GLuint linkProgram(std::vector<GLuint>& shaders);
+// Read a whole text file
+std::string readFile(const std::string& filename);
+// Read a shader's source, replacing each #include "file" line with that file (from the
+// shader's directory; included files may not include others)
+std::string readShaderSource(const std::string& filename);
+// Compile a shader stage, adding the given #define lines after the #version line
+GLuint compileShader(GLenum type, const std::string& filename, const std::string& defines = "");
+// Link shader stages; retrievable programs can be saved with glGetProgramBinary
+// (only pass true where program binaries are supported)
+GLuint linkProgram(std::vector<GLuint>& shaders, bool retrievable = false);
 
 #endif
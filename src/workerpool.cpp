@@ -0,0 +1,81 @@
+#include "workerpool.hpp"
+
+// Start the worker threads
+WorkerPool::WorkerPool(unsigned int threads) {
+	workers.reserve(threads);
+	for (unsigned int i = 0; i < threads; i++)
+		workers.emplace_back(&WorkerPool::work, this);
+}
+
+// Stop the workers; jobs still queued are dropped (every batch is waited for first)
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& w : workers)
+		w.join();
+}
+
+void WorkerPool::run(Batch& batch, std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batch.pending++;
+		queued.push_back({ &batch, std::move(job) });
+	}
+	wake.notify_one();
+}
+
+// Run the batch's queued jobs here, then sleep until those on workers finish
+void WorkerPool::wait(Batch& batch) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (batch.pending > 0) {
+		auto it = std::find_if(queued.begin(), queued.end(), [&batch](const Job& job) { return job.batch == &batch; });
+		if (it == queued.end()) {
+			done.wait(lock);
+			continue;
+		}
+		Job job = std::move(*it);
+		queued.erase(it);
+		lock.unlock();
+		execute(job);
+		lock.lock();
+	}
+	std::exception_ptr error = batch.error;
+	batch.error = nullptr;
+	lock.unlock();
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void WorkerPool::work() {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() { return stopping || !queued.empty(); });
+			if (stopping)
+				return;
+			job = std::move(queued.front());
+			queued.pop_front();
+		}
+		execute(job);
+	}
+}
+
+void WorkerPool::execute(Job& job) {
+	std::exception_ptr error;
+	try {
+		job.fn();
+	} catch (...) {
+		error = std::current_exception();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (error && !job.batch->error)
+			job.batch->error = error;
+		job.batch->pending--;
+	}
+	done.notify_all();
+}
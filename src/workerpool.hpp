@@ -0,0 +1,81 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+// Persistent worker threads for the per-frame jobs (culling, light assignment), so no
+// frame pays for creating and joining threads. Jobs are run in batches: a batch is
+// waited for as a whole, and the waiting thread runs the batch's queued jobs itself
+// rather than sleeping, so a pool without workers still works (everything runs in wait).
+class WorkerPool {
+public:
+	WorkerPool(unsigned int threads);
+	~WorkerPool();
+	// Disallow copy, move, & assignment
+	WorkerPool(const WorkerPool& other) = delete;
+	WorkerPool& operator=(const WorkerPool& other) = delete;
+	WorkerPool(WorkerPool&& other) = delete;
+	WorkerPool& operator=(WorkerPool&& other) = delete;
+
+	// Jobs waited for together
+	class Batch {
+	public:
+		Batch() {}
+		Batch(const Batch& other) = delete;
+		Batch& operator=(const Batch& other) = delete;
+	protected:
+		friend class WorkerPool;
+		unsigned int pending = 0;		// Jobs queued or running
+		std::exception_ptr error;		// First exception thrown by a job
+	};
+
+	// Queue a job; it runs on a worker, or in wait() if none has taken it by then
+	void run(Batch& batch, std::function<void()> job);
+	// Wait for the batch's jobs, rethrowing the first exception any of them threw
+	void wait(Batch& batch);
+
+	// Split [0, count) into up to "tasks" contiguous ranges and call fn(begin, end, task)
+	// for each, like parallelFor, on the workers and the calling thread
+	template <typename Fn>
+	void parallelFor(size_t count, unsigned int tasks, Fn&& fn) {
+		tasks = (unsigned int)std::min<size_t>(std::max(1u, tasks), std::max<size_t>(count, 1));
+		Batch batch;
+		for (unsigned int t = 1; t < tasks; t++)
+			run(batch, [&fn, count, tasks, t]() { fn(count * t / tasks, count * (t + 1) / tasks, t); });
+		try {
+			fn((size_t)0, count / tasks, 0u);
+		} catch (...) {
+			wait(batch);
+			throw;
+		}
+		wait(batch);
+	}
+
+	unsigned int getThreadCount() const { return (unsigned int)workers.size(); }
+
+protected:
+	struct Job {
+		Batch* batch;
+		std::function<void()> fn;
+	};
+
+	void work();					// Worker thread loop
+	void execute(Job& job);			// Run a job taken from the queue and account for it
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;				// Guards the members below and every batch
+	std::condition_variable wake;	// Signals queued jobs or stopping
+	std::condition_variable done;	// Signals finished jobs
+	std::deque<Job> queued;			// Waiting for a thread
+	bool stopping = false;			// Whether the workers should exit
+};
+
+#endif